@@ -2,10 +2,16 @@
 
 # This script combines all sources into a single '.c' file, so that in can be
 # compiled as a part of a project.
+#
+# Usage: amalgamate.py [dest] (build/petrovich.c by default)
 
 import os.path
+import sys
 pjoin = os.path.join
 
+SOURCES = ['alloc.h', 'alloc.c', 'buffer.h', 'utf8.h', 'utf8.c', 'utf16.h', 'utf16.c', 'cache.h', 'cache.c',
+           'pool.h', 'pool.c', 'petrovich.c', 'handle.c']
+
 def process_file(fname, dest):
     with open(fname, 'r') as f:
         if '.h' in fname:
@@ -19,9 +25,12 @@ def process_file(fname, dest):
             # Should not happen (no '\n')
             if not line:
                 continue
-            # Skip project includes
-            if line[0] == '#' and '"' in line:
-                continue
+            # Skip includes of the combined headers. Others (e.g., the
+            # generated default rules) are kept.
+            if line.startswith('#include') and '"' in line:
+                included = line.split('"')[1]
+                if included == 'petrovich.h' or included in SOURCES:
+                    continue
             # Skip @file doxygen commands
             if '@file' in line:
                 continue
@@ -29,7 +38,10 @@ def process_file(fname, dest):
 
 def main():
     src_dir = os.path.dirname(__file__)
-    dest_file = pjoin(src_dir, 'build', 'petrovich.c')
+    if len(sys.argv) > 1:
+        dest_file = sys.argv[1]
+    else:
+        dest_file = pjoin(src_dir, 'build', 'petrovich.c')
     with open(dest_file, 'w') as dest:
         dest.write('''/// @file petrovich.c
 ///
@@ -37,11 +49,12 @@ def main():
 
 // Note: this file is automatically combined from petrovich-c library sources
 
+#define _POSIX_C_SOURCE 200809L
 #define PETROVICH_NDEBUG
 
 #include "petrovich.h"''')
 
-        for name in ['buffer.h', 'utf8.h', 'utf8.c', 'petrovich.c']:
+        for name in SOURCES:
             full_name = pjoin(src_dir, 'lib', name)
             process_file(full_name, dest)
 
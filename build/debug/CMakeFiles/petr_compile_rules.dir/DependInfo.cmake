@@ -0,0 +1,25 @@
+
+# Consider dependencies only in project.
+set(CMAKE_DEPENDS_IN_PROJECT_ONLY OFF)
+
+# The set of languages for which implicit dependencies are needed:
+set(CMAKE_DEPENDS_LANGUAGES
+  )
+
+# The set of dependency files which are needed:
+set(CMAKE_DEPENDS_DEPENDENCY_FILES
+  "/root/repo/lib/alloc.c" "CMakeFiles/petr_compile_rules.dir/lib/alloc.c.o" "gcc" "CMakeFiles/petr_compile_rules.dir/lib/alloc.c.o.d"
+  "/root/repo/lib/cache.c" "CMakeFiles/petr_compile_rules.dir/lib/cache.c.o" "gcc" "CMakeFiles/petr_compile_rules.dir/lib/cache.c.o.d"
+  "/root/repo/lib/petrovich.c" "CMakeFiles/petr_compile_rules.dir/lib/petrovich.c.o" "gcc" "CMakeFiles/petr_compile_rules.dir/lib/petrovich.c.o.d"
+  "/root/repo/lib/pool.c" "CMakeFiles/petr_compile_rules.dir/lib/pool.c.o" "gcc" "CMakeFiles/petr_compile_rules.dir/lib/pool.c.o.d"
+  "/root/repo/lib/utf16.c" "CMakeFiles/petr_compile_rules.dir/lib/utf16.c.o" "gcc" "CMakeFiles/petr_compile_rules.dir/lib/utf16.c.o.d"
+  "/root/repo/lib/utf8.c" "CMakeFiles/petr_compile_rules.dir/lib/utf8.c.o" "gcc" "CMakeFiles/petr_compile_rules.dir/lib/utf8.c.o.d"
+  "/root/repo/tools/compile_rules.c" "CMakeFiles/petr_compile_rules.dir/tools/compile_rules.c.o" "gcc" "CMakeFiles/petr_compile_rules.dir/tools/compile_rules.c.o.d"
+  )
+
+# Targets to which this target links.
+set(CMAKE_TARGET_LINKED_INFO_FILES
+  )
+
+# Fortran module output directory.
+set(CMAKE_Fortran_TARGET_MODULE_DIR "")
@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/petr_rule_stats.dir/tools/rule_stats.c.o"
+  "CMakeFiles/petr_rule_stats.dir/tools/rule_stats.c.o.d"
+  "petr_rule_stats"
+  "petr_rule_stats.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/petr_rule_stats.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/petr_test.dir/test/test.c.o"
+  "CMakeFiles/petr_test.dir/test/test.c.o.d"
+  "petr_test"
+  "petr_test.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/petr_test.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
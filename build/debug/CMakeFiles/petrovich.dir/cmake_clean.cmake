@@ -0,0 +1,24 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/petrovich.dir/lib/alloc.c.o"
+  "CMakeFiles/petrovich.dir/lib/alloc.c.o.d"
+  "CMakeFiles/petrovich.dir/lib/cache.c.o"
+  "CMakeFiles/petrovich.dir/lib/cache.c.o.d"
+  "CMakeFiles/petrovich.dir/lib/handle.c.o"
+  "CMakeFiles/petrovich.dir/lib/handle.c.o.d"
+  "CMakeFiles/petrovich.dir/lib/petrovich.c.o"
+  "CMakeFiles/petrovich.dir/lib/petrovich.c.o.d"
+  "CMakeFiles/petrovich.dir/lib/pool.c.o"
+  "CMakeFiles/petrovich.dir/lib/pool.c.o.d"
+  "CMakeFiles/petrovich.dir/lib/utf16.c.o"
+  "CMakeFiles/petrovich.dir/lib/utf16.c.o.d"
+  "CMakeFiles/petrovich.dir/lib/utf8.c.o"
+  "CMakeFiles/petrovich.dir/lib/utf8.c.o.d"
+  "default_rules.inc"
+  "libpetrovich.pdb"
+  "libpetrovich.so"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/petrovich.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
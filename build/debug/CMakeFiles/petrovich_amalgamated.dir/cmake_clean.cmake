@@ -0,0 +1,13 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/petrovich_amalgamated.dir/petrovich_amalgamated.c.o"
+  "CMakeFiles/petrovich_amalgamated.dir/petrovich_amalgamated.c.o.d"
+  "default_rules.inc"
+  "libpetrovich_amalgamated.a"
+  "libpetrovich_amalgamated.pdb"
+  "petrovich_amalgamated.c"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/petrovich_amalgamated.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
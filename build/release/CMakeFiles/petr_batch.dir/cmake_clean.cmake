@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/petr_batch.dir/tools/batch.c.o"
+  "CMakeFiles/petr_batch.dir/tools/batch.c.o.d"
+  "petr_batch"
+  "petr_batch.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/petr_batch.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
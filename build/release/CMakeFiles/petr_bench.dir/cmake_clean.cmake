@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/petr_bench.dir/tools/bench.c.o"
+  "CMakeFiles/petr_bench.dir/tools/bench.c.o.d"
+  "petr_bench"
+  "petr_bench.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/petr_bench.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
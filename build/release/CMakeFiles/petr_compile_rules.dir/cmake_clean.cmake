@@ -0,0 +1,23 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/petr_compile_rules.dir/lib/alloc.c.o"
+  "CMakeFiles/petr_compile_rules.dir/lib/alloc.c.o.d"
+  "CMakeFiles/petr_compile_rules.dir/lib/cache.c.o"
+  "CMakeFiles/petr_compile_rules.dir/lib/cache.c.o.d"
+  "CMakeFiles/petr_compile_rules.dir/lib/petrovich.c.o"
+  "CMakeFiles/petr_compile_rules.dir/lib/petrovich.c.o.d"
+  "CMakeFiles/petr_compile_rules.dir/lib/pool.c.o"
+  "CMakeFiles/petr_compile_rules.dir/lib/pool.c.o.d"
+  "CMakeFiles/petr_compile_rules.dir/lib/utf16.c.o"
+  "CMakeFiles/petr_compile_rules.dir/lib/utf16.c.o.d"
+  "CMakeFiles/petr_compile_rules.dir/lib/utf8.c.o"
+  "CMakeFiles/petr_compile_rules.dir/lib/utf8.c.o.d"
+  "CMakeFiles/petr_compile_rules.dir/tools/compile_rules.c.o"
+  "CMakeFiles/petr_compile_rules.dir/tools/compile_rules.c.o.d"
+  "petr_compile_rules"
+  "petr_compile_rules.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/petr_compile_rules.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
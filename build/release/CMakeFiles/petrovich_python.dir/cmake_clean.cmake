@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/petrovich_python.dir/python/module.c.o"
+  "CMakeFiles/petrovich_python.dir/python/module.c.o.d"
+  "petrovich.cpython-311-x86_64-linux-gnu.so"
+  "petrovich.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/petrovich_python.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,24 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/petrovich_static.dir/lib/alloc.c.o"
+  "CMakeFiles/petrovich_static.dir/lib/alloc.c.o.d"
+  "CMakeFiles/petrovich_static.dir/lib/cache.c.o"
+  "CMakeFiles/petrovich_static.dir/lib/cache.c.o.d"
+  "CMakeFiles/petrovich_static.dir/lib/handle.c.o"
+  "CMakeFiles/petrovich_static.dir/lib/handle.c.o.d"
+  "CMakeFiles/petrovich_static.dir/lib/petrovich.c.o"
+  "CMakeFiles/petrovich_static.dir/lib/petrovich.c.o.d"
+  "CMakeFiles/petrovich_static.dir/lib/pool.c.o"
+  "CMakeFiles/petrovich_static.dir/lib/pool.c.o.d"
+  "CMakeFiles/petrovich_static.dir/lib/utf16.c.o"
+  "CMakeFiles/petrovich_static.dir/lib/utf16.c.o.d"
+  "CMakeFiles/petrovich_static.dir/lib/utf8.c.o"
+  "CMakeFiles/petrovich_static.dir/lib/utf8.c.o.d"
+  "default_rules.inc"
+  "libpetrovich.a"
+  "libpetrovich.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/petrovich_static.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
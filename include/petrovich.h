@@ -6,6 +6,7 @@
 #define PETROVICH_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 #define PETR_VISIBLE    __attribute__((visibility("default")))
 
@@ -15,6 +16,7 @@ typedef enum {
         ERR_NOMEM               = -2,   ///< Failed to allocate memory
         ERR_BUF                 = -3,   ///< Output buffer too small
         ERR_FILE                = -4,   ///< Error reading file
+        ERR_INVALID_ARG         = -5,   ///< Invalid argument
 } petr_error_t;
 
 /// Type of name
@@ -38,11 +40,106 @@ typedef enum {
 typedef enum {
         GEND_MALE,
         GEND_FEMALE,
-        GEND_ANDROGYNOUS
+        GEND_ANDROGYNOUS,
+        GEND_UNKNOWN            ///< Infer from the name
 } petr_gender_t;
 
+/// Order of words in a full name
+typedef enum {
+        ORDER_LAST_FIRST_MIDDLE,
+        ORDER_FIRST_MIDDLE_LAST
+} petr_name_order_t;
+
+/// Kind of rule matched for a part of a name
+typedef enum {
+        MATCH_NONE,                     ///< No rule, the part is not inflected
+        MATCH_EXCEPTION,                ///< Rule from the exceptions of the name kind
+        MATCH_SUFFIX                    ///< Rule from the suffixes of the name kind
+} petr_match_kind_t;
+
+/// Rule matched for a hyphen-separated part of a name
+typedef struct {
+        size_t part_off;                ///< Offset of the part in the name
+        size_t part_len;                ///< Length of the part
+        petr_match_kind_t kind;
+        unsigned rule;                  ///< Index of the rule among exceptions or suffixes, in the order of the rules
+        petr_gender_t gender;           ///< Gender the part was matched for
+        const char *test;               ///< First test string of the rule (not NUL-terminated)
+        size_t test_len;                ///< Length of \c test
+} petr_rule_match_t;
+
+/// Nominative form recovered from an inflected name by \c petr_lemmatize
+typedef struct {
+        size_t off;                     ///< Offset of the nominative form in the destination buffer
+        size_t len;                     ///< Length of the nominative form (it is followed by NUL)
+        petr_name_kind_t kind;
+        petr_gender_t gender;           ///< Gender of the rule, \c GEND_ANDROGYNOUS if it applies to any gender
+        petr_case_t name_case;          ///< Case the name is in
+        petr_match_kind_t match;        ///< Kind of the rule, \c MATCH_NONE if the name is taken as nominative
+        unsigned rule;                  ///< Index of the rule among exceptions or suffixes, in the order of the rules
+} petr_lemma_t;
+
+/// Maximum number of hyphen-separated parts of a name prepared by \c petr_prepare_name
+#define PETR_PREPARED_MAX_PARTS         8
+
+/// Number of trailing codepoints of every part decoded by \c petr_prepare_name
+#define PETR_PREPARED_TAIL_LEN          8
+
+/// Part of a prepared name, internal to the library
+typedef struct {
+        uint32_t off;                                   ///< Offset of the part in the name
+        uint32_t len;                                   ///< Length of the part in bytes
+        uint32_t hash;                                  ///< Case-insensitive hash of the part
+        uint32_t tail[PETR_PREPARED_TAIL_LEN];          ///< Case-folded codepoints, from the last one backwards
+        uint8_t tail_off[PETR_PREPARED_TAIL_LEN + 1];   ///< Length in bytes of the last \c i codepoints
+        uint8_t tail_len;                               ///< Number of codepoints in \c tail
+        uint8_t flags;
+} petr_prepared_part_t;
+
+/// Name analyzed once by \c petr_prepare_name, to be inflected for any kind, gender and case
+typedef struct {
+        const char *data;                               ///< Name, not copied
+        size_t len;
+        size_t num_parts;
+        petr_prepared_part_t parts[PETR_PREPARED_MAX_PARTS];
+} petr_prepared_name_t;
+
+/// Counters of the inflection results cache
+typedef struct {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;             ///< Results replaced by other ones
+} petr_cache_stats_t;
+
+/// Memory allocator used for everything a context or a thread pool allocates
+typedef struct {
+        void *(*malloc_fn)(void *user, size_t size);
+        void *(*realloc_fn)(void *user, void *ptr, size_t size);   ///< Must allocate if \c ptr is NULL
+        void (*free_fn)(void *user, void *ptr);                    ///< Never called with NULL
+        void *user;                                                ///< First argument of the functions
+} petr_allocator_t;
+
+/// Description of an error in a rules file
+typedef struct {
+        unsigned line;                  ///< Line of the error, starting from 1, or 0 if unknown
+        unsigned column;                ///< Column of the error in codepoints, starting from 1, or 0 if unknown
+        char message[128];
+} petr_rules_error_t;
+
 typedef struct petr_context petr_context_t;
 
+/// Context holder which allows to replace the context while other threads use it
+typedef struct petr_handle petr_handle_t;
+
+/// Pool of threads for parallel batch inflection
+typedef struct petr_pool petr_pool_t;
+
+/// Context in use by a reader of \c petr_handle_t
+typedef struct {
+        const petr_context_t *ctx;      ///< Context to use until the guard is released
+        unsigned ticket;                ///< Internal state of the read
+} petr_read_guard_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -53,13 +150,75 @@ int petr_init_from_file(const char *path, petr_context_t **pctx);
 PETR_VISIBLE
 int petr_init_from_string(const char *data, size_t len, petr_context_t **pctx);
 
+PETR_VISIBLE
+int petr_init_from_mmap(const char *path, petr_context_t **pctx);
+
+PETR_VISIBLE
+int petr_init_from_file_with_allocator(const char *path, const petr_allocator_t *allocator, petr_context_t **pctx);
+
+PETR_VISIBLE
+int petr_init_from_string_with_allocator(const char *data, size_t len, const petr_allocator_t *allocator,
+                                         petr_context_t **pctx);
+
+PETR_VISIBLE
+int petr_init_from_string_with_error(const char *data, size_t len, const petr_allocator_t *allocator,
+                                     petr_rules_error_t *error, petr_context_t **pctx);
+
+PETR_VISIBLE
+int petr_init_from_mmap_with_allocator(const char *path, const petr_allocator_t *allocator, petr_context_t **pctx);
+
+PETR_VISIBLE
+const petr_context_t *petr_default_context(void);
+
+PETR_VISIBLE
+int petr_save_compiled(const petr_context_t *ctx, const char *path);
+
+PETR_VISIBLE
+int petr_save_compiled_source(const petr_context_t *ctx, const char *path);
+
 PETR_VISIBLE
 void petr_free_context(petr_context_t *ctx);
 
+PETR_VISIBLE
+int petr_enable_cache(petr_context_t *ctx, size_t max_bytes);
+
+PETR_VISIBLE
+void petr_get_cache_stats(const petr_context_t *ctx, petr_cache_stats_t *stats);
+
 PETR_VISIBLE
 int petr_inflect(const petr_context_t *ctx, const char *data, size_t len, petr_name_kind_t kind, petr_gender_t gender,
                  petr_case_t dest_case, char *dest, size_t dest_buf_size, size_t *dest_len);
 
+PETR_VISIBLE
+int petr_inflect_size(const petr_context_t *ctx, const char *data, size_t len, petr_name_kind_t kind,
+                      petr_gender_t gender, petr_case_t dest_case, size_t *size);
+
+PETR_VISIBLE
+int petr_match_rules(const petr_context_t *ctx, const char *data, size_t len, petr_name_kind_t kind,
+                     petr_gender_t gender, petr_rule_match_t *matches, size_t max_matches, size_t *num_matches);
+
+PETR_VISIBLE
+int petr_inflect_infer(const petr_context_t *ctx, const char *data, size_t len, petr_name_kind_t kind,
+                       petr_gender_t gender, petr_case_t dest_case, char *dest, size_t dest_buf_size,
+                       size_t *dest_len, petr_gender_t *res_gender);
+
+PETR_VISIBLE
+int petr_lemmatize(const petr_context_t *ctx, const char *data, size_t len, char *dest, size_t dest_buf_size,
+                   petr_lemma_t *lemmas, size_t max_lemmas, size_t *num_lemmas);
+
+PETR_VISIBLE
+int petr_prepare_name(const char *data, size_t len, petr_prepared_name_t *name);
+
+PETR_VISIBLE
+int petr_inflect_prepared(const petr_context_t *ctx, const petr_prepared_name_t *name, petr_name_kind_t kind,
+                          petr_gender_t gender, petr_case_t dest_case, char *dest, size_t dest_buf_size,
+                          size_t *dest_len);
+
+PETR_VISIBLE
+int petr_inflect_u16(const petr_context_t *ctx, const uint16_t *data, size_t len, petr_name_kind_t kind,
+                     petr_gender_t gender, petr_case_t dest_case, uint16_t *dest, size_t dest_buf_size,
+                     size_t *dest_len);
+
 PETR_VISIBLE
 int petr_inflect_first_name(const petr_context_t *ctx, const char *data, size_t len, petr_gender_t gender,
                             petr_case_t dest_case, char *dest, size_t dest_buf_size, size_t *dest_len);
@@ -72,6 +231,55 @@ PETR_VISIBLE
 int petr_inflect_last_name(const petr_context_t *ctx, const char *data, size_t len, petr_gender_t gender,
                            petr_case_t dest_case, char *dest, size_t dest_buf_size, size_t *dest_len);
 
+PETR_VISIBLE
+int petr_inflect_full_name(const petr_context_t *ctx, const char *data, size_t len, petr_name_order_t order,
+                           petr_gender_t gender, petr_case_t dest_case, char *dest, size_t dest_buf_size,
+                           size_t *dest_len);
+
+PETR_VISIBLE
+int petr_inflect_all_cases(const petr_context_t *ctx, const char *data, size_t len, petr_name_kind_t kind,
+                           petr_gender_t gender, char *dest, size_t dest_buf_size, size_t *dest_offsets);
+
+PETR_VISIBLE
+int petr_inflect_batch(const petr_context_t *ctx, size_t count, const char *names, const size_t *name_offsets,
+                       petr_name_kind_t kind, const petr_gender_t *genders, petr_case_t dest_case, char *dest,
+                       size_t dest_buf_size, size_t *dest_offsets, int *statuses);
+
+PETR_VISIBLE
+int petr_pool_create(unsigned num_threads, petr_pool_t **ppool);
+
+PETR_VISIBLE
+int petr_pool_create_with_allocator(const petr_allocator_t *allocator, unsigned num_threads, petr_pool_t **ppool);
+
+PETR_VISIBLE
+void petr_pool_free(petr_pool_t *pool);
+
+PETR_VISIBLE
+int petr_inflect_batch_parallel(petr_pool_t *pool, const petr_context_t *ctx, size_t count, const char *names,
+                                const size_t *name_offsets, petr_name_kind_t kind, const petr_gender_t *genders,
+                                petr_case_t dest_case, char *dest, size_t dest_buf_size, size_t *dest_offsets,
+                                int *statuses);
+
+PETR_VISIBLE
+int petr_handle_create(petr_context_t *ctx, petr_handle_t **phandle);
+
+PETR_VISIBLE
+void petr_handle_free(petr_handle_t *handle);
+
+PETR_VISIBLE
+void petr_handle_acquire(petr_handle_t *handle, petr_read_guard_t *guard);
+
+PETR_VISIBLE
+void petr_handle_release(petr_handle_t *handle, const petr_read_guard_t *guard);
+
+PETR_VISIBLE
+int petr_handle_swap(petr_handle_t *handle, petr_context_t *ctx);
+
+PETR_VISIBLE
+int petr_handle_inflect(petr_handle_t *handle, const char *data, size_t len, petr_name_kind_t kind,
+                        petr_gender_t gender, petr_case_t dest_case, char *dest, size_t dest_buf_size,
+                        size_t *dest_len);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,94 @@
+/// @file alloc.c
+///
+/// @copyright Copyright (c) Mail.Ru Group, 2016. All rights reserved. MIT License.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+
+void *default_malloc(void *user, size_t size)
+{
+        (void)user;
+        return malloc(size);
+}
+
+void *default_realloc(void *user, void *ptr, size_t size)
+{
+        (void)user;
+        return realloc(ptr, size);
+}
+
+void default_free(void *user, void *ptr)
+{
+        (void)user;
+        free(ptr);
+}
+
+/// Allocator of contexts and pools created without one
+const petr_allocator_t g_default_allocator = DEFAULT_ALLOCATOR;
+
+/// Allocate memory
+///
+/// @returns            The memory, or NULL if out of memory
+void *mem_alloc(const petr_allocator_t *alloc, size_t size)
+{
+        return alloc->malloc_fn(alloc->user, size);
+}
+
+/// Allocate zero-filled memory for an array
+///
+/// @returns            The memory, or NULL if out of memory or the size overflows
+void *mem_calloc(const petr_allocator_t *alloc, size_t count, size_t size)
+{
+        if (size != 0 && count > SIZE_MAX / size)
+                return NULL;
+        void *ptr = alloc->malloc_fn(alloc->user, count * size);
+        if (ptr != NULL)
+                memset(ptr, 0, count * size);
+        return ptr;
+}
+
+/// Resize memory allocated by \c mem_alloc (or allocate it if \c ptr is NULL)
+///
+/// @returns            The memory, or NULL if out of memory (\c ptr stays valid then)
+void *mem_realloc(const petr_allocator_t *alloc, void *ptr, size_t size)
+{
+        return alloc->realloc_fn(alloc->user, ptr, size);
+}
+
+/// Free memory allocated by \c mem_alloc, \c mem_calloc or \c mem_realloc. NULL is ignored.
+void mem_free(const petr_allocator_t *alloc, void *ptr)
+{
+        if (ptr != NULL)
+                alloc->free_fn(alloc->user, ptr);
+}
+
+/// Allocate memory aligned to \c align bytes (a power of 2, at least the size of a pointer)
+///
+/// The allocator gives no alignment guarantees, so the block is over-allocated and the original pointer is kept
+/// right before the aligned one.
+///
+/// @returns            The memory, or NULL if out of memory
+void *mem_alloc_aligned(const petr_allocator_t *alloc, size_t size, size_t align)
+{
+        if (size > SIZE_MAX - align - sizeof(void *))
+                return NULL;
+        char *raw = alloc->malloc_fn(alloc->user, size + align + sizeof(void *));
+        if (raw == NULL)
+                return NULL;
+        uintptr_t addr = ((uintptr_t)raw + sizeof(void *) + align - 1) & ~(uintptr_t)(align - 1);
+        memcpy((char *)addr - sizeof(void *), &raw, sizeof(void *));
+        return (void *)addr;
+}
+
+/// Free memory allocated by \c mem_alloc_aligned. NULL is ignored.
+void mem_free_aligned(const petr_allocator_t *alloc, void *ptr)
+{
+        if (ptr == NULL)
+                return;
+        void *raw;
+        memcpy(&raw, (char *)ptr - sizeof(void *), sizeof(void *));
+        alloc->free_fn(alloc->user, raw);
+}
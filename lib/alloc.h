@@ -0,0 +1,36 @@
+/// @file alloc.h
+///
+/// @copyright Copyright (c) Mail.Ru Group, 2016. All rights reserved. MIT License.
+
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stddef.h>
+#include "petrovich.h"
+
+void *default_malloc(void *user, size_t size);
+
+void *default_realloc(void *user, void *ptr, size_t size);
+
+void default_free(void *user, void *ptr);
+
+/// Allocator used when none is given
+#define DEFAULT_ALLOCATOR       { default_malloc, default_realloc, default_free, NULL }
+
+extern const petr_allocator_t g_default_allocator;
+
+void *mem_alloc(const petr_allocator_t *alloc, size_t size);
+
+void *mem_calloc(const petr_allocator_t *alloc, size_t count, size_t size);
+
+void *mem_realloc(const petr_allocator_t *alloc, void *ptr, size_t size);
+
+void mem_free(const petr_allocator_t *alloc, void *ptr);
+
+void *mem_alloc_aligned(const petr_allocator_t *alloc, size_t size, size_t align);
+
+void mem_free_aligned(const petr_allocator_t *alloc, void *ptr);
+
+const petr_allocator_t *context_allocator(const petr_context_t *ctx);
+
+#endif
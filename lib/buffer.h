@@ -21,6 +21,18 @@ typedef struct {
         size_t len;
 } cbuf_t;
 
+/// Mutable UTF-16 string buffer, the length is in code units
+typedef struct {
+        uint16_t *data;
+        size_t len;
+} u16buf_t;
+
+/// Constant UTF-16 string buffer, the length is in code units
+typedef struct {
+        const uint16_t *data;
+        size_t len;
+} cu16buf_t;
+
 /// Copy \c src buffer to \c dest
 static inline int copy_buf(cbuf_t src, buf_t dest, size_t *dest_len)
 {
@@ -45,4 +57,16 @@ static inline int append_buf(cbuf_t src, buf_t dest, size_t *dest_len)
         return 0;
 }
 
+/// Append \c src UTF-16 buffer to \c dest
+static inline int append_u16buf(cu16buf_t src, u16buf_t dest, size_t *dest_len)
+{
+        if (dest.len < src.len + *dest_len + 1)
+                return ERR_BUF;
+
+        memcpy(dest.data + *dest_len, src.data, src.len * sizeof(uint16_t));
+        (*dest_len) += src.len;
+        dest.data[*dest_len] = 0;
+        return 0;
+}
+
 #endif
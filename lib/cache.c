@@ -0,0 +1,186 @@
+/// @file cache.c
+///
+/// @copyright Copyright (c) Mail.Ru Group, 2016. All rights reserved. MIT License.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "cache.h"
+
+// Every entry is guarded by a sequence lock. Writers make the sequence number odd with a compare-and-swap, update
+// the entry and make it even again; a writer that loses the race simply skips caching. Readers never wait: if the
+// sequence number changed while the entry was being copied out, the lookup counts as a miss. The entries are only
+// written by \c cache_put, the counters live apart from them in slots spread over cache lines by thread, so that
+// lookups of different threads don't write to shared lines.
+
+#define CACHE_LINE_SIZE         64
+#define CACHE_STAT_SLOTS        16
+#define CACHE_MAX_ENTRIES       (1U << 28)
+
+/// Cached result of a single inflection
+typedef struct {
+        uint32_t seq;                   ///< Sequence number, odd while the entry is being written, 0 if unused
+        uint32_t hash;                  ///< Hash of \c key and the name
+        uint32_t key;                   ///< Other inflection parameters, packed by the caller
+        uint16_t name_len;              ///< Length of the name
+        uint8_t res_len;                ///< Length of the result
+        uint8_t extra;                  ///< Additional result value, stored for the caller
+        char data[CACHE_ENTRY_SIZE - 16]; ///< Name followed by the result
+} cache_entry_t;
+
+/// Counters updated by the threads of a single slot
+typedef struct {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+} __attribute__((aligned(CACHE_LINE_SIZE))) cache_stat_slot_t;
+
+struct cache {
+        cache_entry_t *entries;
+        uint32_t mask;                  ///< Number of entries minus 1 (the number is a power of 2)
+        petr_allocator_t allocator;
+        cache_stat_slot_t stats[CACHE_STAT_SLOTS];
+};
+
+/// Counters slot of the calling thread, assigned on its first access to any cache
+static __thread unsigned t_stat_slot = CACHE_STAT_SLOTS;
+
+static cache_stat_slot_t *get_stat_slot(cache_t *cache)
+{
+        static unsigned next_slot;
+        if (t_stat_slot == CACHE_STAT_SLOTS)
+                t_stat_slot = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED) % CACHE_STAT_SLOTS;
+        return &cache->stats[t_stat_slot];
+}
+
+static uint32_t cache_hash(uint32_t key, cbuf_t name)
+{
+        // FNV-1a
+        uint32_t hash = 2166136261UL;
+        for (size_t i = 0; i < name.len; i++)
+                hash = (hash ^ (uint8_t)name.data[i]) * 16777619UL;
+        for (int i = 0; i < 4; i++, key >>= 8)
+                hash = (hash ^ (key & 0xFF)) * 16777619UL;
+        return hash;
+}
+
+/// Create a cache
+///
+/// @param max_bytes    Upper limit of memory used by the cache entries, at least \c CACHE_ENTRY_SIZE
+/// @param allocator    Allocator of the cache memory, copied into the cache
+/// @returns            The cache, or NULL if out of memory
+cache_t *cache_create(size_t max_bytes, const petr_allocator_t *allocator)
+{
+        cache_t *cache = mem_alloc_aligned(allocator, sizeof(cache_t), CACHE_LINE_SIZE);
+        if (cache == NULL)
+                return NULL;
+        memset(cache, 0, sizeof(cache_t));
+        cache->allocator = *allocator;
+
+        size_t num_entries = 1;
+        while (num_entries * 2 * sizeof(cache_entry_t) <= max_bytes && num_entries < CACHE_MAX_ENTRIES)
+                num_entries *= 2;
+        cache->entries = mem_alloc_aligned(allocator, num_entries * sizeof(cache_entry_t), CACHE_LINE_SIZE);
+        if (cache->entries == NULL) {
+                mem_free_aligned(allocator, cache);
+                return NULL;
+        }
+        memset(cache->entries, 0, num_entries * sizeof(cache_entry_t));
+        cache->mask = num_entries - 1;
+        return cache;
+}
+
+/// Free a cache
+void cache_destroy(cache_t *cache)
+{
+        petr_allocator_t allocator = cache->allocator;
+        mem_free_aligned(&allocator, cache->entries);
+        mem_free_aligned(&allocator, cache);
+}
+
+/// Look a result up in the cache
+///
+/// @param key           Inflection parameters other than the name
+/// @param name          Name
+/// @param dest          Destination buffer for the result
+/// @param dest_len      Length of the result (excluding terminating NUL)
+/// @param extra         Destination for the additional value stored with the result
+/// @returns             True on hit. On miss, \c dest may be overwritten.
+bool cache_get(cache_t *cache, uint32_t key, cbuf_t name, buf_t dest, size_t *dest_len, uint8_t *extra)
+{
+        uint32_t hash = cache_hash(key, name);
+        cache_entry_t *entry = &cache->entries[hash & cache->mask];
+
+        uint32_t seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+        bool hit = false;
+        // Fields may be torn by a concurrent writer, so lengths are checked before use
+        size_t name_len = entry->name_len;
+        size_t res_len = entry->res_len;
+        if (seq != 0 && seq % 2 == 0 && entry->hash == hash && entry->key == key && name_len == name.len
+            && name_len + res_len <= sizeof(entry->data) && res_len < dest.len
+            && memcmp(entry->data, name.data, name_len) == 0) {
+                memcpy(dest.data, entry->data + name_len, res_len);
+                *extra = entry->extra;
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                hit = __atomic_load_n(&entry->seq, __ATOMIC_RELAXED) == seq;
+        }
+
+        cache_stat_slot_t *stats = get_stat_slot(cache);
+        if (hit) {
+                dest.data[res_len] = '\0';
+                *dest_len = res_len;
+                __atomic_fetch_add(&stats->hits, 1, __ATOMIC_RELAXED);
+        } else {
+                __atomic_fetch_add(&stats->misses, 1, __ATOMIC_RELAXED);
+        }
+        return hit;
+}
+
+/// Store a result in the cache, replacing the entry with the same hash slot
+///
+/// Results that do not fit into an entry, or entries being written by another thread, are skipped.
+void cache_put(cache_t *cache, uint32_t key, cbuf_t name, cbuf_t result, uint8_t extra)
+{
+        if (name.len + result.len > sizeof(((cache_entry_t *)0)->data) || result.len > UINT8_MAX)
+                return;
+        uint32_t hash = cache_hash(key, name);
+        cache_entry_t *entry = &cache->entries[hash & cache->mask];
+
+        uint32_t seq = __atomic_load_n(&entry->seq, __ATOMIC_RELAXED);
+        if (seq % 2 != 0
+            || !__atomic_compare_exchange_n(&entry->seq, &seq, seq + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                return;
+        // Make the odd sequence number visible before the entry changes
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        // The entry is ours now, so its fields can be read. Rewriting the same result (e.g. after concurrent misses)
+        // evicts nothing.
+        if (seq != 0 && (entry->hash != hash || entry->key != key || entry->name_len != name.len
+                         || memcmp(entry->data, name.data, name.len) != 0))
+                __atomic_fetch_add(&get_stat_slot(cache)->evictions, 1, __ATOMIC_RELAXED);
+
+        entry->hash = hash;
+        entry->key = key;
+        entry->name_len = name.len;
+        entry->res_len = result.len;
+        entry->extra = extra;
+        memcpy(entry->data, name.data, name.len);
+        memcpy(entry->data + name.len, result.data, result.len);
+        // Skip 0, which marks unused entries
+        __atomic_store_n(&entry->seq, seq + 2 == 0 ? 2 : seq + 2, __ATOMIC_RELEASE);
+}
+
+/// Sum up counters of all slots
+void cache_get_stats(const cache_t *cache, petr_cache_stats_t *stats)
+{
+        memset(stats, 0, sizeof(*stats));
+        for (unsigned i = 0; i < CACHE_STAT_SLOTS; i++) {
+                const cache_stat_slot_t *slot = &cache->stats[i];
+                stats->hits += __atomic_load_n(&slot->hits, __ATOMIC_RELAXED);
+                stats->misses += __atomic_load_n(&slot->misses, __ATOMIC_RELAXED);
+                stats->evictions += __atomic_load_n(&slot->evictions, __ATOMIC_RELAXED);
+        }
+}
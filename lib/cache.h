@@ -0,0 +1,28 @@
+/// @file cache.h
+///
+/// @copyright Copyright (c) Mail.Ru Group, 2016. All rights reserved. MIT License.
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "buffer.h"
+
+/// Size of a cache entry, the smallest cache holds a single one
+#define CACHE_ENTRY_SIZE        128
+
+/// Bounded cache of inflection results, safe for concurrent use
+typedef struct cache cache_t;
+
+cache_t *cache_create(size_t max_bytes, const petr_allocator_t *allocator);
+
+void cache_destroy(cache_t *cache);
+
+bool cache_get(cache_t *cache, uint32_t key, cbuf_t name, buf_t dest, size_t *dest_len, uint8_t *extra);
+
+void cache_put(cache_t *cache, uint32_t key, cbuf_t name, cbuf_t result, uint8_t extra);
+
+void cache_get_stats(const cache_t *cache, petr_cache_stats_t *stats);
+
+#endif
@@ -0,0 +1,147 @@
+/// @file handle.c
+///
+/// @copyright Copyright (c) Mail.Ru Group, 2016. All rights reserved. MIT License.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include "petrovich.h"
+#include "alloc.h"
+
+// Readers announce themselves in a counter of the current epoch parity, then load the context. A swap installs the
+// new context, flips the epoch and waits until the counters of the previous parity drain; only then no reader can
+// hold the old context. A reader that sees the epoch change under it backs off and retries, so that late readers
+// of a previous epoch never pass unnoticed. Counters are spread over cache lines by thread to avoid contention.
+
+#define READER_SLOTS            16
+#define CACHE_LINE_SIZE         64
+
+/// Counter of readers in a single slot
+typedef struct {
+        uint64_t count;
+} __attribute__((aligned(CACHE_LINE_SIZE))) reader_slot_t;
+
+struct petr_handle {
+        petr_context_t *ctx;                            ///< Current context
+        uint64_t epoch;                                 ///< Incremented on every swap
+        reader_slot_t readers[2][READER_SLOTS];         ///< Readers by epoch parity and slot
+        char swap_lock;                                 ///< Serializes swaps
+        petr_allocator_t allocator;                     ///< Allocator of the handle, the one of the first context
+};
+
+/// Slot of the calling thread, assigned on its first read
+static __thread unsigned t_reader_slot = READER_SLOTS;
+
+static unsigned get_reader_slot(void)
+{
+        static unsigned next_slot;
+        if (t_reader_slot == READER_SLOTS)
+                t_reader_slot = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED) % READER_SLOTS;
+        return t_reader_slot;
+}
+
+/// Create a handle which allows to replace the context while other threads use it
+///
+/// @param ctx           Library context object, owned by the handle from now on. The handle frees its contexts, so
+///                      it cannot hold the default one.
+/// @param phandle       Handle
+/// @returns             Error code (0, if succeed)
+int petr_handle_create(petr_context_t *ctx, petr_handle_t **phandle)
+{
+        if (ctx == NULL || ctx == petr_default_context())
+                return ERR_INVALID_ARG;
+        const petr_allocator_t *allocator = context_allocator(ctx);
+        petr_handle_t *handle = mem_alloc_aligned(allocator, sizeof(petr_handle_t), CACHE_LINE_SIZE);
+        if (handle == NULL)
+                return ERR_NOMEM;
+        memset(handle, 0, sizeof(petr_handle_t));
+        handle->ctx = ctx;
+        handle->allocator = *allocator;
+        *phandle = handle;
+        return 0;
+}
+
+/// Free the handle and its current context
+///
+/// No other thread may use the handle at this point.
+void petr_handle_free(petr_handle_t *handle)
+{
+        petr_free_context(handle->ctx);
+        petr_allocator_t allocator = handle->allocator;
+        mem_free_aligned(&allocator, handle);
+}
+
+/// Start using the current context of the handle
+///
+/// Never blocks. The context stays valid until \c petr_handle_release is called with the same guard.
+///
+/// @param handle        Handle
+/// @param guard         Destination for the context and the internal state of the read
+void petr_handle_acquire(petr_handle_t *handle, petr_read_guard_t *guard)
+{
+        unsigned slot = get_reader_slot();
+        for (;;) {
+                uint64_t epoch = __atomic_load_n(&handle->epoch, __ATOMIC_SEQ_CST);
+                reader_slot_t *counter = &handle->readers[epoch % 2][slot];
+                __atomic_fetch_add(&counter->count, 1, __ATOMIC_SEQ_CST);
+                if (__atomic_load_n(&handle->epoch, __ATOMIC_SEQ_CST) == epoch) {
+                        guard->ctx = __atomic_load_n(&handle->ctx, __ATOMIC_SEQ_CST);
+                        guard->ticket = (unsigned)(epoch % 2) * READER_SLOTS + slot;
+                        return;
+                }
+                // A swap has started meanwhile
+                __atomic_fetch_sub(&counter->count, 1, __ATOMIC_SEQ_CST);
+        }
+}
+
+/// Stop using the context obtained by \c petr_handle_acquire
+void petr_handle_release(petr_handle_t *handle, const petr_read_guard_t *guard)
+{
+        reader_slot_t *counter = &handle->readers[guard->ticket / READER_SLOTS][guard->ticket % READER_SLOTS];
+        __atomic_fetch_sub(&counter->count, 1, __ATOMIC_RELEASE);
+}
+
+/// Replace the context of the handle
+///
+/// Readers are not blocked: the ones that started before the swap keep using the old context, which is freed once
+/// all of them have released it. Concurrent swaps are serialized.
+///
+/// @param handle        Handle
+/// @param ctx           New library context object, owned by the handle from now on. Cannot be the default one.
+/// @returns             Error code (0, if succeed). On failure the handle and \c ctx are left as they were.
+int petr_handle_swap(petr_handle_t *handle, petr_context_t *ctx)
+{
+        if (ctx == NULL || ctx == petr_default_context())
+                return ERR_INVALID_ARG;
+        while (__atomic_test_and_set(&handle->swap_lock, __ATOMIC_ACQUIRE))
+                sched_yield();
+
+        petr_context_t *old_ctx = __atomic_exchange_n(&handle->ctx, ctx, __ATOMIC_SEQ_CST);
+        uint64_t epoch = __atomic_fetch_add(&handle->epoch, 1, __ATOMIC_SEQ_CST);
+        for (unsigned slot = 0; slot < READER_SLOTS; slot++) {
+                while (__atomic_load_n(&handle->readers[epoch % 2][slot].count, __ATOMIC_SEQ_CST) != 0)
+                        sched_yield();
+        }
+        petr_free_context(old_ctx);
+
+        __atomic_clear(&handle->swap_lock, __ATOMIC_RELEASE);
+        return 0;
+}
+
+/// Inflect a name using the current context of the handle
+///
+/// @see petr_inflect
+int petr_handle_inflect(petr_handle_t *handle, const char *data, size_t len, petr_name_kind_t kind,
+                        petr_gender_t gender, petr_case_t dest_case, char *dest, size_t dest_buf_size,
+                        size_t *dest_len)
+{
+        petr_read_guard_t guard;
+        petr_handle_acquire(handle, &guard);
+        int rc = petr_inflect(guard.ctx, data, len, kind, gender, dest_case, dest, dest_buf_size, dest_len);
+        petr_handle_release(handle, &guard);
+        return rc;
+}
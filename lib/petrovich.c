@@ -2,21 +2,35 @@
 ///
 /// @copyright Copyright (c) Mail.Ru Group, 2016. All rights reserved. MIT License.
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdbool.h>
-
-#include <yaml.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "petrovich.h"
+#include "alloc.h"
 #include "buffer.h"
 #include "utf8.h"
+#include "utf16.h"
+#include "cache.h"
+#include "pool.h"
 
 #define NAME_KIND_COUNT         (NAME_LAST + 1)
 #define GENDER_COUNT            (GEND_ANDROGYNOUS + 1)
 #define CASE_COUNT              (CASE_PREPOSITIONAL + 1)
+#define BATCH_CHUNKS_PER_THREAD 8
+#define BATCH_MIN_CHUNK_ROWS    256
+#define BATCH_INDEX_MAX_SLOTS   2048
+#define BATCH_DEDUP_WINDOW      1024
+#define BATCH_DEDUP_MIN_HITS    64
 
 #if defined(NDEBUG) || defined(PETROVICH_NDEBUG)
 #define debug_err(...) ((void)(0 && printf(__VA_ARGS__)))
@@ -28,586 +42,3360 @@
         } while (0)
 #endif
 
+/// Reference to a string in the strings section of the rules image
+typedef struct {
+        uint32_t off;                   ///< Offset in the strings section
+        uint32_t len;                   ///< Length in bytes
+} str_ref_t;
+
 /// Modification rule for a single case
 typedef struct {
-        size_t cnt_remove;              ///< Number of codepoints to remove
-        cbuf_t add_suffix;              ///< Suffix to add
+        uint32_t suffix_off;            ///< Offset of the suffix to add in the strings section, followed by its
+                                        ///< uppercase copy
+        uint8_t suffix_len;             ///< Length of the suffix in bytes
+        uint8_t cnt_remove;             ///< Number of codepoints to remove
+        uint16_t suffix16_off;          ///< Offset of the UTF-16 copies of the suffix in the UTF-16 suffixes section
 } mod_t;
 
 /// Match rules and modification rules for all cases
 typedef struct {
-        size_t num_matches;             ///< Size of \c match array
-        cbuf_t *match;                  ///< Suffixes (or whole words) to match against
+        uint32_t first_match;           ///< Index of the first suffix (or whole word) to match in the matches section
+        uint32_t num_matches;           ///< Number of suffixes (or whole words) to match against
         mod_t mods[CASE_COUNT - 1];     ///< Modification rules for each case except nominative
-        petr_gender_t gender;           ///< Grammatical gender
-        bool first_word;                ///< If true, only match against first word in multi-word last name
+        uint8_t gender;                 ///< Grammatical gender (\c petr_gender_t)
+        uint8_t first_word;             ///< If true, only match against first word in multi-word last name
+        uint8_t reserved[2];
 } mod_rule_t;
 
 /// Array of mod_rule_t
 typedef struct {
-        size_t num_rules;               ///< Number of rules in array
-        mod_rule_t *rules;              ///< Rules array
+        uint32_t first_rule;            ///< Index of the first rule in the rules section
+        uint32_t num_rules;             ///< Number of rules in array
 } mod_rule_arr_t;
 
-/// Parsed YAML node corresponding to a single mod_rule_t
+/// Sentinel value for "no rule" in \c trie_node_t
+#define NO_RULE                 UINT32_MAX
+
+/// Node of a suffix trie
+typedef struct {
+        uint32_t cp;                            ///< Case-folded codepoint leading to this node
+        uint32_t first_child;                   ///< Index of the first child (children are contiguous, sorted by \c cp)
+        uint16_t num_children;                  ///< Number of children
+        uint8_t gender;                         ///< Gender suggested by the ending at this node or above, or
+                                                ///< \c GEND_UNKNOWN
+        uint8_t reserved;
+        uint32_t best[GENDER_COUNT][2];         ///< First rule matching at this node or above, by gender and first_word
+} trie_node_t;
+
+/// Trie over reversed case-folded codepoints of all suffixes in a \c mod_rule_arr_t
+typedef struct {
+        uint32_t root;                          ///< Index of the root in the trie nodes section
+        uint32_t num_nodes;                     ///< Number of nodes
+} suffix_trie_t;
+
+/// Node of a lemma trie, over reversed case-folded codepoints of the endings that mods give to names
+typedef struct {
+        uint32_t cp;                            ///< Case-folded codepoint leading to this node
+        uint32_t first_child;                   ///< Index of the first child (children are contiguous, sorted by \c cp)
+        uint32_t num_children;                  ///< Number of children
+        uint32_t first_entry;                   ///< Index of the first entry giving the ending spelled by this node
+        uint32_t num_entries;                   ///< Number of such entries
+} lemma_node_t;
+
+/// Mod applied to a test of its rule, giving the ending of a lemma trie node: the test without the codepoints the
+/// mod removes, followed by the suffix it adds
+typedef struct {
+        uint32_t rule;                          ///< Index of the rule in the rules section
+        uint32_t match;                         ///< Index of the test in the matches section
+        uint8_t dest_case;                      ///< Case of the mod (\c petr_case_t)
+        uint8_t suffix_cps;                     ///< Number of codepoints of the suffix added by the mod
+        uint8_t reserved[2];
+} lemma_entry_t;
+
+/// Exception word inflected by a single rule, with \c cnt_remove of every mod converted to bytes
+typedef struct {
+        uint32_t rule;                          ///< Index of the rule containing the word
+        uint32_t keep_len[CASE_COUNT - 1];      ///< Number of leading bytes of the name kept in each case
+} exc_forms_t;
+
+/// Slot of the exceptions hash index
+typedef struct {
+        str_ref_t word;                         ///< Exception word (empty for unused slots)
+        uint32_t hash;                          ///< \c rus_utf8_hash of \c word
+        uint32_t forms[GENDER_COUNT][2];        ///< Index in the exception forms section by gender and first_word
+} exc_slot_t;
+
+/// Case-insensitive hash index over all words of an exceptions array
 typedef struct {
-        petr_gender_t gender;           ///< \c gender property
-        const yaml_node_t *test;        ///< \c test property
-        const yaml_node_t *mods;        ///< \c mods property
-        const yaml_node_t *tags;        ///< \c tags property, optional
-} yaml_mod_rules_t;
+        uint32_t first_slot;                    ///< Index of the first slot in the exception slots section
+        uint32_t num_slots;                     ///< Number of slots (a power of 2)
+} exc_index_t;
 
 /// Set of rules for a single name kind (i.e., first name, last name or middle name)
 typedef struct {
         mod_rule_arr_t suffixes;
         mod_rule_arr_t exceptions;
+        suffix_trie_t suffix_trie;              ///< Compiled \c suffixes
+        exc_index_t exc_index;                  ///< Compiled \c exceptions
+        uint32_t cyrillic_only;                 ///< If true, every suffix and exception has Cyrillic letters
+        suffix_trie_t lemma_trie;               ///< Endings given by the mods of \c exceptions and \c suffixes
 } rules_set_t;
 
+/// Sections of the rules image
+enum {
+        SECT_RULES,                             ///< \c mod_rule_t
+        SECT_MATCHES,                           ///< \c str_ref_t
+        SECT_TRIE_NODES,                        ///< \c trie_node_t
+        SECT_EXC_SLOTS,                         ///< \c exc_slot_t
+        SECT_EXC_FORMS,                         ///< \c exc_forms_t
+        SECT_LEMMA_NODES,                       ///< \c lemma_node_t
+        SECT_LEMMA_ENTRIES,                     ///< \c lemma_entry_t
+        SECT_SUFFIXES_U16,                      ///< UTF-16 suffixes: length in code units, lowercase copy, uppercase
+                                                ///< copy
+        SECT_STRINGS,                           ///< Contents of all strings
+        SECT_COUNT
+};
+
+/// Size of a single element of each section
+static const size_t g_sect_elem_size[SECT_COUNT] = {
+        sizeof(mod_rule_t), sizeof(str_ref_t), sizeof(trie_node_t), sizeof(exc_slot_t), sizeof(exc_forms_t),
+        sizeof(lemma_node_t), sizeof(lemma_entry_t), sizeof(uint16_t), 1,
+};
+
+#define IMAGE_MAGIC             "PETR"
+#define IMAGE_BYTE_ORDER        0x01020304UL
+
+/// Version of the rules image format. Must be incremented on any change of the structures stored in the image.
+#define IMAGE_VERSION           7
+
+/// Location of an image section
+typedef struct {
+        uint32_t off;                           ///< Offset from the beginning of the image, in bytes
+        uint32_t count;                         ///< Number of elements
+} image_section_t;
+
+/// Header of the rules image
+///
+/// The image holds all compiled rules in one position-independent block of memory: all references are offsets or
+/// indices into its sections. So it can be written to a file as is and used in place after mapping it back.
+typedef struct {
+        char magic[4];                          ///< \c IMAGE_MAGIC
+        uint32_t version;                       ///< \c IMAGE_VERSION
+        uint32_t byte_order;                    ///< \c IMAGE_BYTE_ORDER, in byte order of the image
+        uint32_t size;                          ///< Size of the whole image in bytes
+        image_section_t sections[SECT_COUNT];
+        rules_set_t sets[NAME_KIND_COUNT];
+} image_header_t;
+
+/// Where the rules image of a context is stored
+typedef enum {
+        STORAGE_HEAP,                           ///< Allocated on heap
+        STORAGE_MMAP,                           ///< Mapped from a compiled rules file
+        STORAGE_STATIC,                         ///< Compiled into the library
+} storage_t;
+
 /// Complete rules set
 struct petr_context {
-        yaml_document_t yaml;
-        rules_set_t sets[NAME_KIND_COUNT];
+        const image_header_t *image;            ///< Compiled rules
+        storage_t storage;                      ///< Where \c image is stored
+        const mod_rule_t *rules;                ///< Rules section of \c image
+        const str_ref_t *matches;               ///< Matches section of \c image
+        const trie_node_t *trie_nodes;          ///< Trie nodes section of \c image
+        const exc_slot_t *exc_slots;            ///< Exception slots section of \c image
+        const exc_forms_t *exc_forms;           ///< Exception forms section of \c image
+        const lemma_node_t *lemma_nodes;        ///< Lemma trie nodes section of \c image
+        const lemma_entry_t *lemma_entries;     ///< Lemma trie entries section of \c image
+        const uint16_t *suffixes_u16;           ///< UTF-16 suffixes section of \c image
+        const char *strings;                    ///< Strings section of \c image
+        cache_t *cache;                         ///< Cache of inflection results, or NULL
+        petr_allocator_t allocator;             ///< Allocator of the context and everything it owns
 };
 
-/// Initialize library context from the rules file
-///
-/// @param path         Path of the rules YAML file
-/// @param pctx         Pointer to context object (output parameter)
-/// @returns            Error code (0, if succeeded)
-int petr_init_from_file(const char *path, petr_context_t **pctx)
+/// Get a string from the strings section
+static inline cbuf_t get_string(const char *strings, str_ref_t ref)
 {
-        int rc = ERR_FILE;
-        FILE *fp = fopen(path, "r");
-        if (!fp) {
-                debug_err("failed to open rules file");
-                goto out;
-        }
-        fseek(fp, 0, SEEK_END);
-        uint64_t sz = ftell(fp);
-        if (!sz) {
-                debug_err("empty rules file");
-                goto close_file;
-        }
-        fseek(fp, 0, SEEK_SET);
-        char *buf = (char *)malloc(sz);
-        if (!buf) {
-                rc = ERR_NOMEM;
-                goto close_file;
-        }
-        uint64_t cnt_read = fread(buf, 1, sz, fp);
-        if (cnt_read != sz) {
-                debug_err("failed to read rules");
-                goto free_mem;
-        }
-        rc = petr_init_from_string(buf, sz, pctx);
-free_mem:
-        free(buf);
-close_file:
-        fclose(fp);
-out:
-        return rc;
+        cbuf_t res = { strings + ref.off, ref.len };
+        return res;
 }
 
-/// Parse one rule set
-static int parse_mod_rules(petr_context_t *ctx, const yaml_node_t *node, yaml_mod_rules_t *dest)
+/// Get the suffix added by a mod, in uppercase if \c upper is true
+static cbuf_t get_suffix(const petr_context_t *ctx, const mod_t *mod, bool upper)
 {
-        bool have_gender = false;
-        if (node->type != YAML_MAPPING_NODE) {
-                debug_err("node is not a mapping");
-                return ERR_INVALID_RULES;
-        }
-
-        memset(dest, 0, sizeof(yaml_mod_rules_t));
-        for (yaml_node_pair_t *p = node->data.mapping.pairs.start; p != node->data.mapping.pairs.top; p++) {
-                yaml_node_t *key_node = yaml_document_get_node(&ctx->yaml, p->key);
-                yaml_node_t *val_node = yaml_document_get_node(&ctx->yaml, p->value);
-                if (key_node->type != YAML_SCALAR_NODE) {
-                        debug_err("invalid key");
-                        return ERR_INVALID_RULES;
-                }
-
-                const char *key = (const char *)key_node->data.scalar.value;
-                size_t key_len = key_node->data.scalar.length;
-                if (strncmp("gender", key, key_len) == 0) {
-                        if (val_node->type != YAML_SCALAR_NODE) {
-                                debug_err("gender is not a scalar");
-                                return ERR_INVALID_RULES;
-                        }
-                        const char *val = (const char *)val_node->data.scalar.value;
-                        size_t val_len = val_node->data.scalar.length;
-                        if (strncmp("male", val, val_len) == 0) {
-                                dest->gender = GEND_MALE;
-                        } else if (strncmp("female", val, val_len) == 0) {
-                                dest->gender = GEND_FEMALE;
-                        } else if (strncmp("androgynous", val, val_len) == 0) {
-                                dest->gender = GEND_ANDROGYNOUS;
-                        } else {
-                                debug_err("invalid gender '%.*s'", (int)val_len, val);
-                                return ERR_INVALID_RULES;
-                        }
-                        have_gender = true;
-                } else if (strncmp("test", key, key_len) == 0) {
-                        dest->test = val_node;
-                } else if (strncmp("mods", key, key_len) == 0) {
-                        dest->mods = val_node;
-                } else if (strncmp("tags", key, key_len) == 0) {
-                        dest->tags = val_node;
-                } else {
-                        debug_err("unexpected key '%.*s'", (int)key_len, key);
-                        return ERR_INVALID_RULES;
-                }
-        }
-
-        if (!have_gender || dest->test == NULL || dest->mods == NULL) {
-                debug_err("mandatory element missing");
-                return ERR_INVALID_RULES;
-        }
-        return 0;
+        str_ref_t ref = { mod->suffix_off, mod->suffix_len };
+        if (upper)
+                ref.off += ref.len;
+        return get_string(ctx->strings, ref);
 }
 
-/// Load data from one yaml_mod_rules_t instance
-static int load_mod_rules(petr_context_t *ctx, const yaml_mod_rules_t *parsed_node, mod_rule_t *dest)
+/// Get the UTF-16 suffix added by a mod, in uppercase if \c upper is true
+static cu16buf_t get_suffix_u16(const petr_context_t *ctx, const mod_t *mod, bool upper)
 {
-        const yaml_node_t *test = parsed_node->test;
-        if (test->type != YAML_SEQUENCE_NODE) {
-                debug_err("test node is not an array");
-                return ERR_INVALID_RULES;
-        }
+        const uint16_t *entry = &ctx->suffixes_u16[mod->suffix16_off];
+        cu16buf_t res = { entry + 1, entry[0] };
+        if (upper)
+                res.data += res.len;
+        return res;
+}
 
-        size_t num_test = test->data.sequence.items.top - test->data.sequence.items.start;
-        if (num_test == 0) {
-                debug_err("test array is empty");
-                return ERR_INVALID_RULES;
+/// Find the slot of the exceptions index holding the word or the empty slot where it belongs
+///
+/// @returns    Index of the slot relative to \c slots
+static size_t find_exc_slot(const exc_slot_t *slots, size_t num_slots, const char *strings, cbuf_t word,
+                            uint32_t hash)
+{
+        size_t mask = num_slots - 1;
+        for (size_t i = hash & mask;; i = (i + 1) & mask) {
+                const exc_slot_t *slot = &slots[i];
+                if (slot->word.len == 0)
+                        return i;
+                if (slot->hash == hash && slot->word.len == word.len
+                    && rus_utf8_streq(get_string(strings, slot->word), word))
+                        return i;
         }
+}
 
-        dest->gender = parsed_node->gender;
+/// Point context at the sections of a valid rules image
+static void attach_image(petr_context_t *ctx, const image_header_t *image)
+{
+        const char *base = (const char *)image;
+        ctx->image = image;
+        ctx->rules = (const mod_rule_t *)(base + image->sections[SECT_RULES].off);
+        ctx->matches = (const str_ref_t *)(base + image->sections[SECT_MATCHES].off);
+        ctx->trie_nodes = (const trie_node_t *)(base + image->sections[SECT_TRIE_NODES].off);
+        ctx->exc_slots = (const exc_slot_t *)(base + image->sections[SECT_EXC_SLOTS].off);
+        ctx->exc_forms = (const exc_forms_t *)(base + image->sections[SECT_EXC_FORMS].off);
+        ctx->lemma_nodes = (const lemma_node_t *)(base + image->sections[SECT_LEMMA_NODES].off);
+        ctx->lemma_entries = (const lemma_entry_t *)(base + image->sections[SECT_LEMMA_ENTRIES].off);
+        ctx->suffixes_u16 = (const uint16_t *)(base + image->sections[SECT_SUFFIXES_U16].off);
+        ctx->strings = base + image->sections[SECT_STRINGS].off;
+}
 
-        dest->num_matches = num_test;
-        dest->match = calloc(sizeof(cbuf_t), num_test);
-        if (dest->match == NULL) {
-                debug_err("allocation failed");
-                return ERR_NOMEM;
+/// Compute offsets of image sections from their sizes
+///
+/// @param sections     Sections with \c count filled in
+/// @returns            Size of the whole image in bytes
+static size_t layout_sections(image_section_t sections[SECT_COUNT])
+{
+        size_t size = sizeof(image_header_t);
+        for (int i = 0; i < SECT_COUNT; i++) {
+                size = (size + 7) & ~(size_t)7;
+                sections[i].off = size;
+                size += sections[i].count * g_sect_elem_size[i];
         }
+        return size;
+}
 
-        cbuf_t *dest_buf = dest->match;
-        for (yaml_node_item_t *p = test->data.sequence.items.start; p != test->data.sequence.items.top;
-             p++, dest_buf++) {
-                yaml_node_t *node = yaml_document_get_node(&ctx->yaml, *p);
-                if (node->type != YAML_SCALAR_NODE) {
-                        debug_err("invalid node type");
-                        return ERR_INVALID_RULES;
-                }
-
-                dest_buf->data = (const char *)node->data.scalar.value;
-                dest_buf->len = node->data.scalar.length;
-        }
+/// Growable array
+typedef struct {
+        char *data;
+        size_t len;                             ///< Number of bytes used
+        size_t cap;                             ///< Number of bytes allocated
+} vec_t;
 
-        const yaml_node_t *mods = parsed_node->mods;
-        if (mods->type != YAML_SEQUENCE_NODE) {
-                debug_err("mods node is not an array");
-                return ERR_INVALID_RULES;
-        }
-        size_t num_mods = mods->data.sequence.items.top - mods->data.sequence.items.start;
-        if (num_mods != CASE_COUNT - 1) {
-                debug_err("invalid number of mods %zu", num_mods);
-                return ERR_INVALID_RULES;
-        }
+/// State of the rules compiler
+typedef struct {
+        const petr_allocator_t *alloc;          ///< Allocator of the sections and of the image
+        vec_t sections[SECT_COUNT];             ///< Contents of the image sections
+        rules_set_t sets[NAME_KIND_COUNT];
+        petr_rules_error_t *error;              ///< Where to describe the first error, or NULL
+} builder_t;
 
-        mod_t *dest_mod = dest->mods;
-        for (yaml_node_item_t *p = mods->data.sequence.items.start; p != mods->data.sequence.items.top;
-             p++, dest_mod++) {
-                yaml_node_t *node = yaml_document_get_node(&ctx->yaml, *p);
-                if (node->type != YAML_SCALAR_NODE) {
-                        debug_err("invalid node type");
-                        return ERR_INVALID_RULES;
-                }
-                cbuf_t buf;
-                buf.data = (const char *)node->data.scalar.value;
-                buf.len = node->data.scalar.length;
-                if (buf.len == 1 && buf.data[0] == '.') {
-                        // '.' means 'no change needed
-                        continue;
+/// Append \c size zero bytes to the array
+///
+/// @returns    Pointer to the appended bytes, or NULL if allocation failed
+static void *vec_grow(const petr_allocator_t *alloc, vec_t *vec, size_t size)
+{
+        if (vec->data == NULL || vec->len + size > vec->cap) {
+                size_t cap = vec->cap ? vec->cap : 256;
+                while (cap < vec->len + size)
+                        cap *= 2;
+                char *data = mem_realloc(alloc, vec->data, cap);
+                if (!data) {
+                        debug_err("allocation failed");
+                        return NULL;
                 }
-                size_t minus_count;
-                for (minus_count = 0; minus_count < buf.len && buf.data[minus_count] == '-'; minus_count++)
-                        ;
-                dest_mod->cnt_remove = minus_count;
-                dest_mod->add_suffix.data = buf.data + minus_count;
-                dest_mod->add_suffix.len = buf.len - minus_count;
+                vec->data = data;
+                vec->cap = cap;
         }
+        char *res = vec->data + vec->len;
+        memset(res, 0, size);
+        vec->len += size;
+        return res;
+}
 
-        const yaml_node_t *tags = parsed_node->tags;
-        if (tags == NULL)
-                return 0;
-
-        if (tags->type != YAML_SEQUENCE_NODE) {
-                debug_err("tags node is not an array");
-                return ERR_INVALID_RULES;
-        }
+/// Number of elements in a section of the image being built
+static size_t sect_count(const builder_t *b, int sect)
+{
+        return b->sections[sect].len / g_sect_elem_size[sect];
+}
 
-        for (yaml_node_item_t *p = tags->data.sequence.items.start; p != tags->data.sequence.items.top; p++) {
-                yaml_node_t *node = yaml_document_get_node(&ctx->yaml, *p);
-                if (node->type != YAML_SCALAR_NODE) {
-                        debug_err("invalid node type");
-                        return ERR_INVALID_RULES;
-                }
-                const char *val = (const char *)node->data.scalar.value;
-                size_t val_len = node->data.scalar.length;
-                if (strncmp("first_word", val, val_len) == 0) {
-                        dest->first_word = true;
-                } else {
-                        debug_err("invalid tag '%.*s'", (int)val_len, val);
-                        return ERR_INVALID_RULES;
-                }
-        }
-        return 0;
+/// Append \c count zero elements to a section of the image being built
+static void *sect_grow(builder_t *b, int sect, size_t count)
+{
+        return vec_grow(b->alloc, &b->sections[sect], count * g_sect_elem_size[sect]);
 }
 
-/// Load a single rules array (either suffixes or exceptions of some name kind)
-static int load_rule_arr(petr_context_t *ctx, const yaml_node_t *node, mod_rule_arr_t *dest)
+/// Describe an error in the rules found while building the image, unless an earlier one is described
+///
+/// The location is left unknown; the parser fills it in for errors found while parsing.
+///
+/// @returns    \c ERR_INVALID_RULES
+__attribute__((format(printf, 2, 3)))
+static int build_error(const builder_t *b, const char *fmt, ...)
 {
-        if (node->type != YAML_SEQUENCE_NODE) {
-                debug_err("node is not an array");
-                return ERR_INVALID_RULES;
+        if (b->error != NULL && b->error->message[0] == '\0') {
+                va_list ap;
+                va_start(ap, fmt);
+                vsnprintf(b->error->message, sizeof(b->error->message), fmt, ap);
+                va_end(ap);
         }
+        return ERR_INVALID_RULES;
+}
 
-        size_t cnt_items = node->data.sequence.items.top - node->data.sequence.items.start;
-        dest->rules = calloc(sizeof(mod_rule_t), cnt_items);
-        if (!dest->rules) {
-                debug_err("allocation failed");
+/// Copy a string into the strings section of the image being built
+static int add_string(builder_t *b, cbuf_t str, str_ref_t *dest)
+{
+        size_t off = b->sections[SECT_STRINGS].len;
+        char *data = sect_grow(b, SECT_STRINGS, str.len);
+        if (!data)
                 return ERR_NOMEM;
-        }
-
-        dest->num_rules = cnt_items;
-        mod_rule_t *dest_item = dest->rules;
-        for (yaml_node_item_t *p = node->data.sequence.items.start; p != node->data.sequence.items.top; p++) {
-                yaml_node_t *node = yaml_document_get_node(&ctx->yaml, *p);
-                yaml_mod_rules_t parsed_node;
-                int rc = parse_mod_rules(ctx, node, &parsed_node);
-                if (rc != 0)
-                        return rc;
-                rc = load_mod_rules(ctx, &parsed_node, dest_item);
-                if (rc != 0)
-                        return rc;
-                dest_item++;
-        }
-
+        memcpy(data, str.data, str.len);
+        dest->off = off;
+        dest->len = str.len;
         return 0;
 }
 
-/// Load rules for a single name kind
-static int load_name_kind(petr_context_t *ctx, const yaml_node_t *node, rules_set_t *dest)
+/// Add UTF-16 copies of a suffix to the UTF-16 suffixes section, unless the same suffix is already there
+///
+/// @param suffix       Suffix
+/// @param upper        Uppercase copy of \c suffix
+/// @param dest         Mod receiving the offset of the copies
+static int add_suffix_u16(builder_t *b, cbuf_t suffix, cbuf_t upper, mod_t *dest)
 {
-        if (node->type != YAML_MAPPING_NODE) {
-                debug_err("node is not a mapping");
-                return ERR_INVALID_RULES;
-        }
-
-        for (yaml_node_pair_t *p = node->data.mapping.pairs.start; p != node->data.mapping.pairs.top; p++) {
-                yaml_node_t *key_node = yaml_document_get_node(&ctx->yaml, p->key);
-                yaml_node_t *val_node = yaml_document_get_node(&ctx->yaml, p->value);
-                if (key_node->type != YAML_SCALAR_NODE) {
-                        debug_err("invalid key");
-                        return ERR_INVALID_RULES;
-                }
-
-                const char *key = (const char *)key_node->data.scalar.value;
-                size_t key_len = key_node->data.scalar.length;
-                bool is_suffixes;
-                if (strncmp("exceptions", key, key_len) == 0) {
-                        is_suffixes = false;
-                } else if (strncmp("suffixes", key, key_len) == 0) {
-                        is_suffixes = true;
-                } else {
-                        debug_err("unexpected kind '%.*s'", (int)key_len, key);
-                        return ERR_INVALID_RULES;
-                }
+        // Room for the length and both copies. UTF-16 never takes more code units than UTF-8 takes bytes.
+        uint16_t entry[1 + 2 * UINT8_MAX];
+        entry[0] = utf8_to_utf16(suffix, entry + 1);
+        if (utf8_to_utf16(upper, entry + 1 + entry[0]) != entry[0])
+                return build_error(b, "uppercase suffix differs in length");
+        size_t entry_len = 1 + 2 * (size_t)entry[0];
 
-                int rc = load_rule_arr(ctx, val_node, is_suffixes ? &dest->suffixes : &dest->exceptions);
-                if (rc != 0)
-                        return rc;
+        // Suffixes repeat a lot, so the section stays small enough for 16-bit offsets
+        const uint16_t *entries = (const uint16_t *)b->sections[SECT_SUFFIXES_U16].data;
+        size_t count = sect_count(b, SECT_SUFFIXES_U16);
+        size_t off = 0;
+        while (off < count && (entries[off] != entry[0]
+                               || memcmp(&entries[off], entry, entry_len * sizeof(uint16_t)) != 0))
+                off += 1 + 2 * (size_t)entries[off];
+        if (off == count) {
+                if (count + entry_len > UINT16_MAX + 1)
+                        return build_error(b, "too many distinct suffixes");
+                uint16_t *data = sect_grow(b, SECT_SUFFIXES_U16, entry_len);
+                if (!data)
+                        return ERR_NOMEM;
+                memcpy(data, entry, entry_len * sizeof(uint16_t));
         }
+        dest->suffix16_off = off;
         return 0;
 }
 
-/// Load all rules into ctx
-static int load_yaml(petr_context_t *ctx)
+/// Add a suffix to the strings section, followed by its uppercase copy
+static int add_suffix(builder_t *b, cbuf_t suffix, mod_t *dest)
 {
-        const yaml_node_t *root = yaml_document_get_root_node(&ctx->yaml);
-        if (!root) {
-                debug_err("empty root node");
-                return ERR_INVALID_RULES;
-        }
-        if (root->type != YAML_MAPPING_NODE) {
-                debug_err("root node is not a mapping");
-                return ERR_INVALID_RULES;
-        }
+        if (suffix.len > UINT8_MAX)
+                return build_error(b, "suffix is too long");
+        str_ref_t ref;
+        int rc = add_string(b, suffix, &ref);
+        if (rc != 0)
+                return rc;
+        dest->suffix_off = ref.off;
+        dest->suffix_len = ref.len;
+        char *upper = sect_grow(b, SECT_STRINGS, suffix.len);
+        if (!upper)
+                return ERR_NOMEM;
+        rus_utf8_upper(suffix, upper);
+        cbuf_t upper_buf = { upper, suffix.len };
+        return add_suffix_u16(b, suffix, upper_buf, dest);
+}
+
+/// Location in the rules file
+typedef struct {
+        const char *pos;
+        const char *line_start;                 ///< Beginning of the line of \c pos
+        unsigned line;                          ///< Number of the line, starting from 1
+} text_pos_t;
 
-        // Which rules sets are initialized
-        bool init_rules[NAME_KIND_COUNT] = { 0 };
+/// State of the rules file parser
+///
+/// The parser handles the subset of YAML used by rules files: block mappings, block and flow sequences, plain and
+/// quoted scalars and comments. Rules are written into the image builder as they are parsed.
+typedef struct {
+        builder_t *b;
+        const char *pos;                        ///< Current position
+        const char *end;                        ///< End of the rules file
+        const char *line_start;                 ///< Beginning of the current line
+        unsigned line;                          ///< Number of the current line, starting from 1
+        text_pos_t token;                       ///< Beginning of the last scalar
+        vec_t scratch;                          ///< Contents of the last quoted scalar
+} parser_t;
 
-        // Iterate over the root mapping node
-        for (yaml_node_pair_t *p = root->data.mapping.pairs.start; p != root->data.mapping.pairs.top; p++) {
-                yaml_node_t *key_node = yaml_document_get_node(&ctx->yaml, p->key);
-                yaml_node_t *val_node = yaml_document_get_node(&ctx->yaml, p->value);
-                if (key_node->type != YAML_SCALAR_NODE) {
-                        debug_err("invalid key");
-                        return ERR_INVALID_RULES;
-                }
+/// Parser of the value of a mapping key
+typedef int (*key_fn_t)(parser_t *p, cbuf_t key, size_t indent, void *arg);
 
-                const char *key = (const char *)key_node->data.scalar.value;
-                size_t key_len = key_node->data.scalar.length;
-                petr_name_kind_t kind;
-                if (strncmp("firstname", key, key_len) == 0) {
-                        kind = NAME_FIRST;
-                } else if (strncmp("middlename", key, key_len) == 0) {
-                        kind = NAME_MIDDLE;
-                } else if (strncmp("lastname", key, key_len) == 0) {
-                        kind = NAME_LAST;
-                } else {
-                        debug_err("unexpected kind '%.*s'", (int)key_len, key);
-                        return ERR_INVALID_RULES;
-                }
+/// Parser of a sequence item, \c flow is true inside a flow sequence
+typedef int (*item_fn_t)(parser_t *p, bool flow, void *arg);
 
-                int rc = load_name_kind(ctx, val_node, &ctx->sets[kind]);
-                if (rc != 0)
-                        return rc;
+static const char *const g_name_kind_keys[NAME_KIND_COUNT] = { "firstname", "middlename", "lastname" };
+static const char *const g_rule_arr_keys[] = { "exceptions", "suffixes" };
+static const char *const g_rule_keys[] = { "gender", "test", "mods", "tags" };
+static const char *const g_gender_names[GENDER_COUNT] = { "male", "female", "androgynous" };
 
-                init_rules[kind] = true;
-        }
+enum {
+        RULE_KEY_GENDER,
+        RULE_KEY_TEST,
+        RULE_KEY_MODS,
+        RULE_KEY_TAGS,
+};
 
-        // Check that the YAML document indeed contains all 3 rules sets
-        for (int i = 0; i < NAME_KIND_COUNT; i++) {
-                if (!init_rules[i]) {
-                        debug_err("missing rules %d", i);
-                        return ERR_INVALID_RULES;
-                }
-        }
-        return 0;
-}
+/// Rule being parsed
+typedef struct {
+        mod_rule_t rule;
+        text_pos_t start;                       ///< Location of the rule in the file
+        unsigned seen_keys;                     ///< Bit mask of the keys parsed
+        size_t num_mods;
+} rule_parser_t;
 
-#if !defined(NDEBUG) && !defined(PETROVICH_NDEBUG)
-/// Output a \c mod_rule_t to IO stream. For debugging purposes.
-static void dump_rule(const mod_rule_t *rule, FILE *fp)
+/// Rules set being parsed
+typedef struct {
+        rules_set_t *set;
+        unsigned seen_keys;                     ///< Bit mask of the keys parsed
+} set_parser_t;
+
+static text_pos_t parser_pos(const parser_t *p)
 {
-        const char *gender_str;
-        switch (rule->gender) {
-        case GEND_MALE:
-                gender_str = "male";
-                break;
-        case GEND_FEMALE:
-                gender_str = "female";
-                break;
-        case GEND_ANDROGYNOUS:
-                gender_str = "androgynous";
-                break;
-        }
-        fprintf(fp, "      gender: %s\n", gender_str);
-        fprintf(fp, "      %zu matches:", rule->num_matches);
-        for (size_t i = 0; i < rule->num_matches; i++)
-                fprintf(fp, " '%.*s'", (int)rule->match[i].len, rule->match[i].data);
-        fprintf(fp, "\n      mods:");
-        for (size_t i = 0; i < CASE_COUNT - 1; i++) {
-                const mod_t *mod = &rule->mods[i];
-                fprintf(fp, " -%zu+'%.*s'", mod->cnt_remove, (int)mod->add_suffix.len, mod->add_suffix.data);
-        }
-        fprintf(fp, "\n");
+        text_pos_t res = { p->pos, p->line_start, p->line };
+        return res;
 }
 
-/// Output a \c mod_rule_arr_t to IO stream. For debugging purposes.
-static void dump_rules(const mod_rule_arr_t *arr, FILE *fp)
+/// Report an error at the given location
+///
+/// Errors in the rules are the caller's input, so they are only described, never treated as bugs. An error the
+/// builder has described without a location gets this one.
+///
+/// @returns    \c ERR_INVALID_RULES
+__attribute__((format(printf, 3, 4)))
+static int parse_error_at(parser_t *p, text_pos_t at, const char *fmt, ...)
 {
-        for (size_t i = 0; i < arr->num_rules; i++) {
-                fprintf(fp, "    rule %zu\n", i);
-                const mod_rule_t *rule = &arr->rules[i];
-                dump_rule(rule, fp);
+        petr_rules_error_t *error = p->b->error;
+        if (error == NULL || error->line != 0)
+                return ERR_INVALID_RULES;
+        unsigned column = 1;
+        for (const char *s = at.line_start; s < at.pos; s++)
+                column += ((unsigned char)*s & 0xC0) != 0x80;
+        error->line = at.line;
+        error->column = column;
+        if (error->message[0] == '\0') {
+                va_list ap;
+                va_start(ap, fmt);
+                vsnprintf(error->message, sizeof(error->message), fmt, ap);
+                va_end(ap);
         }
+        return ERR_INVALID_RULES;
 }
 
-/// Output a \c petr_context_t to IO stream. For debugging purposes.
-__attribute__((used))
-static void dump_context(const petr_context_t *ctx, FILE *fp)
-{
-        for (int kind = 0; kind < NAME_KIND_COUNT; kind++) {
-                switch (kind) {
-                case NAME_FIRST:
-                        fprintf(fp, "first name\n");
-                        break;
-                case NAME_MIDDLE:
-                        fprintf(fp, "middle name\n");
-                        break;
-                case NAME_LAST:
-                        fprintf(fp, "last name\n");
-                        break;
-                }
+#define parse_error(p, ...)     parse_error_at((p), parser_pos(p), __VA_ARGS__)
 
-                fprintf(fp, "  exceptions\n");
-                dump_rules(&ctx->sets[kind].exceptions, fp);
-                fprintf(fp, "  suffixes\n");
-                dump_rules(&ctx->sets[kind].suffixes, fp);
+/// Find a key among \c names
+///
+/// @returns    Index of the key, or -1 if not found
+static int find_key(cbuf_t key, const char *const *names, int num_names)
+{
+        for (int i = 0; i < num_names; i++) {
+                if (strlen(names[i]) == key.len && memcmp(names[i], key.data, key.len) == 0)
+                        return i;
         }
+        return -1;
 }
-#endif
 
-/// Initialize library context from the rules file contents
+/// Check that the key is known and is not repeated in its mapping
 ///
-/// @param data         Contents of the rules file
-/// @param len          Length of \c data
-/// @param pctx         Pointer to context object (output parameter)
-/// @returns            Error code (0, if succeeded)
-int petr_init_from_string(const char *data, size_t len, petr_context_t **pctx)
+/// @returns    Index of the key, or -1 after reporting an error
+static int check_key(parser_t *p, cbuf_t key, const char *const *names, int num_names, unsigned *seen_keys)
 {
-        petr_context_t *ctx = (petr_context_t *)calloc(sizeof(petr_context_t), 1);
-        if (!ctx)
-                goto out;
-        *pctx = ctx;
-        yaml_parser_t parser;
-        if (!yaml_parser_initialize(&parser))
-                goto free_ctx;
-
-        yaml_parser_set_input_string(&parser, (const unsigned char *)data, len);
-        if (!yaml_parser_load(&parser, &ctx->yaml))
-                goto del_parser;
-        if (load_yaml(ctx) != 0) {
-                yaml_parser_delete(&parser);
-                petr_free_context(ctx);
+        int idx = find_key(key, names, num_names);
+        if (idx < 0) {
+                parse_error_at(p, p->token, "unexpected key '%.*s'", (int)key.len, key.data);
                 return -1;
         }
-        yaml_parser_delete(&parser);
-        return 0;
-del_parser:
-        yaml_parser_delete(&parser);
-free_ctx:
-        free(*pctx);
-out:
-        return -1;
+        if (*seen_keys & (1U << idx)) {
+                parse_error_at(p, p->token, "duplicate key '%.*s'", (int)key.len, key.data);
+                return -1;
+        }
+        *seen_keys |= 1U << idx;
+        return idx;
 }
 
-/// Free an instance of \c mod_rule_arr_t
-static void free_rules_arr(mod_rule_arr_t *arr)
+static size_t parser_column(const parser_t *p)
 {
-        if (!arr->rules)
-                return;
+        return p->pos - p->line_start;
+}
 
-        for (size_t i = 0; i < arr->num_rules; i++)
-                free(arr->rules[i].match);
-        free(arr->rules);
+static bool is_blank_char(char c)
+{
+        return c == ' ' || c == '\t';
 }
 
-/// Free library context
-///
-/// @param ctx          Context allocated by \c petr_init_from_file or \c petr_init_from_string
-void petr_free_context(petr_context_t *ctx)
+static bool is_flow_indicator(char c)
 {
-        for (size_t i = 0; i < NAME_KIND_COUNT; i++) {
-                rules_set_t *rules = &ctx->sets[i];
-                free_rules_arr(&rules->exceptions);
-                free_rules_arr(&rules->suffixes);
-        }
-        yaml_document_delete(&ctx->yaml);
-        free(ctx);
+        return c == ',' || c == '[' || c == ']' || c == '{' || c == '}';
 }
 
-static bool is_gender_compatible(petr_gender_t expected, petr_gender_t actual)
+/// Check if the current position is at the end of a line
+static bool at_eol(const parser_t *p)
 {
-        return actual == GEND_ANDROGYNOUS || actual == expected;
+        return p->pos == p->end || *p->pos == '\n'
+               || (*p->pos == '\r' && (p->pos + 1 == p->end || p->pos[1] == '\n'));
 }
 
-/// Try to match the name against rules array
+/// Check if the character at \c offset from the current position separates tokens
+static bool is_space_at(const parser_t *p, size_t offset)
+{
+        if ((size_t)(p->end - p->pos) <= offset)
+                return true;
+        char c = p->pos[offset];
+        return is_blank_char(c) || c == '\n' || c == '\r';
+}
+
+static void skip_blanks(parser_t *p)
+{
+        while (p->pos != p->end && is_blank_char(*p->pos))
+                p->pos++;
+}
+
+/// Move to the beginning of the next line
+static void next_line(parser_t *p)
+{
+        while (p->pos != p->end && *p->pos != '\n')
+                p->pos++;
+        if (p->pos != p->end) {
+                p->pos++;
+                p->line++;
+                p->line_start = p->pos;
+        }
+}
+
+/// Skip the rest of the current line, which may only contain a comment
+static int finish_line(parser_t *p)
+{
+        skip_blanks(p);
+        if (!at_eol(p) && *p->pos != '#')
+                return parse_error(p, "unexpected '%c'", *p->pos);
+        next_line(p);
+        return 0;
+}
+
+/// Skip blanks, comments and empty lines up to the next token or the end of the file
+static int skip_to_token(parser_t *p)
+{
+        for (;;) {
+                bool line_start = p->pos == p->line_start;
+                while (p->pos != p->end && *p->pos == ' ')
+                        p->pos++;
+                const char *indent_end = p->pos;
+                skip_blanks(p);
+                if (p->pos != p->end && *p->pos == '#') {
+                        next_line(p);
+                } else if (p->pos == p->end) {
+                        return 0;
+                } else if (at_eol(p)) {
+                        next_line(p);
+                } else if (line_start && p->pos != indent_end) {
+                        return parse_error(p, "tabs are not allowed in indentation");
+                } else {
+                        return 0;
+                }
+        }
+}
+
+/// Check if the current line has no more tokens
+static bool at_line_end(parser_t *p)
+{
+        skip_blanks(p);
+        return at_eol(p) || *p->pos == '#';
+}
+
+static int parse_quoted_scalar(parser_t *p, cbuf_t *dest)
+{
+        char quote = *p->pos++;
+        p->scratch.len = 0;
+        for (;;) {
+                if (at_eol(p))
+                        return parse_error(p, "unterminated quoted scalar");
+                char c = *p->pos++;
+                if (c == quote) {
+                        // '' is a single quote inside a single-quoted scalar
+                        if (quote == '"' || p->pos == p->end || *p->pos != '\'')
+                                break;
+                        p->pos++;
+                } else if (c == '\\' && quote == '"') {
+                        if (at_eol(p))
+                                return parse_error(p, "unterminated quoted scalar");
+                        c = *p->pos++;
+                        switch (c) {
+                        case '"':
+                        case '\\':
+                        case '/':
+                                break;
+                        case 'n':
+                                c = '\n';
+                                break;
+                        case 't':
+                                c = '\t';
+                                break;
+                        default:
+                                p->pos--;
+                                return parse_error(p, "unsupported escape sequence '\\%c'", c);
+                        }
+                }
+                char *dest_char = vec_grow(p->b->alloc, &p->scratch, 1);
+                if (!dest_char)
+                        return ERR_NOMEM;
+                *dest_char = c;
+        }
+        dest->data = p->scratch.len != 0 ? p->scratch.data : "";
+        dest->len = p->scratch.len;
+        return 0;
+}
+
+/// Parse a scalar, which must end on the current line
+///
+/// @param flow         True inside a flow sequence, where flow indicators end a plain scalar
+/// @param dest         Contents of the scalar, valid until the next scalar is parsed
+static int parse_scalar(parser_t *p, bool flow, cbuf_t *dest)
+{
+        p->token = parser_pos(p);
+        if (at_eol(p))
+                return parse_error(p, "expected a scalar");
+        char c = *p->pos;
+        if (c == '\'' || c == '"')
+                return parse_quoted_scalar(p, dest);
+        if (is_flow_indicator(c) || c == '#' || c == '&' || c == '*' || c == '!' || c == '|' || c == '>' || c == '%'
+            || c == '@' || c == '`' || ((c == '-' || c == '?' || c == ':') && is_space_at(p, 1)))
+                return parse_error(p, "unexpected '%c'", c);
+
+        const char *start = p->pos;
+        const char *last = p->pos;
+        while (!at_eol(p)) {
+                c = *p->pos;
+                if (c == ':' && (is_space_at(p, 1) || (flow && is_flow_indicator(p->pos[1]))))
+                        break;
+                if (c == '#' && is_blank_char(p->pos[-1]))
+                        break;
+                if (flow && is_flow_indicator(c))
+                        break;
+                p->pos++;
+                if (!is_blank_char(c))
+                        last = p->pos;
+        }
+        dest->data = start;
+        dest->len = last - start;
+        return 0;
+}
+
+/// Parse a scalar value of a mapping key, up to the next token
+static int parse_scalar_value(parser_t *p, cbuf_t *value)
+{
+        skip_blanks(p);
+        int rc = parse_scalar(p, false, value);
+        if (rc == 0)
+                rc = finish_line(p);
+        if (rc == 0)
+                rc = skip_to_token(p);
+        return rc;
+}
+
+/// Parse a scalar item of a sequence
+static int parse_scalar_item(parser_t *p, bool flow, cbuf_t *value)
+{
+        int rc = parse_scalar(p, flow, value);
+        if (rc == 0 && !flow)
+                rc = finish_line(p);
+        if (rc == 0 && !flow)
+                rc = skip_to_token(p);
+        return rc;
+}
+
+/// Parse a block mapping starting at the current token, up to the first token after it
+static int parse_mapping(parser_t *p, key_fn_t fn, void *arg)
+{
+        size_t indent = parser_column(p);
+        for (;;) {
+                cbuf_t key;
+                int rc = parse_scalar(p, false, &key);
+                if (rc != 0)
+                        return rc;
+                skip_blanks(p);
+                if (p->pos == p->end || *p->pos != ':' || !is_space_at(p, 1))
+                        return parse_error(p, "expected ':'");
+                p->pos++;
+                rc = fn(p, key, indent, arg);
+                if (rc != 0)
+                        return rc;
+                if (p->pos == p->end || parser_column(p) < indent)
+                        return 0;
+                if (parser_column(p) > indent)
+                        return parse_error(p, "bad indentation");
+        }
+}
+
+/// Parse a block mapping that is the value of a key at \c indent
+static int parse_nested_mapping(parser_t *p, size_t indent, key_fn_t fn, void *arg)
+{
+        if (!at_line_end(p))
+                return parse_error(p, "expected a mapping");
+        next_line(p);
+        int rc = skip_to_token(p);
+        if (rc != 0)
+                return rc;
+        if (p->pos == p->end || parser_column(p) <= indent)
+                return parse_error(p, "expected a mapping");
+        return parse_mapping(p, fn, arg);
+}
+
+static int parse_flow_sequence(parser_t *p, item_fn_t fn, void *arg)
+{
+        p->pos++;
+        for (;;) {
+                int rc = skip_to_token(p);
+                if (rc != 0)
+                        return rc;
+                if (p->pos == p->end)
+                        return parse_error(p, "unterminated flow sequence");
+                if (*p->pos == ']')
+                        break;
+                rc = fn(p, true, arg);
+                if (rc == 0)
+                        rc = skip_to_token(p);
+                if (rc != 0)
+                        return rc;
+                if (p->pos != p->end && *p->pos == ']')
+                        break;
+                if (p->pos == p->end || *p->pos != ',')
+                        return parse_error(p, "expected ',' or ']'");
+                p->pos++;
+        }
+        p->pos++;
+        int rc = finish_line(p);
+        if (rc == 0)
+                rc = skip_to_token(p);
+        return rc;
+}
+
+static bool at_sequence_item(const parser_t *p)
+{
+        return p->pos != p->end && *p->pos == '-' && is_space_at(p, 1);
+}
+
+/// Parse a block or flow sequence that is the value of a key at \c indent, up to the first token after it
+static int parse_sequence(parser_t *p, size_t indent, item_fn_t fn, void *arg)
+{
+        skip_blanks(p);
+        if (p->pos != p->end && *p->pos == '[')
+                return parse_flow_sequence(p, fn, arg);
+        if (!at_line_end(p))
+                return parse_error(p, "expected a sequence");
+        next_line(p);
+        int rc = skip_to_token(p);
+        if (rc != 0)
+                return rc;
+        size_t seq_indent = parser_column(p);
+        if (seq_indent < indent || !at_sequence_item(p))
+                return parse_error(p, "expected a sequence");
+
+        while (parser_column(p) == seq_indent && at_sequence_item(p)) {
+                p->pos++;
+                if (at_line_end(p)) {
+                        next_line(p);
+                        rc = skip_to_token(p);
+                        if (rc != 0)
+                                return rc;
+                        if (p->pos == p->end || parser_column(p) <= seq_indent)
+                                return parse_error(p, "expected a sequence item");
+                }
+                rc = fn(p, false, arg);
+                if (rc != 0)
+                        return rc;
+        }
+        return 0;
+}
+
+static int parse_test_item(parser_t *p, bool flow, void *arg)
+{
+        (void)arg;
+        cbuf_t value;
+        int rc = parse_scalar_item(p, flow, &value);
+        if (rc != 0)
+                return rc;
+        str_ref_t *dest = sect_grow(p->b, SECT_MATCHES, 1);
+        if (!dest)
+                return ERR_NOMEM;
+        return add_string(p->b, value, dest);
+}
+
+static int parse_mod_item(parser_t *p, bool flow, void *arg)
+{
+        rule_parser_t *rp = arg;
+        cbuf_t value;
+        int rc = parse_scalar_item(p, flow, &value);
+        if (rc != 0)
+                return rc;
+        if (rp->num_mods == CASE_COUNT - 1)
+                return parse_error_at(p, p->token, "too many mods");
+        mod_t *mod = &rp->rule.mods[rp->num_mods++];
+
+        // '.' means 'no change needed'
+        if (value.len == 1 && value.data[0] == '.')
+                return 0;
+        size_t minus_count;
+        for (minus_count = 0; minus_count < value.len && value.data[minus_count] == '-'; minus_count++)
+                ;
+        cbuf_t suffix = { value.data + minus_count, value.len - minus_count };
+        if (minus_count > UINT8_MAX)
+                return parse_error_at(p, p->token, "too many codepoints to remove");
+        if (suffix.len > UINT8_MAX)
+                return parse_error_at(p, p->token, "suffix is too long");
+        mod->cnt_remove = minus_count;
+        rc = add_suffix(p->b, suffix, mod);
+        if (rc == ERR_INVALID_RULES)
+                return parse_error_at(p, p->token, "invalid suffix");
+        return rc;
+}
+
+static int parse_tag_item(parser_t *p, bool flow, void *arg)
+{
+        rule_parser_t *rp = arg;
+        cbuf_t value;
+        int rc = parse_scalar_item(p, flow, &value);
+        if (rc != 0)
+                return rc;
+        if (value.len != strlen("first_word") || memcmp(value.data, "first_word", value.len) != 0)
+                return parse_error_at(p, p->token, "invalid tag '%.*s'", (int)value.len, value.data);
+        rp->rule.first_word = true;
+        return 0;
+}
+
+static int parse_rule_key(parser_t *p, cbuf_t key, size_t indent, void *arg)
+{
+        rule_parser_t *rp = arg;
+        int idx = check_key(p, key, g_rule_keys, sizeof(g_rule_keys) / sizeof(g_rule_keys[0]), &rp->seen_keys);
+        if (idx < 0)
+                return ERR_INVALID_RULES;
+
+        int rc = 0;
+        switch (idx) {
+        case RULE_KEY_GENDER: {
+                cbuf_t value;
+                rc = parse_scalar_value(p, &value);
+                if (rc != 0)
+                        return rc;
+                int gender = find_key(value, g_gender_names, GENDER_COUNT);
+                if (gender < 0)
+                        return parse_error_at(p, p->token, "invalid gender '%.*s'", (int)value.len, value.data);
+                rp->rule.gender = gender;
+                break;
+        }
+        case RULE_KEY_TEST:
+                rp->rule.first_match = sect_count(p->b, SECT_MATCHES);
+                rc = parse_sequence(p, indent, parse_test_item, rp);
+                rp->rule.num_matches = sect_count(p->b, SECT_MATCHES) - rp->rule.first_match;
+                break;
+        case RULE_KEY_MODS:
+                rc = parse_sequence(p, indent, parse_mod_item, rp);
+                break;
+        case RULE_KEY_TAGS:
+                rc = parse_sequence(p, indent, parse_tag_item, rp);
+                break;
+        }
+        return rc;
+}
+
+/// Parse a rule and append it to the rules section
+static int parse_rule(parser_t *p, bool flow, void *arg)
+{
+        (void)arg;
+        if (flow)
+                return parse_error(p, "expected a block mapping");
+
+        rule_parser_t rp;
+        memset(&rp, 0, sizeof(rp));
+        rp.start = parser_pos(p);
+        int rc = parse_mapping(p, parse_rule_key, &rp);
+        if (rc != 0)
+                return rc;
+        unsigned mandatory = (1U << RULE_KEY_GENDER) | (1U << RULE_KEY_TEST) | (1U << RULE_KEY_MODS);
+        if ((rp.seen_keys & mandatory) != mandatory)
+                return parse_error_at(p, rp.start, "mandatory key of the rule missing");
+        if (rp.rule.num_matches == 0)
+                return parse_error_at(p, rp.start, "test array is empty");
+        if (rp.num_mods != CASE_COUNT - 1)
+                return parse_error_at(p, rp.start, "invalid number of mods %zu", rp.num_mods);
+
+        mod_rule_t *dest = sect_grow(p->b, SECT_RULES, 1);
+        if (!dest)
+                return ERR_NOMEM;
+        *dest = rp.rule;
+        return 0;
+}
+
+static int parse_set_key(parser_t *p, cbuf_t key, size_t indent, void *arg)
+{
+        set_parser_t *sp = arg;
+        int idx = check_key(p, key, g_rule_arr_keys, sizeof(g_rule_arr_keys) / sizeof(g_rule_arr_keys[0]),
+                            &sp->seen_keys);
+        if (idx < 0)
+                return ERR_INVALID_RULES;
+
+        // Rules are appended to the rules section as they are parsed, so the rules of an array are contiguous
+        mod_rule_arr_t *dest = idx == 0 ? &sp->set->exceptions : &sp->set->suffixes;
+        dest->first_rule = sect_count(p->b, SECT_RULES);
+        int rc = parse_sequence(p, indent, parse_rule, NULL);
+        dest->num_rules = sect_count(p->b, SECT_RULES) - dest->first_rule;
+        return rc;
+}
+
+static int parse_root_key(parser_t *p, cbuf_t key, size_t indent, void *arg)
+{
+        int kind = check_key(p, key, g_name_kind_keys, NAME_KIND_COUNT, arg);
+        if (kind < 0)
+                return ERR_INVALID_RULES;
+        set_parser_t sp = { &p->b->sets[kind], 0 };
+        return parse_nested_mapping(p, indent, parse_set_key, &sp);
+}
+
+/// Parse the rules file into the image builder
+static int parse_rules(builder_t *b, const char *data, size_t len)
+{
+        parser_t p;
+        memset(&p, 0, sizeof(p));
+        p.b = b;
+        p.pos = data;
+        p.end = data + len;
+        p.line_start = data;
+        p.line = 1;
+
+        // Byte order mark
+        if (len >= 3 && memcmp(data, "\xEF\xBB\xBF", 3) == 0)
+                p.pos += 3;
+        int rc = skip_to_token(&p);
+        if (rc == 0 && p.end - p.pos >= 3 && memcmp(p.pos, "---", 3) == 0 && is_space_at(&p, 3)) {
+                p.pos += 3;
+                rc = finish_line(&p);
+                if (rc == 0)
+                        rc = skip_to_token(&p);
+        }
+        unsigned seen_kinds = 0;
+        if (rc == 0 && p.pos == p.end)
+                rc = parse_error(&p, "empty rules file");
+        if (rc == 0)
+                rc = parse_mapping(&p, parse_root_key, &seen_kinds);
+        if (rc == 0 && p.pos != p.end)
+                rc = parse_error(&p, "bad indentation");
+        for (int i = 0; rc == 0 && i < NAME_KIND_COUNT; i++) {
+                if (!(seen_kinds & (1U << i)))
+                        rc = parse_error(&p, "missing rules for %s", g_name_kind_keys[i]);
+        }
+        mem_free(b->alloc, p.scratch.data);
+        return rc;
+}
+
+static bool is_gender_compatible(petr_gender_t expected, petr_gender_t actual)
+{
+        return actual == GEND_ANDROGYNOUS || actual == expected;
+}
+
+/// Name endings that reveal the gender, compiled into the suffix tries
+static const struct {
+        petr_name_kind_t kind;
+        petr_gender_t gender;
+        const char *suffix;
+} g_gender_suffixes[] = {
+        { NAME_MIDDLE, GEND_MALE, "ич" },
+        { NAME_MIDDLE, GEND_MALE, "ыч" },
+        { NAME_MIDDLE, GEND_MALE, "оглы" },
+        { NAME_MIDDLE, GEND_FEMALE, "на" },
+        { NAME_MIDDLE, GEND_FEMALE, "кызы" },
+        { NAME_LAST, GEND_MALE, "ов" },
+        { NAME_LAST, GEND_MALE, "ев" },
+        { NAME_LAST, GEND_MALE, "ёв" },
+        { NAME_LAST, GEND_MALE, "ин" },
+        { NAME_LAST, GEND_MALE, "ын" },
+        { NAME_LAST, GEND_MALE, "ий" },
+        { NAME_LAST, GEND_MALE, "ый" },
+        { NAME_LAST, GEND_MALE, "ой" },
+        { NAME_LAST, GEND_FEMALE, "ова" },
+        { NAME_LAST, GEND_FEMALE, "ева" },
+        { NAME_LAST, GEND_FEMALE, "ёва" },
+        { NAME_LAST, GEND_FEMALE, "ина" },
+        { NAME_LAST, GEND_FEMALE, "ына" },
+        { NAME_LAST, GEND_FEMALE, "ая" },
+};
+
+/// Single suffix being inserted into a \c suffix_trie_t
+typedef struct {
+        const uint32_t *cps;                    ///< Reversed case-folded codepoints
+        size_t len;                             ///< Size of \c cps
+        uint32_t rule;                          ///< Index of the rule in the rules section, or \c NO_RULE
+        petr_gender_t gender;                   ///< Gender suggested by the suffix if \c rule is \c NO_RULE
+} trie_key_t;
+
+static int cmp_trie_keys(const void *p1, const void *p2)
+{
+        const trie_key_t *k1 = (const trie_key_t *)p1;
+        const trie_key_t *k2 = (const trie_key_t *)p2;
+        for (size_t i = 0; i < k1->len && i < k2->len; i++) {
+                if (k1->cps[i] != k2->cps[i])
+                        return k1->cps[i] < k2->cps[i] ? -1 : 1;
+        }
+        if (k1->len != k2->len)
+                return k1->len < k2->len ? -1 : 1;
+        if (k1->rule != k2->rule)
+                return k1->rule < k2->rule ? -1 : 1;
+        return 0;
+}
+
+/// Fill node \c idx of the trie from keys [lo, hi), which all share a prefix of length \c depth
+///
+/// @param b            Image being built, its trie nodes section is already large enough
+/// @param next_node    Index of the next unused node
+static void build_trie_node(builder_t *b, const trie_key_t *keys, size_t lo, size_t hi, size_t depth,
+                            uint32_t *next_node, uint32_t idx)
+{
+        const mod_rule_t *rules = (const mod_rule_t *)b->sections[SECT_RULES].data;
+        trie_node_t *nodes = (trie_node_t *)b->sections[SECT_TRIE_NODES].data;
+        trie_node_t *node = &nodes[idx];
+
+        // Keys that end at this node sort before the longer ones
+        for (; lo < hi && keys[lo].len == depth; lo++) {
+                uint32_t rule_idx = keys[lo].rule;
+                if (rule_idx == NO_RULE) {
+                        node->gender = keys[lo].gender;
+                        continue;
+                }
+                const mod_rule_t *rule = &rules[rule_idx];
+                for (int gender = 0; gender < GENDER_COUNT; gender++) {
+                        if (!is_gender_compatible(gender, rule->gender))
+                                continue;
+                        for (int first_word = rule->first_word; first_word < 2; first_word++) {
+                                if (rule_idx < node->best[gender][first_word])
+                                        node->best[gender][first_word] = rule_idx;
+                        }
+                }
+        }
+
+        size_t num_children = 0;
+        for (size_t i = lo; i < hi; i++) {
+                if (i == lo || keys[i].cps[depth] != keys[i - 1].cps[depth])
+                        num_children++;
+        }
+        node->first_child = *next_node;
+        node->num_children = num_children;
+        *next_node += num_children;
+
+        uint32_t child_idx = node->first_child;
+        while (lo < hi) {
+                size_t end = lo + 1;
+                while (end < hi && keys[end].cps[depth] == keys[lo].cps[depth])
+                        end++;
+                trie_node_t *child = &nodes[child_idx];
+                child->cp = keys[lo].cps[depth];
+                memcpy(child->best, node->best, sizeof(child->best));
+                child->gender = node->gender;
+                build_trie_node(b, keys, lo, end, depth + 1, next_node, child_idx);
+                child_idx++;
+                lo = end;
+        }
+}
+
+/// Reverse case-folded codepoints of \c str into \c cps
+///
+/// @returns    Number of codepoints, or 0 if \c str is not valid UTF-8
+static size_t reverse_codepoints(cbuf_t str, uint32_t *cps)
+{
+        size_t len = 0;
+        while (str.len != 0) {
+                uint32_t cp;
+                size_t cp_len = get_last_codepoint(str, &cp);
+                if (cp_len == 0)
+                        return 0;
+                cps[len++] = rus_lowercase(cp);
+                str.len -= cp_len;
+        }
+        return len;
+}
+
+/// Compile suffixes of the rules array and gender endings of the name kind into a trie
+static int build_suffix_trie(builder_t *b, const mod_rule_arr_t *arr, petr_name_kind_t kind, suffix_trie_t *dest)
+{
+        const mod_rule_t *rules = (const mod_rule_t *)b->sections[SECT_RULES].data + arr->first_rule;
+        const str_ref_t *matches = (const str_ref_t *)b->sections[SECT_MATCHES].data;
+        const char *strings = b->sections[SECT_STRINGS].data;
+
+        int rc = ERR_NOMEM;
+        size_t num_keys = 0;
+        size_t num_cps = 0;
+        for (size_t i = 0; i < arr->num_rules; i++) {
+                const mod_rule_t *rule = &rules[i];
+                num_keys += rule->num_matches;
+                for (size_t j = 0; j < rule->num_matches; j++)
+                        num_cps += matches[rule->first_match + j].len;
+        }
+        for (size_t i = 0; i < sizeof(g_gender_suffixes) / sizeof(g_gender_suffixes[0]); i++) {
+                if (g_gender_suffixes[i].kind == kind) {
+                        num_keys++;
+                        num_cps += strlen(g_gender_suffixes[i].suffix);
+                }
+        }
+
+        trie_key_t *keys = mem_calloc(b->alloc, num_keys + 1, sizeof(trie_key_t));
+        uint32_t *cps = mem_calloc(b->alloc, num_cps + 1, sizeof(uint32_t));
+        if (!keys || !cps) {
+                debug_err("allocation failed");
+                goto out;
+        }
+
+        trie_key_t *key = keys;
+        uint32_t *key_cps = cps;
+        for (size_t i = 0; i < arr->num_rules; i++) {
+                const mod_rule_t *rule = &rules[i];
+                for (size_t j = 0; j < rule->num_matches; j++, key++) {
+                        cbuf_t match = get_string(strings, matches[rule->first_match + j]);
+                        key->cps = key_cps;
+                        key->rule = arr->first_rule + i;
+                        key->len = reverse_codepoints(match, key_cps);
+                        if (key->len == 0 && match.len != 0) {
+                                rc = build_error(b, "invalid UTF-8 in '%.*s'", (int)match.len, match.data);
+                                goto out;
+                        }
+                        key_cps += key->len;
+                }
+        }
+        for (size_t i = 0; i < sizeof(g_gender_suffixes) / sizeof(g_gender_suffixes[0]); i++) {
+                if (g_gender_suffixes[i].kind != kind)
+                        continue;
+                cbuf_t suffix = { g_gender_suffixes[i].suffix, strlen(g_gender_suffixes[i].suffix) };
+                key->cps = key_cps;
+                key->rule = NO_RULE;
+                key->gender = g_gender_suffixes[i].gender;
+                key->len = reverse_codepoints(suffix, key_cps);
+                key_cps += key->len;
+                key++;
+        }
+        if (num_keys > UINT16_MAX) {
+                // A node could have more children than fit into trie_node_t::num_children
+                rc = build_error(b, "too many suffixes");
+                goto out;
+        }
+        qsort(keys, num_keys, sizeof(trie_key_t), cmp_trie_keys);
+
+        // Reserve the maximum possible number of nodes, then drop the unused ones
+        dest->root = sect_count(b, SECT_TRIE_NODES);
+        trie_node_t *root = sect_grow(b, SECT_TRIE_NODES, num_cps + 1);
+        if (!root)
+                goto out;
+        memset(root->best, 0xFF, sizeof(root->best));
+        root->gender = GEND_UNKNOWN;
+        uint32_t next_node = dest->root + 1;
+        build_trie_node(b, keys, 0, num_keys, 0, &next_node, dest->root);
+        dest->num_nodes = next_node - dest->root;
+        b->sections[SECT_TRIE_NODES].len = next_node * sizeof(trie_node_t);
+        rc = 0;
+out:
+        mem_free(b->alloc, cps);
+        mem_free(b->alloc, keys);
+        return rc;
+}
+
+/// Check that every suffix (or whole word) to match of the rules array has Cyrillic letters
+static bool is_cyrillic_only(const builder_t *b, const mod_rule_arr_t *arr)
+{
+        const mod_rule_t *rules = (const mod_rule_t *)b->sections[SECT_RULES].data + arr->first_rule;
+        const str_ref_t *matches = (const str_ref_t *)b->sections[SECT_MATCHES].data;
+        for (size_t i = 0; i < arr->num_rules; i++) {
+                for (size_t j = 0; j < rules[i].num_matches; j++) {
+                        cbuf_t match = get_string(b->sections[SECT_STRINGS].data, matches[rules[i].first_match + j]);
+                        if (!has_cyrillic(match))
+                                return false;
+                }
+        }
+        return true;
+}
+
+/// Compile exceptions array into a hash index
+static int build_exc_index(builder_t *b, const mod_rule_arr_t *arr, exc_index_t *dest)
+{
+        size_t num_words = 0;
+        for (size_t i = 0; i < arr->num_rules; i++)
+                num_words += ((const mod_rule_t *)b->sections[SECT_RULES].data)[arr->first_rule + i].num_matches;
+
+        // Keep load factor at most 1/2, so that probe sequences stay short
+        size_t num_slots = 1;
+        while (num_slots < 2 * num_words + 1)
+                num_slots *= 2;
+        dest->first_slot = sect_count(b, SECT_EXC_SLOTS);
+        dest->num_slots = num_slots;
+        uint32_t forms_idx = sect_count(b, SECT_EXC_FORMS);
+        if (!sect_grow(b, SECT_EXC_SLOTS, num_slots) || !sect_grow(b, SECT_EXC_FORMS, num_words))
+                return ERR_NOMEM;
+
+        const mod_rule_t *rules = (const mod_rule_t *)b->sections[SECT_RULES].data;
+        const str_ref_t *matches = (const str_ref_t *)b->sections[SECT_MATCHES].data;
+        const char *strings = b->sections[SECT_STRINGS].data;
+        exc_slot_t *slots = (exc_slot_t *)b->sections[SECT_EXC_SLOTS].data + dest->first_slot;
+        exc_forms_t *forms = (exc_forms_t *)b->sections[SECT_EXC_FORMS].data + forms_idx;
+        for (uint32_t rule_idx = arr->first_rule; rule_idx < arr->first_rule + arr->num_rules; rule_idx++) {
+                const mod_rule_t *rule = &rules[rule_idx];
+                for (size_t j = 0; j < rule->num_matches; j++, forms++, forms_idx++) {
+                        str_ref_t word_ref = matches[rule->first_match + j];
+                        cbuf_t word = get_string(strings, word_ref);
+                        if (word.len == 0)
+                                return build_error(b, "empty exception");
+                        uint32_t hash = rus_utf8_hash(word);
+                        exc_slot_t *slot = &slots[find_exc_slot(slots, num_slots, strings, word, hash)];
+                        if (slot->word.len == 0) {
+                                slot->word = word_ref;
+                                slot->hash = hash;
+                                memset(slot->forms, 0xFF, sizeof(slot->forms));
+                        }
+
+                        forms->rule = rule_idx;
+                        for (size_t k = 0; k < CASE_COUNT - 1; k++)
+                                forms->keep_len[k] = pop_n_codepoints(word, rule->mods[k].cnt_remove);
+
+                        // Rules are visited in file order, so the first suitable one wins
+                        for (int gender = 0; gender < GENDER_COUNT; gender++) {
+                                if (!is_gender_compatible(gender, rule->gender))
+                                        continue;
+                                for (int first_word = rule->first_word; first_word < 2; first_word++) {
+                                        if (slot->forms[gender][first_word] == NO_RULE)
+                                                slot->forms[gender][first_word] = forms_idx;
+                                }
+                        }
+                }
+        }
+        return 0;
+}
+
+/// Ending given by a mod, being inserted into a lemma trie
+typedef struct {
+        const uint32_t *cps;                    ///< Reversed case-folded codepoints of the ending
+        size_t len;                             ///< Size of \c cps
+        uint32_t rank;                          ///< Priority of the rule: exceptions first, then suffixes, in file order
+        lemma_entry_t entry;
+} lemma_key_t;
+
+static int cmp_lemma_keys(const void *p1, const void *p2)
+{
+        const lemma_key_t *k1 = (const lemma_key_t *)p1;
+        const lemma_key_t *k2 = (const lemma_key_t *)p2;
+        for (size_t i = 0; i < k1->len && i < k2->len; i++) {
+                if (k1->cps[i] != k2->cps[i])
+                        return k1->cps[i] < k2->cps[i] ? -1 : 1;
+        }
+        if (k1->len != k2->len)
+                return k1->len < k2->len ? -1 : 1;
+        if (k1->rank != k2->rank)
+                return k1->rank < k2->rank ? -1 : 1;
+        if (k1->entry.dest_case != k2->entry.dest_case)
+                return k1->entry.dest_case < k2->entry.dest_case ? -1 : 1;
+        if (k1->entry.match != k2->entry.match)
+                return k1->entry.match < k2->entry.match ? -1 : 1;
+        return 0;
+}
+
+/// Fill node \c idx of the lemma trie from keys [lo, hi), which all share a prefix of length \c depth
+///
+/// @param b            Image being built, its lemma nodes and entries sections are already large enough
+/// @param next_node    Index of the next unused node
+/// @param next_entry   Index of the next unused entry
+static void build_lemma_node(builder_t *b, const lemma_key_t *keys, size_t lo, size_t hi, size_t depth,
+                             uint32_t *next_node, uint32_t *next_entry, uint32_t idx)
+{
+        lemma_node_t *nodes = (lemma_node_t *)b->sections[SECT_LEMMA_NODES].data;
+        lemma_entry_t *entries = (lemma_entry_t *)b->sections[SECT_LEMMA_ENTRIES].data;
+        lemma_node_t *node = &nodes[idx];
+
+        // Keys that end at this node sort before the longer ones, best rules first
+        node->first_entry = *next_entry;
+        for (; lo < hi && keys[lo].len == depth; lo++)
+                entries[(*next_entry)++] = keys[lo].entry;
+        node->num_entries = *next_entry - node->first_entry;
+
+        size_t num_children = 0;
+        for (size_t i = lo; i < hi; i++) {
+                if (i == lo || keys[i].cps[depth] != keys[i - 1].cps[depth])
+                        num_children++;
+        }
+        node->first_child = *next_node;
+        node->num_children = num_children;
+        *next_node += num_children;
+
+        uint32_t child_idx = node->first_child;
+        while (lo < hi) {
+                size_t end = lo + 1;
+                while (end < hi && keys[end].cps[depth] == keys[lo].cps[depth])
+                        end++;
+                nodes[child_idx].cp = keys[lo].cps[depth];
+                build_lemma_node(b, keys, lo, end, depth + 1, next_node, next_entry, child_idx);
+                child_idx++;
+                lo = end;
+        }
+}
+
+/// Check if a mod changes a test of its rule, and can be undone: it doesn't remove more than the test
+static bool is_invertible_mod(const mod_t *mod, cbuf_t test)
+{
+        return (mod->suffix_len != 0 || mod->cnt_remove != 0) && count_codepoints(test) >= mod->cnt_remove;
+}
+
+/// Compile the endings given by the mods of all rules of a name kind to their tests into a trie for lemmatization
+///
+/// Mods that leave names as they are are skipped: a name is always reported as its own nominative form anyway.
+static int build_lemma_trie(builder_t *b, rules_set_t *rules)
+{
+        const mod_rule_arr_t *arrs[] = { &rules->exceptions, &rules->suffixes };
+        const mod_rule_t *all_rules = (const mod_rule_t *)b->sections[SECT_RULES].data;
+        const str_ref_t *matches = (const str_ref_t *)b->sections[SECT_MATCHES].data;
+        const char *strings = b->sections[SECT_STRINGS].data;
+
+        int rc = ERR_NOMEM;
+        size_t num_keys = 0;
+        size_t num_cps = 0;
+        for (size_t a = 0; a < 2; a++) {
+                for (size_t i = 0; i < arrs[a]->num_rules; i++) {
+                        const mod_rule_t *rule = &all_rules[arrs[a]->first_rule + i];
+                        for (size_t j = 0; j < rule->num_matches; j++) {
+                                cbuf_t test = get_string(strings, matches[rule->first_match + j]);
+                                for (int k = 0; k < CASE_COUNT - 1; k++) {
+                                        if (is_invertible_mod(&rule->mods[k], test)) {
+                                                num_keys++;
+                                                num_cps += test.len + rule->mods[k].suffix_len;
+                                        }
+                                }
+                        }
+                }
+        }
+
+        lemma_key_t *keys = mem_calloc(b->alloc, num_keys + 1, sizeof(lemma_key_t));
+        uint32_t *cps = mem_calloc(b->alloc, num_cps + 1, sizeof(uint32_t));
+        if (!keys || !cps) {
+                debug_err("allocation failed");
+                goto out;
+        }
+
+        lemma_key_t *key = keys;
+        uint32_t *key_cps = cps;
+        uint32_t rank = 0;
+        for (size_t a = 0; a < 2; a++) {
+                for (size_t i = 0; i < arrs[a]->num_rules; i++, rank++) {
+                        uint32_t rule_idx = arrs[a]->first_rule + i;
+                        const mod_rule_t *rule = &all_rules[rule_idx];
+                        for (size_t j = 0; j < rule->num_matches; j++) {
+                                cbuf_t test = get_string(strings, matches[rule->first_match + j]);
+                                for (int k = 0; k < CASE_COUNT - 1; k++) {
+                                        const mod_t *mod = &rule->mods[k];
+                                        if (!is_invertible_mod(mod, test))
+                                                continue;
+                                        str_ref_t suffix_ref = { mod->suffix_off, mod->suffix_len };
+                                        cbuf_t suffix = get_string(strings, suffix_ref);
+                                        cbuf_t kept = { test.data, pop_n_codepoints(test, mod->cnt_remove) };
+                                        size_t suffix_cps = reverse_codepoints(suffix, key_cps);
+                                        size_t kept_cps = reverse_codepoints(kept, key_cps + suffix_cps);
+                                        if ((suffix_cps == 0 && suffix.len != 0) || (kept_cps == 0 && kept.len != 0)
+                                            || suffix_cps > UINT8_MAX) {
+                                                rc = build_error(b, "invalid suffix '%.*s'", (int)suffix.len,
+                                                                 suffix.data);
+                                                goto out;
+                                        }
+                                        key->cps = key_cps;
+                                        key->len = suffix_cps + kept_cps;
+                                        key->rank = rank;
+                                        key->entry.rule = rule_idx;
+                                        key->entry.match = rule->first_match + j;
+                                        key->entry.dest_case = k + 1;
+                                        key->entry.suffix_cps = suffix_cps;
+                                        key_cps += key->len;
+                                        key++;
+                                }
+                        }
+                }
+        }
+        qsort(keys, num_keys, sizeof(lemma_key_t), cmp_lemma_keys);
+
+        // Every key becomes an entry, but nodes are reserved for the worst case and the unused ones are dropped
+        uint32_t next_entry = sect_count(b, SECT_LEMMA_ENTRIES);
+        rules->lemma_trie.root = sect_count(b, SECT_LEMMA_NODES);
+        if (!sect_grow(b, SECT_LEMMA_ENTRIES, num_keys) || !sect_grow(b, SECT_LEMMA_NODES, num_cps + 1))
+                goto out;
+        uint32_t next_node = rules->lemma_trie.root + 1;
+        build_lemma_node(b, keys, 0, num_keys, 0, &next_node, &next_entry, rules->lemma_trie.root);
+        rules->lemma_trie.num_nodes = next_node - rules->lemma_trie.root;
+        b->sections[SECT_LEMMA_NODES].len = next_node * sizeof(lemma_node_t);
+        rc = 0;
+out:
+        mem_free(b->alloc, cps);
+        mem_free(b->alloc, keys);
+        return rc;
+}
+
+/// Load all rules into the image builder
+static int load_rules(builder_t *b, const char *data, size_t len)
+{
+        // Mods without a suffix are left zeroed, so the UTF-16 suffixes start with the empty one
+        if (!sect_grow(b, SECT_SUFFIXES_U16, 1))
+                return ERR_NOMEM;
+        int rc = parse_rules(b, data, len);
+        if (rc != 0)
+                return rc;
+
+        for (int i = 0; i < NAME_KIND_COUNT; i++) {
+                rules_set_t *rules = &b->sets[i];
+                rc = build_suffix_trie(b, &rules->suffixes, i, &rules->suffix_trie);
+                if (rc != 0)
+                        return rc;
+                rc = build_exc_index(b, &rules->exceptions, &rules->exc_index);
+                if (rc != 0)
+                        return rc;
+                rc = build_lemma_trie(b, rules);
+                if (rc != 0)
+                        return rc;
+                rules->cyrillic_only = is_cyrillic_only(b, &rules->suffixes) && is_cyrillic_only(b, &rules->exceptions);
+        }
+        return 0;
+}
+
+/// Copy compiled rules into a single image
+static int build_image(const builder_t *b, image_header_t **pimage)
+{
+        image_section_t sections[SECT_COUNT];
+        for (int i = 0; i < SECT_COUNT; i++)
+                sections[i].count = sect_count(b, i);
+        size_t size = layout_sections(sections);
+        if (size > UINT32_MAX)
+                return build_error(b, "rules are too large");
+
+        char *data = mem_calloc(b->alloc, size, 1);
+        if (!data) {
+                debug_err("allocation failed");
+                return ERR_NOMEM;
+        }
+        image_header_t *image = (image_header_t *)data;
+        memcpy(image->magic, IMAGE_MAGIC, sizeof(image->magic));
+        image->version = IMAGE_VERSION;
+        image->byte_order = IMAGE_BYTE_ORDER;
+        image->size = size;
+        memcpy(image->sections, sections, sizeof(sections));
+        memcpy(image->sets, b->sets, sizeof(image->sets));
+        for (int i = 0; i < SECT_COUNT; i++) {
+                if (b->sections[i].len != 0)
+                        memcpy(data + sections[i].off, b->sections[i].data, b->sections[i].len);
+        }
+        *pimage = image;
+        return 0;
+}
+
+/// Check that a string reference stays within the strings section
+static bool is_valid_str_ref(const image_header_t *image, str_ref_t ref)
+{
+        return (uint64_t)ref.off + ref.len <= image->sections[SECT_STRINGS].count;
+}
+
+/// Check that a suffix and its uppercase copy are within the strings section, and its UTF-16 copies are within the
+/// UTF-16 suffixes section
+static bool is_valid_suffix_ref(const petr_context_t *view, const mod_t *mod)
+{
+        const image_header_t *image = view->image;
+        uint32_t num_units = image->sections[SECT_SUFFIXES_U16].count;
+        return (uint64_t)mod->suffix_off + 2 * (uint64_t)mod->suffix_len <= image->sections[SECT_STRINGS].count
+               && mod->suffix16_off < num_units
+               && mod->suffix16_off + 1 + 2 * (uint32_t)view->suffixes_u16[mod->suffix16_off] <= num_units;
+}
+
+/// Check that an exceptions index is consistent and has at least one empty slot
+static bool is_valid_exc_index(const petr_context_t *view, exc_index_t index)
+{
+        const image_header_t *image = view->image;
+        if (index.num_slots == 0 || (index.num_slots & (index.num_slots - 1)) != 0
+            || (uint64_t)index.first_slot + index.num_slots > image->sections[SECT_EXC_SLOTS].count)
+                return false;
+
+        bool have_empty = false;
+        for (uint32_t i = 0; i < index.num_slots; i++) {
+                const exc_slot_t *slot = &view->exc_slots[index.first_slot + i];
+                if (slot->word.len == 0) {
+                        have_empty = true;
+                        continue;
+                }
+                if (!is_valid_str_ref(image, slot->word))
+                        return false;
+                for (int gender = 0; gender < GENDER_COUNT; gender++) {
+                        for (int first_word = 0; first_word < 2; first_word++) {
+                                uint32_t forms_idx = slot->forms[gender][first_word];
+                                if (forms_idx == NO_RULE)
+                                        continue;
+                                if (forms_idx >= image->sections[SECT_EXC_FORMS].count)
+                                        return false;
+                                for (int k = 0; k < CASE_COUNT - 1; k++) {
+                                        if (view->exc_forms[forms_idx].keep_len[k] > slot->word.len)
+                                                return false;
+                                }
+                        }
+                }
+        }
+        return have_empty;
+}
+
+/// Check that the rules image is consistent, so that it can be used without any further checks
+static int validate_image(const void *data, size_t size)
+{
+        const image_header_t *image = (const image_header_t *)data;
+        if (size < sizeof(image_header_t) || memcmp(image->magic, IMAGE_MAGIC, sizeof(image->magic)) != 0) {
+                debug_err("not a compiled rules file");
+                return ERR_INVALID_RULES;
+        }
+        if (image->version != IMAGE_VERSION || image->byte_order != IMAGE_BYTE_ORDER) {
+                debug_err("unsupported compiled rules version %u", (unsigned)image->version);
+                return ERR_INVALID_RULES;
+        }
+        if (image->size != size) {
+                debug_err("truncated compiled rules file");
+                return ERR_INVALID_RULES;
+        }
+        for (int i = 0; i < SECT_COUNT; i++) {
+                image_section_t sect = image->sections[i];
+                if (sect.off < sizeof(image_header_t) || sect.off % 8 != 0
+                    || (uint64_t)sect.off + (uint64_t)sect.count * g_sect_elem_size[i] > size) {
+                        debug_err("invalid section %d", i);
+                        return ERR_INVALID_RULES;
+                }
+        }
+
+        petr_context_t view;
+        attach_image(&view, image);
+        uint32_t num_rules = image->sections[SECT_RULES].count;
+        uint32_t num_nodes = image->sections[SECT_TRIE_NODES].count;
+
+        for (uint32_t i = 0; i < num_rules; i++) {
+                const mod_rule_t *rule = &view.rules[i];
+                bool valid = rule->gender < GENDER_COUNT
+                             && (uint64_t)rule->first_match + rule->num_matches <= image->sections[SECT_MATCHES].count;
+                for (int k = 0; k < CASE_COUNT - 1; k++)
+                        valid = valid && is_valid_suffix_ref(&view, &rule->mods[k]);
+                if (!valid) {
+                        debug_err("invalid rule %u", (unsigned)i);
+                        return ERR_INVALID_RULES;
+                }
+        }
+        for (uint32_t i = 0; i < image->sections[SECT_MATCHES].count; i++) {
+                if (!is_valid_str_ref(image, view.matches[i])) {
+                        debug_err("invalid match %u", (unsigned)i);
+                        return ERR_INVALID_RULES;
+                }
+        }
+        for (uint32_t i = 0; i < num_nodes; i++) {
+                const trie_node_t *node = &view.trie_nodes[i];
+                bool valid = (uint64_t)node->first_child + node->num_children <= num_nodes
+                             && node->gender <= GEND_UNKNOWN;
+                for (int gender = 0; gender < GENDER_COUNT; gender++) {
+                        for (int first_word = 0; first_word < 2; first_word++) {
+                                uint32_t rule_idx = node->best[gender][first_word];
+                                valid = valid && (rule_idx == NO_RULE || rule_idx < num_rules);
+                        }
+                }
+                if (!valid) {
+                        debug_err("invalid trie node %u", (unsigned)i);
+                        return ERR_INVALID_RULES;
+                }
+        }
+        for (uint32_t i = 0; i < image->sections[SECT_EXC_FORMS].count; i++) {
+                if (view.exc_forms[i].rule >= num_rules) {
+                        debug_err("invalid exception forms %u", (unsigned)i);
+                        return ERR_INVALID_RULES;
+                }
+        }
+        uint32_t num_lemma_nodes = image->sections[SECT_LEMMA_NODES].count;
+        for (uint32_t i = 0; i < num_lemma_nodes; i++) {
+                const lemma_node_t *node = &view.lemma_nodes[i];
+                if ((uint64_t)node->first_child + node->num_children > num_lemma_nodes
+                    || (uint64_t)node->first_entry + node->num_entries > image->sections[SECT_LEMMA_ENTRIES].count) {
+                        debug_err("invalid lemma trie node %u", (unsigned)i);
+                        return ERR_INVALID_RULES;
+                }
+        }
+        for (uint32_t i = 0; i < image->sections[SECT_LEMMA_ENTRIES].count; i++) {
+                const lemma_entry_t *entry = &view.lemma_entries[i];
+                if (entry->rule >= num_rules || entry->match >= image->sections[SECT_MATCHES].count
+                    || entry->dest_case == CASE_NOMINATIVE || entry->dest_case >= CASE_COUNT) {
+                        debug_err("invalid lemma trie entry %u", (unsigned)i);
+                        return ERR_INVALID_RULES;
+                }
+        }
+        for (int kind = 0; kind < NAME_KIND_COUNT; kind++) {
+                const rules_set_t *rules = &image->sets[kind];
+                bool valid = (uint64_t)rules->suffixes.first_rule + rules->suffixes.num_rules <= num_rules
+                             && (uint64_t)rules->exceptions.first_rule + rules->exceptions.num_rules <= num_rules
+                             && rules->suffix_trie.num_nodes != 0
+                             && (uint64_t)rules->suffix_trie.root + rules->suffix_trie.num_nodes <= num_nodes
+                             && is_valid_exc_index(&view, rules->exc_index)
+                             && rules->lemma_trie.num_nodes != 0
+                             && (uint64_t)rules->lemma_trie.root + rules->lemma_trie.num_nodes <= num_lemma_nodes;
+                if (!valid) {
+                        debug_err("invalid rules set %d", kind);
+                        return ERR_INVALID_RULES;
+                }
+        }
+        return 0;
+}
+
+#if !defined(NDEBUG) && !defined(PETROVICH_NDEBUG)
+/// Output a \c mod_rule_t to IO stream. For debugging purposes.
+static void dump_rule(const petr_context_t *ctx, const mod_rule_t *rule, FILE *fp)
+{
+        const char *gender_str = "";
+        switch (rule->gender) {
+        case GEND_MALE:
+                gender_str = "male";
+                break;
+        case GEND_FEMALE:
+                gender_str = "female";
+                break;
+        case GEND_ANDROGYNOUS:
+                gender_str = "androgynous";
+                break;
+        }
+        fprintf(fp, "      gender: %s\n", gender_str);
+        fprintf(fp, "      %u matches:", (unsigned)rule->num_matches);
+        for (size_t i = 0; i < rule->num_matches; i++) {
+                cbuf_t match = get_string(ctx->strings, ctx->matches[rule->first_match + i]);
+                fprintf(fp, " '%.*s'", (int)match.len, match.data);
+        }
+        fprintf(fp, "\n      mods:");
+        for (size_t i = 0; i < CASE_COUNT - 1; i++) {
+                const mod_t *mod = &rule->mods[i];
+                cbuf_t suffix = get_suffix(ctx, mod, false);
+                fprintf(fp, " -%u+'%.*s'", (unsigned)mod->cnt_remove, (int)suffix.len, suffix.data);
+        }
+        fprintf(fp, "\n");
+}
+
+/// Output a \c mod_rule_arr_t to IO stream. For debugging purposes.
+static void dump_rules(const petr_context_t *ctx, const mod_rule_arr_t *arr, FILE *fp)
+{
+        for (size_t i = 0; i < arr->num_rules; i++) {
+                fprintf(fp, "    rule %zu\n", i);
+                const mod_rule_t *rule = &ctx->rules[arr->first_rule + i];
+                dump_rule(ctx, rule, fp);
+        }
+}
+
+/// Output a \c petr_context_t to IO stream. For debugging purposes.
+__attribute__((used))
+static void dump_context(const petr_context_t *ctx, FILE *fp)
+{
+        for (int kind = 0; kind < NAME_KIND_COUNT; kind++) {
+                switch (kind) {
+                case NAME_FIRST:
+                        fprintf(fp, "first name\n");
+                        break;
+                case NAME_MIDDLE:
+                        fprintf(fp, "middle name\n");
+                        break;
+                case NAME_LAST:
+                        fprintf(fp, "last name\n");
+                        break;
+                }
+
+                fprintf(fp, "  exceptions\n");
+                dump_rules(ctx, &ctx->image->sets[kind].exceptions, fp);
+                fprintf(fp, "  suffixes\n");
+                dump_rules(ctx, &ctx->image->sets[kind].suffixes, fp);
+        }
+}
+#endif
+
+/// Initialize library context from the rules file
+///
+/// @param path         Path of the rules YAML file
+/// @param pctx         Pointer to context object (output parameter)
+/// @returns            Error code (0, if succeeded)
+int petr_init_from_file(const char *path, petr_context_t **pctx)
+{
+        return petr_init_from_file_with_allocator(path, NULL, pctx);
+}
+
+/// Initialize library context from the rules file, allocating memory with the given allocator
+///
+/// The allocator is used for everything the context allocates while loading and later (e.g., the cache), until
+/// \c petr_free_context.
+///
+/// @param path         Path of the rules YAML file
+/// @param allocator    Allocator, copied into the context. NULL for the standard \c malloc and \c free.
+/// @param pctx         Pointer to context object (output parameter)
+/// @returns            Error code (0, if succeeded)
+int petr_init_from_file_with_allocator(const char *path, const petr_allocator_t *allocator, petr_context_t **pctx)
+{
+        if (allocator == NULL)
+                allocator = &g_default_allocator;
+        int rc = ERR_FILE;
+        FILE *fp = fopen(path, "r");
+        if (!fp) {
+                debug_err("failed to open rules file");
+                goto out;
+        }
+        fseek(fp, 0, SEEK_END);
+        uint64_t sz = ftell(fp);
+        if (!sz) {
+                debug_err("empty rules file");
+                goto close_file;
+        }
+        fseek(fp, 0, SEEK_SET);
+        char *buf = mem_alloc(allocator, sz);
+        if (!buf) {
+                rc = ERR_NOMEM;
+                goto close_file;
+        }
+        uint64_t cnt_read = fread(buf, 1, sz, fp);
+        if (cnt_read != sz) {
+                debug_err("failed to read rules");
+                goto free_mem;
+        }
+        rc = petr_init_from_string_with_allocator(buf, sz, allocator, pctx);
+free_mem:
+        mem_free(allocator, buf);
+close_file:
+        fclose(fp);
+out:
+        return rc;
+}
+
+/// Initialize library context from the rules file contents
+///
+/// @param data         Contents of the rules file
+/// @param len          Length of \c data
+/// @param pctx         Pointer to context object (output parameter)
+/// @returns            Error code (0, if succeeded)
+int petr_init_from_string(const char *data, size_t len, petr_context_t **pctx)
+{
+        return petr_init_from_string_with_allocator(data, len, NULL, pctx);
+}
+
+/// Initialize library context from the rules file contents, allocating memory with the given allocator
+///
+/// @param allocator    Allocator, copied into the context. NULL for the standard \c malloc and \c free.
+/// @see petr_init_from_string
+/// @see petr_init_from_file_with_allocator
+int petr_init_from_string_with_allocator(const char *data, size_t len, const petr_allocator_t *allocator,
+                                         petr_context_t **pctx)
+{
+        return petr_init_from_string_with_error(data, len, allocator, NULL, pctx);
+}
+
+/// Initialize library context from the rules file contents, describing the error if the rules are invalid
+///
+/// @param data         Contents of the rules file
+/// @param len          Length of \c data
+/// @param allocator    Allocator, copied into the context. NULL for the standard \c malloc and \c free.
+/// @param error        Description of the error, if \c ERR_INVALID_RULES is returned. May be NULL.
+/// @param pctx         Pointer to context object (output parameter)
+/// @returns            Error code (0, if succeeded)
+int petr_init_from_string_with_error(const char *data, size_t len, const petr_allocator_t *allocator,
+                                     petr_rules_error_t *error, petr_context_t **pctx)
+{
+        if (allocator == NULL)
+                allocator = &g_default_allocator;
+        if (error != NULL)
+                memset(error, 0, sizeof(*error));
+        int rc = ERR_NOMEM;
+        builder_t b;
+        memset(&b, 0, sizeof(b));
+        petr_context_t *ctx = mem_calloc(allocator, 1, sizeof(petr_context_t));
+        if (!ctx)
+                goto out;
+        ctx->allocator = *allocator;
+        b.alloc = &ctx->allocator;
+        b.error = error;
+
+        image_header_t *image = NULL;
+        rc = load_rules(&b, data, len);
+        if (rc == 0)
+                rc = build_image(&b, &image);
+        for (int i = 0; i < SECT_COUNT; i++)
+                mem_free(allocator, b.sections[i].data);
+        if (rc != 0)
+                goto free_ctx;
+
+        attach_image(ctx, image);
+        *pctx = ctx;
+        return 0;
+free_ctx:
+        mem_free(allocator, ctx);
+out:
+        if (rc == ERR_INVALID_RULES && error != NULL && error->message[0] == '\0')
+                snprintf(error->message, sizeof(error->message), "invalid rules");
+        return rc;
+}
+
+/// Initialize library context from a compiled rules file
+///
+/// The file is mapped into memory and used in place, so all processes loading the same file share its pages.
+///
+/// @param path         Path of the file written by \c petr_save_compiled
+/// @param pctx         Pointer to context object (output parameter)
+/// @returns            Error code (0, if succeeded)
+int petr_init_from_mmap(const char *path, petr_context_t **pctx)
+{
+        return petr_init_from_mmap_with_allocator(path, NULL, pctx);
+}
+
+/// Initialize library context from a compiled rules file, allocating memory with the given allocator
+///
+/// @param allocator    Allocator, copied into the context. NULL for the standard \c malloc and \c free.
+/// @see petr_init_from_mmap
+/// @see petr_init_from_file_with_allocator
+int petr_init_from_mmap_with_allocator(const char *path, const petr_allocator_t *allocator, petr_context_t **pctx)
+{
+        if (allocator == NULL)
+                allocator = &g_default_allocator;
+        int rc = ERR_FILE;
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+                debug_err("failed to open compiled rules file");
+                goto out;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+                debug_err("failed to read compiled rules file");
+                goto close_file;
+        }
+        size_t size = st.st_size;
+        void *data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+                debug_err("failed to map compiled rules file");
+                goto close_file;
+        }
+        rc = validate_image(data, size);
+        if (rc != 0)
+                goto unmap;
+        petr_context_t *ctx = mem_calloc(allocator, 1, sizeof(petr_context_t));
+        if (!ctx) {
+                rc = ERR_NOMEM;
+                goto unmap;
+        }
+        ctx->allocator = *allocator;
+        ctx->storage = STORAGE_MMAP;
+        attach_image(ctx, (const image_header_t *)data);
+        *pctx = ctx;
+        close(fd);
+        return 0;
+unmap:
+        munmap(data, size);
+close_file:
+        close(fd);
+out:
+        return rc;
+}
+
+#ifdef PETROVICH_DEFAULT_RULES
+#include "default_rules.inc"
+
+/// Context with the default rules
+static const petr_context_t g_default_context = {
+        &g_default_image,
+        STORAGE_STATIC,
+        g_default_rules,
+        g_default_matches,
+        g_default_trie_nodes,
+        g_default_exc_slots,
+        g_default_exc_forms,
+        g_default_lemma_nodes,
+        g_default_lemma_entries,
+        g_default_suffixes_u16,
+        g_default_strings,
+        NULL,
+        DEFAULT_ALLOCATOR,
+};
+#endif
+
+/// Get library context with the default rules (the ones from 'rules.yml' of this library)
+///
+/// The rules are compiled into the library as static tables, so the context needs neither initialization nor
+/// memory allocation. It is shared and must not be freed.
+///
+/// @returns            Context object, or NULL if the library was built without the default rules
+const petr_context_t *petr_default_context(void)
+{
+#ifdef PETROVICH_DEFAULT_RULES
+        return &g_default_context;
+#else
+        return NULL;
+#endif
+}
+
+/// Get contents of an image section of the context
+static const void *get_section(const petr_context_t *ctx, int sect)
+{
+        switch (sect) {
+        case SECT_RULES:
+                return ctx->rules;
+        case SECT_MATCHES:
+                return ctx->matches;
+        case SECT_TRIE_NODES:
+                return ctx->trie_nodes;
+        case SECT_EXC_SLOTS:
+                return ctx->exc_slots;
+        case SECT_EXC_FORMS:
+                return ctx->exc_forms;
+        case SECT_LEMMA_NODES:
+                return ctx->lemma_nodes;
+        case SECT_LEMMA_ENTRIES:
+                return ctx->lemma_entries;
+        case SECT_SUFFIXES_U16:
+                return ctx->suffixes_u16;
+        default:
+                return ctx->strings;
+        }
+}
+
+/// Write compiled rules to a file, which can be loaded with \c petr_init_from_mmap
+///
+/// The file can only be loaded by a library using the same format version, on a machine with the same byte order.
+///
+/// @param ctx          Library context object
+/// @param path         Path of the output file
+/// @returns            Error code (0, if succeeded)
+int petr_save_compiled(const petr_context_t *ctx, const char *path)
+{
+        // Sections of the context are not necessarily laid out as in a file (e.g., for the default context)
+        image_header_t header = *ctx->image;
+        size_t size = layout_sections(header.sections);
+        header.size = size;
+
+        FILE *fp = fopen(path, "wb");
+        if (!fp) {
+                debug_err("failed to open output file");
+                return ERR_FILE;
+        }
+        bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+        size_t pos = sizeof(header);
+        for (int i = 0; ok && i < SECT_COUNT; i++) {
+                static const char padding[8] = { 0 };
+                size_t sect_size = header.sections[i].count * g_sect_elem_size[i];
+                ok = fwrite(padding, 1, header.sections[i].off - pos, fp) == header.sections[i].off - pos
+                     && fwrite(get_section(ctx, i), 1, sect_size, fp) == sect_size;
+                pos = header.sections[i].off + sect_size;
+        }
+        if (fclose(fp) != 0 || !ok) {
+                debug_err("failed to write compiled rules");
+                return ERR_FILE;
+        }
+        return 0;
+}
+
+/// Output \c count 32-bit numbers as a C array initializer
+static void write_c_uints(const uint32_t *data, size_t count, FILE *fp)
+{
+        fprintf(fp, "{");
+        for (size_t i = 0; i < count; i++)
+                fprintf(fp, i == 0 ? " %lu" : ", %lu", (unsigned long)data[i]);
+        fprintf(fp, " }");
+}
+
+/// Output a table indexed by gender and first_word as a C array initializer
+static void write_c_gender_table(const uint32_t table[GENDER_COUNT][2], FILE *fp)
+{
+        fprintf(fp, "{");
+        for (int gender = 0; gender < GENDER_COUNT; gender++) {
+                fprintf(fp, gender == 0 ? " " : ", ");
+                write_c_uints(table[gender], 2, fp);
+        }
+        fprintf(fp, " }");
+}
+
+/// Write compiled rules as C source, which defines them as static tables
+///
+/// The output is used to compile the default rules into the library (see \c petr_default_context).
+///
+/// @param ctx          Library context object
+/// @param path         Path of the output file
+/// @returns            Error code (0, if succeeded)
+int petr_save_compiled_source(const petr_context_t *ctx, const char *path)
+{
+        FILE *fp = fopen(path, "w");
+        if (!fp) {
+                debug_err("failed to open output file");
+                return ERR_FILE;
+        }
+        const image_header_t *image = ctx->image;
+        fprintf(fp, "// Compiled rules for petrovich.c, generated by petr_compile_rules. Do not edit.\n");
+
+        // Zero-sized arrays are not allowed, so empty tables get a single zero element
+        static const mod_rule_t zero_rule;
+        static const str_ref_t zero_match;
+        static const trie_node_t zero_node;
+        static const exc_slot_t zero_slot;
+        static const exc_forms_t zero_forms;
+        static const lemma_node_t zero_lemma_node;
+        static const lemma_entry_t zero_lemma_entry;
+#define EMPTY_OR(sect, table, i, zero) \
+        (image->sections[sect].count == 0 ? &zero : &table[i])
+#define TABLE_SIZE(sect) (image->sections[sect].count ? image->sections[sect].count : 1)
+
+        fprintf(fp, "\nstatic const mod_rule_t g_default_rules[] = {\n");
+        for (uint32_t i = 0; i < TABLE_SIZE(SECT_RULES); i++) {
+                const mod_rule_t *rule = EMPTY_OR(SECT_RULES, ctx->rules, i, zero_rule);
+                fprintf(fp, "        { %lu, %lu, {", (unsigned long)rule->first_match,
+                        (unsigned long)rule->num_matches);
+                for (int k = 0; k < CASE_COUNT - 1; k++) {
+                        const mod_t *mod = &rule->mods[k];
+                        fprintf(fp, "%s { %lu, %u, %u, %u }", k == 0 ? "" : ",", (unsigned long)mod->suffix_off,
+                                mod->suffix_len, mod->cnt_remove, mod->suffix16_off);
+                }
+                fprintf(fp, " }, %u, %u, { 0, 0 } },\n", rule->gender, rule->first_word);
+        }
+        fprintf(fp, "};\n");
+
+        fprintf(fp, "\nstatic const str_ref_t g_default_matches[] = {\n");
+        for (uint32_t i = 0; i < TABLE_SIZE(SECT_MATCHES); i++) {
+                const str_ref_t *match = EMPTY_OR(SECT_MATCHES, ctx->matches, i, zero_match);
+                fprintf(fp, "        { %lu, %lu },\n", (unsigned long)match->off, (unsigned long)match->len);
+        }
+        fprintf(fp, "};\n");
+
+        fprintf(fp, "\nstatic const trie_node_t g_default_trie_nodes[] = {\n");
+        for (uint32_t i = 0; i < TABLE_SIZE(SECT_TRIE_NODES); i++) {
+                const trie_node_t *node = EMPTY_OR(SECT_TRIE_NODES, ctx->trie_nodes, i, zero_node);
+                fprintf(fp, "        { %lu, %lu, %u, %u, 0, ", (unsigned long)node->cp,
+                        (unsigned long)node->first_child, node->num_children, node->gender);
+                write_c_gender_table(node->best, fp);
+                fprintf(fp, " },\n");
+        }
+        fprintf(fp, "};\n");
+
+        fprintf(fp, "\nstatic const exc_slot_t g_default_exc_slots[] = {\n");
+        for (uint32_t i = 0; i < TABLE_SIZE(SECT_EXC_SLOTS); i++) {
+                const exc_slot_t *slot = EMPTY_OR(SECT_EXC_SLOTS, ctx->exc_slots, i, zero_slot);
+                fprintf(fp, "        { { %lu, %lu }, %lu, ", (unsigned long)slot->word.off,
+                        (unsigned long)slot->word.len, (unsigned long)slot->hash);
+                write_c_gender_table(slot->forms, fp);
+                fprintf(fp, " },\n");
+        }
+        fprintf(fp, "};\n");
+
+        fprintf(fp, "\nstatic const exc_forms_t g_default_exc_forms[] = {\n");
+        for (uint32_t i = 0; i < TABLE_SIZE(SECT_EXC_FORMS); i++) {
+                const exc_forms_t *forms = EMPTY_OR(SECT_EXC_FORMS, ctx->exc_forms, i, zero_forms);
+                fprintf(fp, "        { %lu, ", (unsigned long)forms->rule);
+                write_c_uints(forms->keep_len, CASE_COUNT - 1, fp);
+                fprintf(fp, " },\n");
+        }
+        fprintf(fp, "};\n");
+
+        fprintf(fp, "\nstatic const lemma_node_t g_default_lemma_nodes[] = {\n");
+        for (uint32_t i = 0; i < TABLE_SIZE(SECT_LEMMA_NODES); i++) {
+                const lemma_node_t *node = EMPTY_OR(SECT_LEMMA_NODES, ctx->lemma_nodes, i, zero_lemma_node);
+                fprintf(fp, "        { %lu, %lu, %lu, %lu, %lu },\n", (unsigned long)node->cp,
+                        (unsigned long)node->first_child, (unsigned long)node->num_children,
+                        (unsigned long)node->first_entry, (unsigned long)node->num_entries);
+        }
+        fprintf(fp, "};\n");
+
+        fprintf(fp, "\nstatic const lemma_entry_t g_default_lemma_entries[] = {\n");
+        for (uint32_t i = 0; i < TABLE_SIZE(SECT_LEMMA_ENTRIES); i++) {
+                const lemma_entry_t *entry = EMPTY_OR(SECT_LEMMA_ENTRIES, ctx->lemma_entries, i, zero_lemma_entry);
+                fprintf(fp, "        { %lu, %lu, %u, %u, { 0, 0 } },\n", (unsigned long)entry->rule,
+                        (unsigned long)entry->match, entry->dest_case, entry->suffix_cps);
+        }
+        fprintf(fp, "};\n");
+
+        fprintf(fp, "\nstatic const uint16_t g_default_suffixes_u16[] = {");
+        for (uint32_t i = 0; i < TABLE_SIZE(SECT_SUFFIXES_U16); i++) {
+                uint16_t unit = image->sections[SECT_SUFFIXES_U16].count ? ctx->suffixes_u16[i] : 0;
+                fprintf(fp, i % 12 == 0 ? "\n        0x%04x," : " 0x%04x,", unit);
+        }
+        fprintf(fp, "\n};\n");
+#undef TABLE_SIZE
+#undef EMPTY_OR
+
+        fprintf(fp, "\nstatic const char g_default_strings[] =");
+        for (uint32_t i = 0; i < image->sections[SECT_STRINGS].count; i++) {
+                if (i % 16 == 0)
+                        fprintf(fp, "\n        \"");
+                fprintf(fp, "\\x%02x", (unsigned char)ctx->strings[i]);
+                if (i % 16 == 15 || i + 1 == image->sections[SECT_STRINGS].count)
+                        fprintf(fp, "\"");
+        }
+        fprintf(fp, "\n        \"\";\n");
+
+        // Only element counts of the sections matter, the tables above are separate arrays
+        fprintf(fp, "\nstatic const image_header_t g_default_image = {\n");
+        fprintf(fp, "        IMAGE_MAGIC, IMAGE_VERSION, IMAGE_BYTE_ORDER, 0,\n        {");
+        for (int i = 0; i < SECT_COUNT; i++)
+                fprintf(fp, "%s { 0, %lu }", i == 0 ? "" : ",", (unsigned long)image->sections[i].count);
+        fprintf(fp, " },\n        {\n");
+        for (int kind = 0; kind < NAME_KIND_COUNT; kind++) {
+                const rules_set_t *rules = &image->sets[kind];
+                fprintf(fp, "                { { %lu, %lu }, { %lu, %lu }, { %lu, %lu }, { %lu, %lu }, %lu,"
+                        " { %lu, %lu } },\n",
+                        (unsigned long)rules->suffixes.first_rule, (unsigned long)rules->suffixes.num_rules,
+                        (unsigned long)rules->exceptions.first_rule, (unsigned long)rules->exceptions.num_rules,
+                        (unsigned long)rules->suffix_trie.root, (unsigned long)rules->suffix_trie.num_nodes,
+                        (unsigned long)rules->exc_index.first_slot, (unsigned long)rules->exc_index.num_slots,
+                        (unsigned long)rules->cyrillic_only, (unsigned long)rules->lemma_trie.root,
+                        (unsigned long)rules->lemma_trie.num_nodes);
+        }
+        fprintf(fp, "        },\n};\n");
+
+        if (fclose(fp) != 0) {
+                debug_err("failed to write compiled rules");
+                return ERR_FILE;
+        }
+        return 0;
+}
+
+/// Free library context
+///
+/// @param ctx          Context allocated by one of \c petr_init_* functions
+void petr_free_context(petr_context_t *ctx)
+{
+        if (ctx->cache != NULL)
+                cache_destroy(ctx->cache);
+        switch (ctx->storage) {
+        case STORAGE_HEAP:
+                mem_free(&ctx->allocator, (void *)ctx->image);
+                break;
+        case STORAGE_MMAP:
+                munmap((void *)ctx->image, ctx->image->size);
+                break;
+        case STORAGE_STATIC:
+                // The default context is never freed
+                return;
+        }
+        petr_allocator_t allocator = ctx->allocator;
+        mem_free(&allocator, ctx);
+}
+
+/// Get the allocator of a context
+const petr_allocator_t *context_allocator(const petr_context_t *ctx)
+{
+        return &ctx->allocator;
+}
+
+/// Enable caching of inflection results
+///
+/// Only \c petr_inflect and the functions based on it use the cache. Must be called before the context is shared
+/// between threads. The default context cannot have a cache.
+///
+/// @param ctx           Library context object
+/// @param max_bytes     Upper limit of memory used by the cache, at least 128 bytes (a single entry)
+/// @returns             Error code (0, if succeed), \c ERR_INVALID_ARG for the default context, a context that
+///                      already has a cache or a smaller limit
+int petr_enable_cache(petr_context_t *ctx, size_t max_bytes)
+{
+        // Rejected arguments are reported to the caller only, like in petr_handle_create
+        if (ctx->storage == STORAGE_STATIC || ctx->cache != NULL || max_bytes < CACHE_ENTRY_SIZE)
+                return ERR_INVALID_ARG;
+        ctx->cache = cache_create(max_bytes, &ctx->allocator);
+        if (ctx->cache == NULL) {
+                debug_err("failed to allocate cache");
+                return ERR_NOMEM;
+        }
+        return 0;
+}
+
+/// Get counters of the inflection results cache
+///
+/// @param ctx           Library context object
+/// @param stats         Destination for the counters, all zero if the cache is not enabled
+void petr_get_cache_stats(const petr_context_t *ctx, petr_cache_stats_t *stats)
+{
+        if (ctx->cache != NULL)
+                cache_get_stats(ctx->cache, stats);
+        else
+                memset(stats, 0, sizeof(*stats));
+}
+
+/// Look the whole name up in the exceptions index
+///
+/// @param ctx           Library context object
+/// @param index         Exceptions index
+/// @param first_word    If true, this is the first word of a multi-part name
+/// @param gender        Grammatical gender
+/// @param name          Name string
+/// @param hash          \c rus_utf8_hash of \c name
+/// @returns             Inflections of the matched exception, or NULL if not found
+static const exc_forms_t *match_exceptions(const petr_context_t *ctx, const exc_index_t *index, bool first_word,
+                                           petr_gender_t gender, cbuf_t name, uint32_t hash)
+{
+        const exc_slot_t *slots = &ctx->exc_slots[index->first_slot];
+        const exc_slot_t *slot = &slots[find_exc_slot(slots, index->num_slots, ctx->strings, name, hash)];
+        if (slot->word.len == 0)
+                return NULL;
+        uint32_t forms_idx = slot->forms[gender][first_word];
+        return forms_idx == NO_RULE ? NULL : &ctx->exc_forms[forms_idx];
+}
+
+/// Find the child of a trie node for a case-folded codepoint
+///
+/// @returns             Child node, or NULL if there is none
+static inline const trie_node_t *find_trie_child(const trie_node_t *nodes, const trie_node_t *node, uint32_t cp)
+{
+        // Binary search among children
+        const trie_node_t *lo = &nodes[node->first_child];
+        const trie_node_t *end = lo + node->num_children;
+        const trie_node_t *hi = end;
+        while (lo < hi) {
+                const trie_node_t *mid = lo + (hi - lo) / 2;
+                if (mid->cp < cp)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        return (lo == end || lo->cp != cp) ? NULL : lo;
+}
+
+/// Find the deepest trie node matching the name ending
+///
+/// Walks the name backwards down the trie. Each node already stores the first suitable rule and the gender suggested
+/// among itself and all its ancestors, so both are taken from the deepest node reached.
+///
+/// @param ctx           Library context object
+/// @param node          Node to start from: the root, or the node reached by the codepoints after \c name
+/// @param name          Name string
+/// @returns             Deepest matched node
+static const trie_node_t *walk_suffix_trie_from(const petr_context_t *ctx, const trie_node_t *node, cbuf_t name)
+{
+        while (name.len != 0 && node->num_children != 0) {
+                uint32_t cp;
+                size_t cp_len = get_last_codepoint(name, &cp);
+                if (cp_len == 0)
+                        break;
+                const trie_node_t *child = find_trie_child(ctx->trie_nodes, node, rus_lowercase(cp));
+                if (child == NULL)
+                        break;
+                name.len -= cp_len;
+                node = child;
+        }
+        return node;
+}
+
+/// Walk the whole name ending down a suffix trie, see \c walk_suffix_trie_from
+static const trie_node_t *walk_suffix_trie(const petr_context_t *ctx, const suffix_trie_t *trie, cbuf_t name)
+{
+        return walk_suffix_trie_from(ctx, &ctx->trie_nodes[trie->root], name);
+}
+
+static int apply_rule(const petr_context_t *ctx, const mod_t *mod, cbuf_t name, bool upper, buf_t dest,
+                      size_t *dest_len)
+{
+        cbuf_t trimmed = name;
+        trimmed.len = pop_n_codepoints(trimmed, mod->cnt_remove);
+        int rc = append_buf(trimmed, dest, dest_len);
+        if (rc != 0)
+                return rc;
+        return append_buf(get_suffix(ctx, mod, upper), dest, dest_len);
+}
+
+/// Rules matched for a single part of a name
+typedef struct {
+        cbuf_t name;                    ///< Part of the name
+        const exc_forms_t *forms;       ///< Matched exception, or NULL
+        const mod_rule_t *rule;         ///< Matched suffix rule if there is no exception, or NULL
+        bool upper;                     ///< If true, the name is in all caps and so are the added suffixes
+} part_match_t;
+
+/// Upper limit of name parts matched at once by \c petr_inflect_all_cases
+#define MAX_NAME_PARTS          8
+
+/// Check if a part of a name is matched against the rules at all
+static bool is_inflectable_part(const rules_set_t *rules, cbuf_t name)
+{
+        // Do not inflect single-character names
+        if (pop_one_codepoint(name) == 0)
+                return false;
+        // Names without Cyrillic letters cannot match rules made of Russian words
+        return !rules->cyrillic_only || has_cyrillic(name);
+}
+
+/// Match rules for a part of a name
+///
+/// If \c gender is \c GEND_UNKNOWN, it is inferred from the ending of the part while walking the suffix trie. The
+/// part is then matched against androgynous rules only if the ending suggests no gender. Hyphenated names resolve
+/// the gender with \c resolve_gender before matching their parts.
+static void match_part(const petr_context_t *ctx, const rules_set_t *rules, cbuf_t name, bool first_word,
+                       petr_gender_t *gender, part_match_t *match)
+{
+        match->name = name;
+        match->forms = NULL;
+        match->rule = NULL;
+        match->upper = false;
+        if (!is_inflectable_part(rules, name))
+                return;
+
+        // Suffixes follow the case of the last letter, so that all-caps names stay all caps
+        uint32_t last_cp;
+        match->upper = get_last_codepoint(name, &last_cp) != 0 && rus_lowercase(last_cp) != last_cp;
+
+        const trie_node_t *node = NULL;
+        if (*gender == GEND_UNKNOWN) {
+                node = walk_suffix_trie(ctx, &rules->suffix_trie, name);
+                *gender = node->gender;
+        }
+        petr_gender_t match_gender = (*gender == GEND_UNKNOWN) ? GEND_ANDROGYNOUS : *gender;
+
+        // First try to search in exceptions. Their forms are ready to be copied.
+        match->forms = match_exceptions(ctx, &rules->exc_index, first_word, match_gender, name, rus_utf8_hash(name));
+        if (match->forms != NULL)
+                return;
+        // If not found, search in suffixes.
+        if (node == NULL)
+                node = walk_suffix_trie(ctx, &rules->suffix_trie, name);
+        uint32_t rule_idx = node->best[match_gender][first_word];
+        match->rule = (rule_idx == NO_RULE) ? NULL : &ctx->rules[rule_idx];
+}
+
+static int inflect_part(const petr_context_t *ctx, const part_match_t *match, petr_case_t dest_case, buf_t dest,
+                        size_t *dest_len)
+{
+        const exc_forms_t *forms = match->forms;
+        if (forms != NULL) {
+                cbuf_t stem = { match->name.data, forms->keep_len[dest_case - 1] };
+                int rc = append_buf(stem, dest, dest_len);
+                if (rc != 0)
+                        return rc;
+                const mod_t *mod = &ctx->rules[forms->rule].mods[dest_case - 1];
+                return append_buf(get_suffix(ctx, mod, match->upper), dest, dest_len);
+        }
+        // If nothing matched, copy as-is.
+        if (match->rule == NULL)
+                return append_buf(match->name, dest, dest_len);
+
+        return apply_rule(ctx, &match->rule->mods[dest_case - 1], match->name, match->upper, dest, dest_len);
+}
+
+/// Get the length of a part of a name inflected by \c inflect_part
+static size_t inflected_part_size(const petr_context_t *ctx, const part_match_t *match, petr_case_t dest_case)
+{
+        const exc_forms_t *forms = match->forms;
+        if (forms != NULL) {
+                const mod_t *mod = &ctx->rules[forms->rule].mods[dest_case - 1];
+                return forms->keep_len[dest_case - 1] + mod->suffix_len;
+        }
+        if (match->rule == NULL)
+                return match->name.len;
+
+        const mod_t *mod = &match->rule->mods[dest_case - 1];
+        return pop_n_codepoints(match->name, mod->cnt_remove) + mod->suffix_len;
+}
+
+/// Split off the next part of a hyphenated name
+///
+/// @param name          Rest of the name, advanced past the part and the hyphen
+/// @param part          Part of the name
+/// @returns             True if the part is followed by a hyphen
+static bool next_part(cbuf_t *name, cbuf_t *part)
+{
+        const char *dash_pos = memchr(name->data, '-', name->len);
+        part->data = name->data;
+        if (dash_pos == NULL) {
+                part->len = name->len;
+                name->len = 0;
+                return false;
+        }
+        part->len = dash_pos - name->data;
+        name->data += part->len + 1;
+        name->len -= part->len + 1;
+        return true;
+}
+
+/// Infer gender from the endings of hyphen-separated parts of a name
+///
+/// @returns             Gender suggested by the first part with a known ending, or \c GEND_UNKNOWN
+static petr_gender_t infer_gender(const petr_context_t *ctx, const rules_set_t *rules, cbuf_t name)
+{
+        petr_gender_t gender = GEND_UNKNOWN;
+        while (gender == GEND_UNKNOWN && name.len != 0) {
+                cbuf_t part;
+                next_part(&name, &part);
+                if (is_inflectable_part(rules, part))
+                        gender = walk_suffix_trie(ctx, &rules->suffix_trie, part)->gender;
+        }
+        return gender;
+}
+
+/// Infer the gender of a hyphenated name before matching its parts
+///
+/// Otherwise \c match_part would fix the gender at the first part with a known ending, and match the parts before it
+/// as androgynous. Single parts are left to \c match_part, which gives the same gender from the same trie walk.
+static void resolve_gender(const petr_context_t *ctx, const rules_set_t *rules, cbuf_t name, petr_gender_t *gender)
+{
+        if (*gender == GEND_UNKNOWN && name.len != 0 && memchr(name.data, '-', name.len) != NULL)
+                *gender = infer_gender(ctx, rules, name);
+}
+
+/// Write parts of a name joined with hyphens
+static int emit_parts(const petr_context_t *ctx, const part_match_t *parts, size_t num_parts, petr_case_t dest_case,
+                      buf_t dest, size_t *dest_len)
+{
+        for (size_t i = 0; i < num_parts; i++) {
+                if (i != 0) {
+                        cbuf_t dash_buf = { "-", 1 };
+                        int rc = append_buf(dash_buf, dest, dest_len);
+                        if (rc != 0)
+                                return rc;
+                }
+                int rc = inflect_part(ctx, &parts[i], dest_case, dest, dest_len);
+                if (rc != 0)
+                        return rc;
+        }
+        return 0;
+}
+
+/// Append inflected name to \c dest
+///
+/// @param gender        Grammatical gender. If \c GEND_UNKNOWN, receives the gender inferred from the name.
+static int do_inflect(const petr_context_t *ctx, const rules_set_t *rules, cbuf_t name, petr_gender_t *gender,
+                      petr_case_t dest_case, buf_t dest, size_t *dest_len)
+{
+        if (dest_case == CASE_NOMINATIVE) {
+                // Nothing to match, but the gender is still reported
+                if (*gender == GEND_UNKNOWN)
+                        *gender = infer_gender(ctx, rules, name);
+                return append_buf(name, dest, dest_len);
+        }
+        resolve_gender(ctx, rules, name, gender);
+        bool maybe_first = true;
+        while (name.len != 0) {
+                cbuf_t part;
+                bool found_dash = next_part(&name, &part);
+                part_match_t match;
+                match_part(ctx, rules, part, maybe_first && found_dash, gender, &match);
+                int rc = inflect_part(ctx, &match, dest_case, dest, dest_len);
+                if (rc != 0)
+                        return rc;
+                if (found_dash) {
+                        cbuf_t dash_buf = { "-", 1 };
+                        rc = append_buf(dash_buf, dest, dest_len);
+                        if (rc != 0)
+                                return rc;
+                }
+                maybe_first = false;
+        }
+        return 0;
+}
+
+/// Get the length of the name \c do_inflect would append, without inflecting it
+static size_t inflected_size(const petr_context_t *ctx, const rules_set_t *rules, cbuf_t name, petr_gender_t gender,
+                             petr_case_t dest_case)
+{
+        if (dest_case == CASE_NOMINATIVE)
+                return name.len;
+
+        // Same walk over the parts as in do_inflect
+        resolve_gender(ctx, rules, name, &gender);
+        size_t res = 0;
+        bool maybe_first = true;
+        while (name.len != 0) {
+                cbuf_t part;
+                bool found_dash = next_part(&name, &part);
+                part_match_t match;
+                match_part(ctx, rules, part, maybe_first && found_dash, &gender, &match);
+                res += inflected_part_size(ctx, &match, dest_case);
+                if (found_dash)
+                        res++;
+                maybe_first = false;
+        }
+        return res;
+}
+
+/// Get the exact length of an inflected name without inflecting it
+///
+/// The name is matched against the rules like \c petr_inflect does, so the result is exactly the \c dest_len the
+/// latter would return. A buffer of the returned size plus one byte for the terminating NUL is enough to hold it.
+///
+/// @param ctx                  Library context object
+/// @param data                 Name to inflect
+/// @param len                  Length of \c data
+/// @param kind                 Type of name (e.g., first name)
+/// @param gender               Grammatical gender, \c GEND_UNKNOWN to infer it from the name
+/// @param dest_case            Required grammatical case
+/// @param size                 Length of the inflected name in bytes (excluding terminating NUL)
+/// @returns                    Error code (0, if succeed)
+int petr_inflect_size(const petr_context_t *ctx, const char *data, size_t len, petr_name_kind_t kind,
+                      petr_gender_t gender, petr_case_t dest_case, size_t *size)
+{
+        cbuf_t name = { data, len };
+        *size = inflected_size(ctx, &ctx->image->sets[kind], name, gender, dest_case);
+        return 0;
+}
+
+/// Report the rules \c petr_inflect would apply to a name, for profiling and debugging of rules
+///
+/// @param ctx                  Library context object
+/// @param data                 Name
+/// @param len                  Length of \c data
+/// @param kind                 Type of name (e.g., first name)
+/// @param gender               Grammatical gender, \c GEND_UNKNOWN to infer it from the name
+/// @param matches              Destination for the rule of every hyphen-separated part of the name
+/// @param max_matches          Size of \c matches
+/// @param num_matches          Number of parts
+/// @returns                    Error code (0, if succeed), \c ERR_BUF if the name has more than \c max_matches parts
+int petr_match_rules(const petr_context_t *ctx, const char *data, size_t len, petr_name_kind_t kind,
+                     petr_gender_t gender, petr_rule_match_t *matches, size_t max_matches, size_t *num_matches)
+{
+        const rules_set_t *rules = &ctx->image->sets[kind];
+        cbuf_t name = { data, len };
+        resolve_gender(ctx, rules, name, &gender);
+        size_t count = 0;
+        bool maybe_first = true;
+        while (name.len != 0) {
+                if (count == max_matches)
+                        return ERR_BUF;
+                cbuf_t part;
+                bool found_dash = next_part(&name, &part);
+                part_match_t match;
+                match_part(ctx, rules, part, maybe_first && found_dash, &gender, &match);
+
+                petr_rule_match_t *res = &matches[count++];
+                memset(res, 0, sizeof(*res));
+                res->part_off = part.data - data;
+                res->part_len = part.len;
+                res->gender = gender;
+                const mod_rule_t *rule = NULL;
+                if (match.forms != NULL) {
+                        res->kind = MATCH_EXCEPTION;
+                        res->rule = match.forms->rule - rules->exceptions.first_rule;
+                        rule = &ctx->rules[match.forms->rule];
+                } else if (match.rule != NULL) {
+                        res->kind = MATCH_SUFFIX;
+                        res->rule = (match.rule - ctx->rules) - rules->suffixes.first_rule;
+                        rule = match.rule;
+                }
+                if (rule != NULL && rule->num_matches != 0) {
+                        cbuf_t test = get_string(ctx->strings, ctx->matches[rule->first_match]);
+                        res->test = test.data;
+                        res->test_len = test.len;
+                }
+                maybe_first = false;
+        }
+        *num_matches = count;
+        return 0;
+}
+
+/// Inflect a name
+///
+/// @param ctx                  Library context object
+/// @param data                 Name to inflect
+/// @param len                  Length of \c data
+/// @param kind                 Type of name (e.g., first name)
+/// @param gender               Grammatical gender, \c GEND_UNKNOWN to infer it from the name
+/// @param dest_case            Required grammatical case
+/// @param dest                 Destination buffer
+/// @param dest_buf_size        Size of \c dest
+/// @param dest_len             Actual number of bytes written to \c dest (excluding terminating NUL)
+/// @returns                    Error code (0, if succeed)
+int petr_inflect(const petr_context_t *ctx, const char *data, size_t len, petr_name_kind_t kind, petr_gender_t gender,
+                 petr_case_t dest_case, char *dest, size_t dest_buf_size, size_t *dest_len)
+{
+        petr_gender_t res_gender;
+        return petr_inflect_infer(ctx, data, len, kind, gender, dest_case, dest, dest_buf_size, dest_len, &res_gender);
+}
+
+/// Inflect a name and report its gender
+///
+/// Unknown gender is inferred from the endings of middle and last names while matching the inflection rules.
+///
+/// @param ctx                  Library context object
+/// @param data                 Name to inflect
+/// @param len                  Length of \c data
+/// @param kind                 Type of name (e.g., first name)
+/// @param gender               Grammatical gender, \c GEND_UNKNOWN to infer it from the name
+/// @param dest_case            Required grammatical case
+/// @param dest                 Destination buffer
+/// @param dest_buf_size        Size of \c dest
+/// @param dest_len             Actual number of bytes written to \c dest (excluding terminating NUL)
+/// @param res_gender           Gender the name was inflected for, \c GEND_UNKNOWN if it could not be inferred
+/// @returns                    Error code (0, if succeed). On failure \c dest holds an empty string.
+int petr_inflect_infer(const petr_context_t *ctx, const char *data, size_t len, petr_name_kind_t kind,
+                       petr_gender_t gender, petr_case_t dest_case, char *dest, size_t dest_buf_size,
+                       size_t *dest_len, petr_gender_t *res_gender)
+{
+        const rules_set_t *rules = &ctx->image->sets[kind];
+        buf_t dest_buf = { dest, dest_buf_size };
+        cbuf_t name = { data, len };
+        uint32_t cache_key = kind | (gender << 8) | (dest_case << 16);
+        uint8_t cached_gender;
+        if (ctx->cache != NULL && cache_get(ctx->cache, cache_key, name, dest_buf, dest_len, &cached_gender)) {
+                *res_gender = cached_gender;
+                return 0;
+        }
+
+        *dest_len = 0;
+        *res_gender = gender;
+        int rc = do_inflect(ctx, rules, name, res_gender, dest_case, dest_buf, dest_len);
+        if (rc != 0) {
+                // Do not leave a partial result
+                *dest_len = 0;
+                if (dest_buf_size != 0)
+                        dest[0] = '\0';
+        } else if (ctx->cache != NULL) {
+                cbuf_t result = { dest, *dest_len };
+                cache_put(ctx->cache, cache_key, name, result, *res_gender);
+        }
+        return rc;
+}
+
+// Lemmatization runs the rules backwards. A mod applied to a name matching a test of its rule leaves the test without
+// the removed codepoints, followed by the added suffix, at the end of the name. These endings are indexed in a trie
+// over their reversed codepoints, so the mods that could have produced a name are found by walking the name down the
+// trie. Each of them suggests a nominative form: the name without the added suffix, followed by the codepoints the mod
+// removes from the test. A form is only accepted if it inflects back into the name.
+
+/// Maximum length in bytes of the codepoints removed by a mod
+#define MAX_REMOVED_LEN         (4 * UINT8_MAX)
+
+/// Size of the scratch buffers of \c petr_lemmatize kept on the stack, longer names allocate them
+#define LEMMA_STACK_SCRATCH     4096
+
+/// Nominative form of a part of a name suggested by a rule
+typedef struct {
+        cbuf_t form;                    ///< Nominative form of the part
+        petr_gender_t gender;           ///< Gender of the rule
+        petr_case_t name_case;          ///< Case the part is in
+        petr_match_kind_t match;
+        unsigned rule;                  ///< Index of the rule among exceptions or suffixes
+} part_lemma_t;
+
+/// Callback receiving nominative forms of a part of a name
+///
+/// @returns             False to stop the search
+typedef bool (*lemma_fn_t)(void *arg, const part_lemma_t *lemma);
+
+/// Rules and scratch buffers for looking up nominative forms of name parts
+typedef struct {
+        const petr_context_t *ctx;
+        const rules_set_t *rules;       ///< Rules of the name kind
+        char *form_buf;                 ///< Nominative form being checked, up to a part plus \c MAX_REMOVED_LEN
+        buf_t check_buf;                ///< Inflected forms, as large as the name plus NUL
+} lemma_search_t;
+
+/// Find the child of a lemma trie node for a case-folded codepoint
+///
+/// @returns             Child node, or NULL if there is none
+static inline const lemma_node_t *find_lemma_child(const lemma_node_t *nodes, const lemma_node_t *node, uint32_t cp)
+{
+        // Binary search among children
+        const lemma_node_t *lo = &nodes[node->first_child];
+        const lemma_node_t *end = lo + node->num_children;
+        const lemma_node_t *hi = end;
+        while (lo < hi) {
+                const lemma_node_t *mid = lo + (hi - lo) / 2;
+                if (mid->cp < cp)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        return (lo == end || lo->cp != cp) ? NULL : lo;
+}
+
+/// Check that a nominative form of a part of a name inflects exactly into the part
+static bool inflects_back(const lemma_search_t *s, cbuf_t form, cbuf_t part, bool first_word, petr_gender_t gender,
+                          petr_case_t name_case)
+{
+        part_match_t match;
+        match_part(s->ctx, s->rules, form, first_word, &gender, &match);
+        // Forms that don't fit into the buffer are longer than the part anyway
+        size_t len = 0;
+        return inflect_part(s->ctx, &match, name_case, s->check_buf, &len) == 0 && len == part.len
+               && memcmp(s->check_buf.data, part.data, len) == 0;
+}
+
+/// Suggest a nominative form of a part of a name from a mod that could have given it its ending
+///
+/// @param s             Lookup state
+/// @param part          Part of the name
+/// @param prefix        The part without the ending of \c entry
+/// @param upper         If true, the part ends in an uppercase letter
+/// @param first_word    If true, this is the first word of a multi-part name
+/// @param gender        Gender the part must be inflected for, \c GEND_UNKNOWN for the gender of the rule
+/// @param entry         Mod and the test of its rule
+/// @param fn            Callback receiving the form if it inflects back into the part
+/// @returns             False if \c fn stopped the search
+static bool find_entry_lemma(const lemma_search_t *s, cbuf_t part, cbuf_t prefix, bool upper, bool first_word,
+                             petr_gender_t gender, const lemma_entry_t *entry, lemma_fn_t fn, void *arg)
+{
+        const petr_context_t *ctx = s->ctx;
+        const mod_rule_t *rule = &ctx->rules[entry->rule];
+        petr_gender_t check_gender = (gender == GEND_UNKNOWN) ? (petr_gender_t)rule->gender : gender;
+        if (!is_gender_compatible(check_gender, rule->gender) || (rule->first_word && !first_word))
+                return true;
+        const mod_rule_arr_t *exceptions = &s->rules->exceptions;
+        bool exception = entry->rule - exceptions->first_rule < exceptions->num_rules;
+        // Exceptions match whole parts
+        if (exception && prefix.len != 0)
+                return true;
+
+        const mod_t *mod = &rule->mods[entry->dest_case - 1];
+        cbuf_t test = get_string(ctx->strings, ctx->matches[entry->match]);
+        size_t keep = pop_n_codepoints(test, mod->cnt_remove);
+        cbuf_t removed = { test.data + keep, test.len - keep };
+        size_t stem_len = pop_n_codepoints(part, entry->suffix_cps);
+        memcpy(s->form_buf, part.data, stem_len);
+        if (upper)
+                rus_utf8_upper(removed, s->form_buf + stem_len);
+        else
+                memcpy(s->form_buf + stem_len, removed.data, removed.len);
+        cbuf_t form = { s->form_buf, stem_len + removed.len };
+        if (!inflects_back(s, form, part, first_word, check_gender, entry->dest_case))
+                return true;
+
+        part_lemma_t lemma;
+        lemma.form = form;
+        lemma.gender = rule->gender;
+        lemma.name_case = entry->dest_case;
+        lemma.match = exception ? MATCH_EXCEPTION : MATCH_SUFFIX;
+        lemma.rule = entry->rule - (exception ? exceptions->first_rule : s->rules->suffixes.first_rule);
+        return fn(arg, &lemma);
+}
+
+/// Find nominative forms of a part of a name
+///
+/// Walks the part backwards down the lemma trie and tries the entries of every node on the way, so that forms are
+/// suggested by every mod giving the part one of its endings. The forms are passed to \c fn in the scratch buffer of \c s,
+/// which is reused for the next one.
+///
+/// @param s             Lookup state
+/// @param part          Part of the name
+/// @param first_word    If true, this is the first word of a multi-part name
+/// @param gender        Gender the part must be inflected for, \c GEND_UNKNOWN for the gender of each rule
+/// @param name_case     Case the part must be in, \c CASE_NOMINATIVE for any case
+/// @param fn            Callback receiving the forms
+/// @returns             False if \c fn stopped the search
+static bool find_part_lemmas(const lemma_search_t *s, cbuf_t part, bool first_word, petr_gender_t gender,
+                             petr_case_t name_case, lemma_fn_t fn, void *arg)
+{
+        const petr_context_t *ctx = s->ctx;
+        uint32_t last_cp;
+        bool upper = get_last_codepoint(part, &last_cp) != 0 && rus_lowercase(last_cp) != last_cp;
+        const lemma_node_t *node = &ctx->lemma_nodes[s->rules->lemma_trie.root];
+        cbuf_t prefix = part;
+        for (;;) {
+                for (uint32_t i = 0; i < node->num_entries; i++) {
+                        const lemma_entry_t *entry = &ctx->lemma_entries[node->first_entry + i];
+                        if (name_case != CASE_NOMINATIVE && entry->dest_case != (uint32_t)name_case)
+                                continue;
+                        if (!find_entry_lemma(s, part, prefix, upper, first_word, gender, entry, fn, arg))
+                                return false;
+                }
+                uint32_t cp;
+                size_t cp_len = get_last_codepoint(prefix, &cp);
+                if (cp_len == 0)
+                        return true;
+                node = find_lemma_child(ctx->lemma_nodes, node, rus_lowercase(cp));
+                if (node == NULL)
+                        return true;
+                prefix.len -= cp_len;
+        }
+}
+
+/// State of \c petr_lemmatize
+typedef struct {
+        lemma_search_t search;
+        petr_name_kind_t kind;          ///< Name kind being searched
+        cbuf_t name;
+        cbuf_t parts[MAX_NAME_PARTS];   ///< Hyphen-separated parts of the name
+        bool dashes[MAX_NAME_PARTS];    ///< If true, the part is followed by a hyphen
+        size_t num_parts;
+        char *draft_buf;                ///< Nominative form being assembled, up to \c MAX_REMOVED_LEN longer than the
+                                        ///< name for every part
+        buf_t dest;
+        size_t dest_len;                ///< Bytes of \c dest taken by the lemmas found
+        petr_lemma_t *lemmas;
+        size_t max_lemmas;
+        size_t num_lemmas;
+        int rc;                         ///< \c ERR_BUF once the lemmas don't fit
+} lemmatizer_t;
+
+/// Nominative form of a name assembled part by part
+typedef struct {
+        lemmatizer_t *l;
+        size_t part;                    ///< Index of the next part
+        size_t len;                     ///< Length of the form so far
+        petr_gender_t gender;           ///< Gender of the rules so far, \c GEND_ANDROGYNOUS if none is specific
+        petr_case_t name_case;          ///< Case of the parts so far, \c CASE_NOMINATIVE before the first part
+        petr_match_kind_t match;        ///< First rule that inflected a part, \c MATCH_NONE if none did
+        unsigned rule;
+} lemma_draft_t;
+
+/// Position of a match kind in the ranking of lemmas: exceptions, suffixes, then names taken as they are
+static int match_rank(petr_match_kind_t match)
+{
+        return match == MATCH_NONE ? MATCH_SUFFIX + 1 : (int)match;
+}
+
+static int cmp_lemmas(const void *p1, const void *p2)
+{
+        const petr_lemma_t *l1 = (const petr_lemma_t *)p1;
+        const petr_lemma_t *l2 = (const petr_lemma_t *)p2;
+        if (l1->match != l2->match)
+                return match_rank(l1->match) < match_rank(l2->match) ? -1 : 1;
+        if (l1->rule != l2->rule)
+                return l1->rule < l2->rule ? -1 : 1;
+        if (l1->kind != l2->kind)
+                return l1->kind < l2->kind ? -1 : 1;
+        if (l1->name_case != l2->name_case)
+                return l1->name_case < l2->name_case ? -1 : 1;
+        if (l1->gender != l2->gender)
+                return l1->gender < l2->gender ? -1 : 1;
+        return 0;
+}
+
+/// Add a nominative form to the lemmas, unless it is already there
+///
+/// @returns             False if there is no room for it
+static bool emit_lemma(lemmatizer_t *l, cbuf_t form, petr_gender_t gender, petr_case_t name_case,
+                       petr_match_kind_t match, unsigned rule)
+{
+        for (size_t i = 0; i < l->num_lemmas; i++) {
+                petr_lemma_t *other = &l->lemmas[i];
+                if (other->kind == l->kind && other->gender == gender && other->name_case == name_case
+                    && other->len == form.len && memcmp(l->dest.data + other->off, form.data, form.len) == 0) {
+                        // Keep the best rule suggesting the form
+                        if (match_rank(match) < match_rank(other->match)
+                            || (match == other->match && rule < other->rule)) {
+                                other->match = match;
+                                other->rule = rule;
+                        }
+                        return true;
+                }
+        }
+        if (l->num_lemmas == l->max_lemmas || l->dest_len + form.len + 1 > l->dest.len) {
+                l->rc = ERR_BUF;
+                return false;
+        }
+        petr_lemma_t *res = &l->lemmas[l->num_lemmas++];
+        res->off = l->dest_len;
+        res->len = form.len;
+        res->kind = l->kind;
+        res->gender = gender;
+        res->name_case = name_case;
+        res->match = match;
+        res->rule = rule;
+        memcpy(l->dest.data + l->dest_len, form.data, form.len);
+        l->dest.data[l->dest_len + form.len] = '\0';
+        l->dest_len += form.len + 1;
+        return true;
+}
+
+/// Add a completely assembled nominative form to the lemmas if it inflects back into the name
+static bool finish_lemma(const lemma_draft_t *draft)
+{
+        lemmatizer_t *l = draft->l;
+        cbuf_t form = { l->draft_buf, draft->len };
+        if (l->num_parts > 1) {
+                // A name of parts that aren't inflected is reported once, as nominative
+                if (draft->match == MATCH_NONE)
+                        return true;
+                // The parts were checked one by one, check them together for the final gender
+                buf_t check = l->search.check_buf;
+                size_t len = 0;
+                petr_gender_t gender = draft->gender;
+                if (do_inflect(l->search.ctx, l->search.rules, form, &gender, draft->name_case, check, &len) != 0
+                    || len != l->name.len || memcmp(check.data, l->name.data, len) != 0)
+                        return true;
+        }
+        return emit_lemma(l, form, draft->gender, draft->name_case, draft->match, draft->rule);
+}
+
+/// Append a nominative form of the next part to the form being assembled, then complete it with every form of the
+/// parts that follow
+///
+/// @returns             False if the lemmas don't fit
+static bool add_part_lemma(void *arg, const part_lemma_t *lemma)
+{
+        const lemma_draft_t *draft = (const lemma_draft_t *)arg;
+        lemmatizer_t *l = draft->l;
+        memcpy(l->draft_buf + draft->len, lemma->form.data, lemma->form.len);
+        lemma_draft_t next = *draft;
+        next.len += lemma->form.len;
+        next.name_case = lemma->name_case;
+        if (next.gender == GEND_ANDROGYNOUS)
+                next.gender = lemma->gender;
+        if (next.match == MATCH_NONE) {
+                next.match = lemma->match;
+                next.rule = lemma->rule;
+        }
+        if (l->dashes[next.part])
+                l->draft_buf[next.len++] = '-';
+        if (++next.part == l->num_parts)
+                return finish_lemma(&next);
+
+        // Other parts must be in the same case, for a compatible gender
+        cbuf_t part = l->parts[next.part];
+        petr_gender_t part_gender = (next.gender == GEND_ANDROGYNOUS) ? GEND_UNKNOWN : next.gender;
+        if (!find_part_lemmas(&l->search, part, false, part_gender, next.name_case, add_part_lemma, &next))
+                return false;
+        if (!inflects_back(&l->search, part, part, false, next.gender, next.name_case))
+                return true;
+        part_lemma_t same = { part, GEND_ANDROGYNOUS, next.name_case, MATCH_NONE, 0 };
+        return add_part_lemma(&next, &same);
+}
+
+/// Find nominative forms of the name for one name kind
+///
+/// @returns             False if the lemmas don't fit
+static bool lemmatize_kind(lemmatizer_t *l, petr_name_kind_t kind)
+{
+        l->kind = kind;
+        l->search.rules = &l->search.ctx->image->sets[kind];
+        lemma_draft_t draft = { l, 0, 0, GEND_ANDROGYNOUS, CASE_NOMINATIVE, MATCH_NONE, 0 };
+        if (l->num_parts != 0) {
+                cbuf_t first = l->parts[0];
+                bool first_word = l->dashes[0];
+                if (!find_part_lemmas(&l->search, first, first_word, GEND_UNKNOWN, CASE_NOMINATIVE, add_part_lemma,
+                                      &draft))
+                        return false;
+                // Other parts may be inflected while the first one is not
+                for (int gender = 0; l->num_parts > 1 && gender < GENDER_COUNT; gender++) {
+                        for (int name_case = CASE_GENITIVE; name_case < CASE_COUNT; name_case++) {
+                                if (!inflects_back(&l->search, first, first, first_word, gender, name_case))
+                                        continue;
+                                part_lemma_t same = { first, gender, name_case, MATCH_NONE, 0 };
+                                if (!add_part_lemma(&draft, &same))
+                                        return false;
+                        }
+                }
+        }
+
+        // Any name may be nominative already
+        petr_gender_t gender = infer_gender(l->search.ctx, l->search.rules, l->name);
+        return emit_lemma(l, l->name, gender, CASE_NOMINATIVE, MATCH_NONE, 0);
+}
+
+/// Recover nominative forms of a name in an unknown case
+///
+/// The name is tried as every name kind. Every rule whose mods could have produced the ending of the name suggests a
+/// nominative form, which is kept if \c petr_inflect turns it back into the name for the gender of the rule. The
+/// name itself is always reported as nominative too. Lemmas are ranked by rule priority: forms suggested by
+/// exceptions come first, then forms suggested by suffix rules, each in the order of the rules, then the name itself.
+///
+/// @param ctx                  Library context object
+/// @param data                 Inflected name
+/// @param len                  Length of \c data
+/// @param dest                 Destination buffer for the nominative forms, each followed by NUL
+/// @param dest_buf_size        Size of \c dest
+/// @param lemmas               Destination for the lemmas
+/// @param max_lemmas           Size of \c lemmas
+/// @param num_lemmas           Number of lemmas found
+/// @returns                    Error code (0, if succeed). \c ERR_BUF if the lemmas didn't fit into \c dest or
+///                             \c lemmas (those that did are still returned), or the name has too many
+///                             hyphen-separated parts.
+int petr_lemmatize(const petr_context_t *ctx, const char *data, size_t len, char *dest, size_t dest_buf_size,
+                   petr_lemma_t *lemmas, size_t max_lemmas, size_t *num_lemmas)
+{
+        lemmatizer_t l;
+        memset(&l, 0, sizeof(l));
+        l.search.ctx = ctx;
+        l.name.data = data;
+        l.name.len = len;
+        l.dest.data = dest;
+        l.dest.len = dest_buf_size;
+        l.lemmas = lemmas;
+        l.max_lemmas = max_lemmas;
+        *num_lemmas = 0;
+
+        cbuf_t rest = l.name;
+        while (rest.len != 0) {
+                if (l.num_parts == MAX_NAME_PARTS)
+                        return ERR_BUF;
+                l.dashes[l.num_parts] = next_part(&rest, &l.parts[l.num_parts]);
+                l.num_parts++;
+        }
+
+        char stack_scratch[LEMMA_STACK_SCRATCH];
+        size_t scratch_size = 3 * len + (l.num_parts + 1) * MAX_REMOVED_LEN + 1;
+        char *scratch = stack_scratch;
+        if (scratch_size > sizeof(stack_scratch)) {
+                scratch = mem_alloc(context_allocator(ctx), scratch_size);
+                if (!scratch) {
+                        debug_err("allocation failed");
+                        return ERR_NOMEM;
+                }
+        }
+        l.search.form_buf = scratch;
+        l.search.check_buf.data = scratch + len + MAX_REMOVED_LEN;
+        l.search.check_buf.len = len + 1;
+        l.draft_buf = l.search.check_buf.data + len + 1;
+
+        for (int kind = 0; kind < NAME_KIND_COUNT && lemmatize_kind(&l, kind); kind++)
+                ;
+        if (scratch != stack_scratch)
+                mem_free(context_allocator(ctx), scratch);
+
+        qsort(lemmas, l.num_lemmas, sizeof(petr_lemma_t), cmp_lemmas);
+        *num_lemmas = l.num_lemmas;
+        return l.rc;
+}
+
+// A prepared name keeps everything of a name that does not depend on the rules: the parts, their hashes for the
+// exceptions index and their case-folded endings for the suffix trie. Only the lookups are left to inflection.
+
+/// Flags of a prepared part
+enum {
+        PART_SKIP               = 1,    ///< Single character or empty, not inflected
+        PART_CYRILLIC           = 2,    ///< Has Cyrillic letters
+        PART_UPPER              = 4,    ///< The last letter is uppercase
+        PART_TAIL_COMPLETE      = 8,    ///< \c tail ends where a trie walk would stop for lack of codepoints
+};
+
+static void prepare_part(const char *data, cbuf_t part, petr_prepared_part_t *res)
+{
+        res->off = part.data - data;
+        res->len = part.len;
+        res->hash = rus_utf8_hash(part);
+        res->flags = 0;
+        if (pop_one_codepoint(part) == 0)
+                res->flags |= PART_SKIP;
+        if (has_cyrillic(part))
+                res->flags |= PART_CYRILLIC;
+
+        cbuf_t rest = part;
+        size_t n = 0;
+        res->tail_off[0] = 0;
+        for (; n < PETR_PREPARED_TAIL_LEN; n++) {
+                uint32_t cp;
+                size_t cp_len = get_last_codepoint(rest, &cp);
+                if (cp_len == 0) {
+                        res->flags |= PART_TAIL_COMPLETE;
+                        break;
+                }
+                if (n == 0 && rus_lowercase(cp) != cp)
+                        res->flags |= PART_UPPER;
+                res->tail[n] = rus_lowercase(cp);
+                rest.len -= cp_len;
+                res->tail_off[n + 1] = part.len - rest.len;
+        }
+        res->tail_len = n;
+}
+
+/// Analyze a name once for inflecting it repeatedly with \c petr_inflect_prepared
+///
+/// The name is split into hyphen-separated parts, and the endings of the parts are decoded and case-folded. The
+/// result refers to \c data, which must stay unchanged while it is used. It does not depend on the rules, so it can
+/// be used with any context.
+///
+/// @param data                 Name
+/// @param len                  Length of \c data
+/// @param name                 Prepared name
+/// @returns                    Error code (0, if succeed), \c ERR_BUF if the name has more than
+///                             \c PETR_PREPARED_MAX_PARTS parts (counting the empty one after a trailing hyphen)
+int petr_prepare_name(const char *data, size_t len, petr_prepared_name_t *name)
+{
+        if (len > UINT32_MAX)
+                return ERR_INVALID_ARG;
+        name->data = data;
+        name->len = len;
+        name->num_parts = 0;
+        cbuf_t rest = { data, len };
+        while (rest.len != 0) {
+                cbuf_t part;
+                bool found_dash = next_part(&rest, &part);
+                if (name->num_parts == PETR_PREPARED_MAX_PARTS)
+                        return ERR_BUF;
+                prepare_part(data, part, &name->parts[name->num_parts++]);
+                if (found_dash && rest.len == 0) {
+                        if (name->num_parts == PETR_PREPARED_MAX_PARTS)
+                                return ERR_BUF;
+                        prepare_part(data, rest, &name->parts[name->num_parts++]);
+                }
+        }
+        return 0;
+}
+
+/// Same as \c walk_suffix_trie for a prepared part, decoding only the codepoints beyond its tail
+static const trie_node_t *walk_prepared_part(const petr_context_t *ctx, const suffix_trie_t *trie, const char *data,
+                                             const petr_prepared_part_t *part)
+{
+        const trie_node_t *node = &ctx->trie_nodes[trie->root];
+        size_t i = 0;
+        for (; i < part->tail_len && node->num_children != 0; i++) {
+                const trie_node_t *child = find_trie_child(ctx->trie_nodes, node, part->tail[i]);
+                if (child == NULL)
+                        return node;
+                node = child;
+        }
+        if (i < part->tail_len || (part->flags & PART_TAIL_COMPLETE))
+                return node;
+        cbuf_t rest = { data + part->off, part->len - part->tail_off[i] };
+        return walk_suffix_trie_from(ctx, node, rest);
+}
+
+/// Same as \c match_part for a prepared part
+static void match_prepared_part(const petr_context_t *ctx, const rules_set_t *rules, const char *data,
+                                const petr_prepared_part_t *part, bool first_word, petr_gender_t *gender,
+                                part_match_t *match)
+{
+        cbuf_t name = { data + part->off, part->len };
+        match->name = name;
+        match->forms = NULL;
+        match->rule = NULL;
+        match->upper = false;
+        if (part->flags & PART_SKIP)
+                return;
+        if (rules->cyrillic_only && !(part->flags & PART_CYRILLIC))
+                return;
+        match->upper = (part->flags & PART_UPPER) != 0;
+
+        const trie_node_t *node = NULL;
+        if (*gender == GEND_UNKNOWN) {
+                node = walk_prepared_part(ctx, &rules->suffix_trie, data, part);
+                *gender = node->gender;
+        }
+        petr_gender_t match_gender = (*gender == GEND_UNKNOWN) ? GEND_ANDROGYNOUS : *gender;
+
+        match->forms = match_exceptions(ctx, &rules->exc_index, first_word, match_gender, name, part->hash);
+        if (match->forms != NULL)
+                return;
+        if (node == NULL)
+                node = walk_prepared_part(ctx, &rules->suffix_trie, data, part);
+        uint32_t rule_idx = node->best[match_gender][first_word];
+        match->rule = (rule_idx == NO_RULE) ? NULL : &ctx->rules[rule_idx];
+}
+
+/// Same as \c resolve_gender for a prepared name
+static void resolve_prepared_gender(const petr_context_t *ctx, const rules_set_t *rules,
+                                    const petr_prepared_name_t *name, petr_gender_t *gender)
+{
+        if (*gender != GEND_UNKNOWN || name->num_parts < 2)
+                return;
+        for (size_t i = 0; i < name->num_parts && *gender == GEND_UNKNOWN; i++) {
+                const petr_prepared_part_t *part = &name->parts[i];
+                if (!(part->flags & PART_SKIP) && (!rules->cyrillic_only || (part->flags & PART_CYRILLIC)))
+                        *gender = walk_prepared_part(ctx, &rules->suffix_trie, name->data, part)->gender;
+        }
+}
+
+/// Same as \c inflect_part for a prepared part, taking the length of the removed codepoints from its tail
+static int inflect_prepared_part(const petr_context_t *ctx, const part_match_t *match,
+                                 const petr_prepared_part_t *part, petr_case_t dest_case, buf_t dest,
+                                 size_t *dest_len)
+{
+        if (match->rule == NULL)
+                return inflect_part(ctx, match, dest_case, dest, dest_len);
+
+        const mod_t *mod = &match->rule->mods[dest_case - 1];
+        if (mod->cnt_remove > part->tail_len)
+                return apply_rule(ctx, mod, match->name, match->upper, dest, dest_len);
+        cbuf_t stem = { match->name.data, match->name.len - part->tail_off[mod->cnt_remove] };
+        int rc = append_buf(stem, dest, dest_len);
+        if (rc != 0)
+                return rc;
+        return append_buf(get_suffix(ctx, mod, match->upper), dest, dest_len);
+}
+
+/// Inflect a name prepared by \c petr_prepare_name
 ///
-/// @param arr           Rules array
-/// @param first_word    If true, this is the first word of a multi-part name
-/// @param gender        Grammatical gender
-/// @param full_match    If true, match full name, otherwise match ending
-/// @param name          Name string
-/// @returns             Matched rule, or NULL if not found
-static const mod_rule_t *match_rules(const mod_rule_arr_t *arr, bool first_word, petr_gender_t gender, bool full_match,
-                                     cbuf_t name)
+/// The result is the same as the one of \c petr_inflect for the name. Results are not cached.
+///
+/// @param ctx                  Library context object
+/// @param name                 Prepared name
+/// @param kind                 Type of name (e.g., first name)
+/// @param gender               Grammatical gender, \c GEND_UNKNOWN to infer it from the name
+/// @param dest_case            Required grammatical case
+/// @param dest                 Destination buffer
+/// @param dest_buf_size        Size of \c dest
+/// @param dest_len             Actual number of bytes written to \c dest (excluding terminating NUL)
+/// @returns                    Error code (0, if succeed). On failure \c dest holds an empty string.
+int petr_inflect_prepared(const petr_context_t *ctx, const petr_prepared_name_t *name, petr_name_kind_t kind,
+                          petr_gender_t gender, petr_case_t dest_case, char *dest, size_t dest_buf_size,
+                          size_t *dest_len)
 {
-        for (size_t i = 0; i < arr->num_rules; i++) {
-                const mod_rule_t *rule = &arr->rules[i];
-                if (rule->first_word && !first_word)
-                        continue;
-                if (!is_gender_compatible(gender, rule->gender))
-                        continue;
-                for (size_t j = 0; j < rule->num_matches; j++) {
-                        cbuf_t rule_match = rule->match[j];
-                        if (rule_match.len > name.len)
-                                continue;
-                        cbuf_t name_match;
-                        if (full_match) {
-                                if (rule_match.len != name.len)
-                                        continue;
-                                name_match.data = name.data;
-                                name_match.len = name.len;
-                        } else {
-                                size_t len_cp = count_codepoints(rule_match);
-                                size_t prefix_len = pop_n_codepoints(name, len_cp);
-                                name_match.data = name.data + prefix_len;
-                                name_match.len = name.len - prefix_len;
-                        }
-                        if (rus_utf8_streq(name_match, rule_match))
-                                return rule;
+        const rules_set_t *rules = &ctx->image->sets[kind];
+        buf_t dest_buf = { dest, dest_buf_size };
+        *dest_len = 0;
+        int rc = 0;
+        if (dest_case == CASE_NOMINATIVE) {
+                cbuf_t src = { name->data, name->len };
+                rc = append_buf(src, dest_buf, dest_len);
+        }
+        resolve_prepared_gender(ctx, rules, name, &gender);
+        for (size_t i = 0; i < name->num_parts && dest_case != CASE_NOMINATIVE && rc == 0; i++) {
+                if (i != 0) {
+                        cbuf_t dash_buf = { "-", 1 };
+                        rc = append_buf(dash_buf, dest_buf, dest_len);
+                        if (rc != 0)
+                                break;
                 }
+                part_match_t match;
+                match_prepared_part(ctx, rules, name->data, &name->parts[i], i == 0 && name->num_parts > 1, &gender,
+                                    &match);
+                rc = inflect_prepared_part(ctx, &match, &name->parts[i], dest_case, dest_buf, dest_len);
         }
-        return NULL;
+        if (rc != 0) {
+                // Do not leave a partial result
+                *dest_len = 0;
+                if (dest_buf_size != 0)
+                        dest[0] = '\0';
+        }
+        return rc;
 }
 
-static int apply_rule(const mod_t *mod, cbuf_t name, buf_t dest, size_t *dest_len)
+// UTF-16 names are matched against the same suffix trie and exceptions index as UTF-8 ones: both are keyed by
+// codepoints. Only the suffixes are added from their UTF-16 copies compiled into the rules image.
+
+/// Same as \c walk_suffix_trie for a UTF-16 name
+static const trie_node_t *walk_suffix_trie_u16(const petr_context_t *ctx, const suffix_trie_t *trie, cu16buf_t name)
 {
-        cbuf_t trimmed = name;
-        trimmed.len = pop_n_codepoints(trimmed, mod->cnt_remove);
-        int rc = append_buf(trimmed, dest, dest_len);
+        const trie_node_t *node = &ctx->trie_nodes[trie->root];
+        while (name.len != 0 && node->num_children != 0) {
+                uint32_t cp;
+                size_t cp_len = get_last_codepoint_u16(name, &cp);
+                if (cp_len == 0)
+                        break;
+                const trie_node_t *child = find_trie_child(ctx->trie_nodes, node, rus_lowercase(cp));
+                if (child == NULL)
+                        break;
+                name.len -= cp_len;
+                node = child;
+        }
+        return node;
+}
+
+/// Same as \c match_exceptions for a UTF-16 name
+static const exc_forms_t *match_exceptions_u16(const petr_context_t *ctx, const exc_index_t *index, bool first_word,
+                                               petr_gender_t gender, cu16buf_t name)
+{
+        const exc_slot_t *slots = &ctx->exc_slots[index->first_slot];
+        size_t mask = index->num_slots - 1;
+        uint32_t hash = rus_utf16_hash(name);
+        for (size_t i = hash & mask;; i = (i + 1) & mask) {
+                const exc_slot_t *slot = &slots[i];
+                if (slot->word.len == 0)
+                        return NULL;
+                if (slot->hash == hash && rus_utf16_streq_utf8(name, get_string(ctx->strings, slot->word))) {
+                        uint32_t forms_idx = slot->forms[gender][first_word];
+                        return forms_idx == NO_RULE ? NULL : &ctx->exc_forms[forms_idx];
+                }
+        }
+}
+
+/// Rules matched for a single part of a UTF-16 name
+typedef struct {
+        cu16buf_t name;                 ///< Part of the name
+        const mod_rule_t *rule;         ///< Matched exception or suffix rule, or NULL
+        bool upper;                     ///< If true, the name is in all caps and so are the added suffixes
+} part_match_u16_t;
+
+/// Same as \c match_part for a UTF-16 name
+static void match_part_u16(const petr_context_t *ctx, const rules_set_t *rules, cu16buf_t name, bool first_word,
+                           petr_gender_t *gender, part_match_u16_t *match)
+{
+        match->name = name;
+        match->rule = NULL;
+        match->upper = false;
+        if (pop_n_codepoints_u16(name, 1) == 0)
+                return;
+        if (rules->cyrillic_only && !has_cyrillic_u16(name))
+                return;
+
+        uint32_t last_cp;
+        match->upper = get_last_codepoint_u16(name, &last_cp) != 0 && rus_lowercase(last_cp) != last_cp;
+
+        const trie_node_t *node = NULL;
+        if (*gender == GEND_UNKNOWN) {
+                node = walk_suffix_trie_u16(ctx, &rules->suffix_trie, name);
+                *gender = node->gender;
+        }
+        petr_gender_t match_gender = (*gender == GEND_UNKNOWN) ? GEND_ANDROGYNOUS : *gender;
+
+        // The name equals the exception word up to case, so removing the codepoints of the mods of its rule keeps
+        // the same stem as the byte lengths of its forms do
+        const exc_forms_t *forms = match_exceptions_u16(ctx, &rules->exc_index, first_word, match_gender, name);
+        if (forms != NULL) {
+                match->rule = &ctx->rules[forms->rule];
+                return;
+        }
+        if (node == NULL)
+                node = walk_suffix_trie_u16(ctx, &rules->suffix_trie, name);
+        uint32_t rule_idx = node->best[match_gender][first_word];
+        match->rule = (rule_idx == NO_RULE) ? NULL : &ctx->rules[rule_idx];
+}
+
+static int inflect_part_u16(const petr_context_t *ctx, const part_match_u16_t *match, petr_case_t dest_case,
+                            u16buf_t dest, size_t *dest_len)
+{
+        // If nothing matched, copy as-is.
+        if (match->rule == NULL)
+                return append_u16buf(match->name, dest, dest_len);
+
+        const mod_t *mod = &match->rule->mods[dest_case - 1];
+        cu16buf_t stem = match->name;
+        stem.len = pop_n_codepoints_u16(stem, mod->cnt_remove);
+        int rc = append_u16buf(stem, dest, dest_len);
         if (rc != 0)
                 return rc;
-        return append_buf(mod->add_suffix, dest, dest_len);
+        return append_u16buf(get_suffix_u16(ctx, mod, match->upper), dest, dest_len);
 }
 
-static int inflect_part(const rules_set_t *rules, cbuf_t name, bool first_word, petr_gender_t gender,
-                        petr_case_t dest_case, buf_t dest, size_t *dest_len)
+/// Same as \c next_part for a UTF-16 name
+static bool next_part_u16(cu16buf_t *name, cu16buf_t *part)
 {
-        // Do not inflect single-character names
-        if (count_codepoints(name) <= 1)
-                return append_buf(name, dest, dest_len);
-
-        // First try to search in exceptions.
-        const mod_rule_t *rule = match_rules(&rules->exceptions, first_word, gender, true, name);
-        // If not found, search in suffixes.
-        if (rule == NULL)
-                rule = match_rules(&rules->suffixes, first_word, gender, false, name);
-        // If not found, copy as-is.
-        if (rule == NULL)
-                return append_buf(name, dest, dest_len);
+        size_t len = 0;
+        while (len < name->len && name->data[len] != '-')
+                len++;
+        part->data = name->data;
+        part->len = len;
+        if (len == name->len) {
+                name->len = 0;
+                return false;
+        }
+        name->data += len + 1;
+        name->len -= len + 1;
+        return true;
+}
 
-        return apply_rule(&rule->mods[dest_case - 1], name, dest, dest_len);
+/// Same as \c resolve_gender for a UTF-16 name
+static void resolve_gender_u16(const petr_context_t *ctx, const rules_set_t *rules, cu16buf_t name,
+                               petr_gender_t *gender)
+{
+        bool hyphenated = false;
+        for (size_t i = 0; i < name.len && !hyphenated; i++)
+                hyphenated = name.data[i] == '-';
+        while (*gender == GEND_UNKNOWN && hyphenated && name.len != 0) {
+                cu16buf_t part;
+                next_part_u16(&name, &part);
+                if (pop_n_codepoints_u16(part, 1) != 0 && (!rules->cyrillic_only || has_cyrillic_u16(part)))
+                        *gender = walk_suffix_trie_u16(ctx, &rules->suffix_trie, part)->gender;
+        }
 }
 
-static int do_inflect(const rules_set_t *rules, cbuf_t name, petr_gender_t gender, petr_case_t dest_case, buf_t dest,
-                      size_t *dest_len)
+/// Same as \c do_inflect for a UTF-16 name
+static int do_inflect_u16(const petr_context_t *ctx, const rules_set_t *rules, cu16buf_t name, petr_gender_t *gender,
+                          petr_case_t dest_case, u16buf_t dest, size_t *dest_len)
 {
         if (dest_case == CASE_NOMINATIVE)
-                return copy_buf(name, dest, dest_len);
-        *dest_len = 0;
+                return append_u16buf(name, dest, dest_len);
+        resolve_gender_u16(ctx, rules, name, gender);
         bool maybe_first = true;
         while (name.len != 0) {
-                const char *dash_pos = memchr(name.data, '-', name.len);
-                cbuf_t part;
-                part.data = name.data;
-                bool found_dash = (dash_pos != NULL);
-                if (found_dash) {
-                        part.len = dash_pos - name.data;
-                        name.data += part.len + 1;
-                        name.len -= part.len + 1;
-                } else {
-                        part.len = name.len;
-                        name.len = 0;
-                }
-                int rc = inflect_part(rules, part, maybe_first && found_dash, gender, dest_case, dest, dest_len);
+                cu16buf_t part;
+                bool found_dash = next_part_u16(&name, &part);
+                part_match_u16_t match;
+                match_part_u16(ctx, rules, part, maybe_first && found_dash, gender, &match);
+                int rc = inflect_part_u16(ctx, &match, dest_case, dest, dest_len);
                 if (rc != 0)
                         return rc;
                 if (found_dash) {
-                        cbuf_t dash_buf = { "-", 1 };
-                        rc = append_buf(dash_buf, dest, dest_len);
+                        static const uint16_t dash = '-';
+                        cu16buf_t dash_buf = { &dash, 1 };
+                        rc = append_u16buf(dash_buf, dest, dest_len);
                         if (rc != 0)
                                 return rc;
                 }
@@ -616,25 +3404,36 @@ static int do_inflect(const rules_set_t *rules, cbuf_t name, petr_gender_t gende
         return 0;
 }
 
-/// Inflect a name
+/// Inflect a UTF-16 name
+///
+/// Same as \c petr_inflect for names in UTF-16 of the native byte order. The name is matched against the rules as is,
+/// without converting it to UTF-8 and back. Results are not cached.
 ///
 /// @param ctx                  Library context object
 /// @param data                 Name to inflect
-/// @param len                  Length of \c data
+/// @param len                  Length of \c data in code units
 /// @param kind                 Type of name (e.g., first name)
-/// @param gender               Grammatical gender
+/// @param gender               Grammatical gender, \c GEND_UNKNOWN to infer it from the name
 /// @param dest_case            Required grammatical case
 /// @param dest                 Destination buffer
-/// @param dest_buf_size        Size of \c dest
-/// @param dest_len             Actual number of bytes written to \c dest (excluding terminating NUL)
-/// @returns                    Error code (0, if succeed)
-int petr_inflect(const petr_context_t *ctx, const char *data, size_t len, petr_name_kind_t kind, petr_gender_t gender,
-                 petr_case_t dest_case, char *dest, size_t dest_buf_size, size_t *dest_len)
+/// @param dest_buf_size        Size of \c dest in code units
+/// @param dest_len             Actual number of code units written to \c dest (excluding terminating NUL)
+/// @returns                    Error code (0, if succeed). On failure \c dest holds an empty string.
+int petr_inflect_u16(const petr_context_t *ctx, const uint16_t *data, size_t len, petr_name_kind_t kind,
+                     petr_gender_t gender, petr_case_t dest_case, uint16_t *dest, size_t dest_buf_size,
+                     size_t *dest_len)
 {
-        const rules_set_t *rules = &ctx->sets[kind];
-        buf_t dest_buf = { dest, dest_buf_size };
-        cbuf_t name = { data, len };
-        return do_inflect(rules, name, gender, dest_case, dest_buf, dest_len);
+        u16buf_t dest_buf = { dest, dest_buf_size };
+        cu16buf_t name = { data, len };
+        *dest_len = 0;
+        int rc = do_inflect_u16(ctx, &ctx->image->sets[kind], name, &gender, dest_case, dest_buf, dest_len);
+        if (rc != 0) {
+                // Do not leave a partial result
+                *dest_len = 0;
+                if (dest_buf_size != 0)
+                        dest[0] = 0;
+        }
+        return rc;
 }
 
 /// Inflect first name
@@ -687,3 +3486,517 @@ int petr_inflect_last_name(const petr_context_t *ctx, const char *data, size_t l
 {
         return petr_inflect(ctx, data, len, NAME_LAST, gender, dest_case, dest, dest_buf_size, dest_len);
 }
+
+/// Length of the leading run of whitespace (or non-whitespace) characters
+static size_t span_spaces(cbuf_t str, bool spaces)
+{
+        size_t n = 0;
+        while (n < str.len && (str.data[n] == ' ' || str.data[n] == '\t') == spaces)
+                n++;
+        return n;
+}
+
+/// Inflect a full name
+///
+/// Words of the name are separated by spaces or tabs, which are copied as-is. A name of two words is assumed to
+/// lack the middle name. Words beyond the third one are copied as-is. Unknown gender is inferred from the middle
+/// name, or from the last name if the middle name does not tell it.
+///
+/// @param ctx                  Library context object
+/// @param data                 Name to inflect
+/// @param len                  Length of \c data
+/// @param order                Order of the words in the name
+/// @param gender               Grammatical gender
+/// @param dest_case            Required grammatical case
+/// @param dest                 Destination buffer
+/// @param dest_buf_size        Size of \c dest
+/// @param dest_len             Actual number of bytes written to \c dest (excluding terminating NUL)
+/// @returns                    Error code (0, if succeed). On failure \c dest holds an empty string.
+int petr_inflect_full_name(const petr_context_t *ctx, const char *data, size_t len, petr_name_order_t order,
+                           petr_gender_t gender, petr_case_t dest_case, char *dest, size_t dest_buf_size,
+                           size_t *dest_len)
+{
+        static const petr_name_kind_t order_kinds[][NAME_KIND_COUNT] = {
+                [ORDER_LAST_FIRST_MIDDLE] = { NAME_LAST, NAME_FIRST, NAME_MIDDLE },
+                [ORDER_FIRST_MIDDLE_LAST] = { NAME_FIRST, NAME_MIDDLE, NAME_LAST },
+        };
+        cbuf_t name = { data, len };
+
+        cbuf_t words[NAME_KIND_COUNT];
+        size_t num_words = 0;
+        for (cbuf_t rest = name; rest.len != 0;) {
+                size_t spaces_len = span_spaces(rest, true);
+                size_t word_len = span_spaces((cbuf_t){ rest.data + spaces_len, rest.len - spaces_len }, false);
+                if (word_len != 0) {
+                        if (num_words < NAME_KIND_COUNT)
+                                words[num_words] = (cbuf_t){ rest.data + spaces_len, word_len };
+                        num_words++;
+                }
+                rest.data += spaces_len + word_len;
+                rest.len -= spaces_len + word_len;
+        }
+
+        petr_name_kind_t kinds[NAME_KIND_COUNT];
+        size_t num_kinds = 0;
+        for (size_t i = 0; i < NAME_KIND_COUNT; i++) {
+                if (num_words == 2 && order_kinds[order][i] == NAME_MIDDLE)
+                        continue;
+                kinds[num_kinds++] = order_kinds[order][i];
+        }
+
+        // Middle name tells the gender best, then last name
+        static const petr_name_kind_t infer_kinds[] = { NAME_MIDDLE, NAME_LAST };
+        for (size_t i = 0; i < 2 && gender == GEND_UNKNOWN; i++) {
+                for (size_t j = 0; j < num_kinds && j < num_words; j++) {
+                        if (kinds[j] == infer_kinds[i])
+                                gender = infer_gender(ctx, &ctx->image->sets[kinds[j]], words[j]);
+                }
+        }
+
+        buf_t dest_buf = { dest, dest_buf_size };
+        *dest_len = 0;
+        int rc = 0;
+        for (size_t word_idx = 0; name.len != 0 && rc == 0; word_idx++) {
+                cbuf_t spaces = { name.data, span_spaces(name, true) };
+                rc = append_buf(spaces, dest_buf, dest_len);
+                if (rc != 0)
+                        break;
+                name.data += spaces.len;
+                name.len -= spaces.len;
+
+                cbuf_t word = { name.data, span_spaces(name, false) };
+                name.data += word.len;
+                name.len -= word.len;
+                if (word_idx < num_kinds)
+                        rc = do_inflect(ctx, &ctx->image->sets[kinds[word_idx]], word, &gender, dest_case,
+                                        dest_buf, dest_len);
+                else
+                        rc = append_buf(word, dest_buf, dest_len);
+        }
+        if (rc != 0) {
+                // Do not leave the words inflected so far
+                *dest_len = 0;
+                if (dest_buf_size != 0)
+                        dest[0] = '\0';
+        }
+        return rc;
+}
+
+/// Inflect a name to all grammatical cases
+///
+/// Rules are matched once per part of the name. Forms are written back to back into \c dest, form of case \c c
+/// occupying bytes from <tt>dest_offsets[c]</tt> to <tt>dest_offsets[c + 1]</tt>.
+///
+/// @param ctx                  Library context object
+/// @param data                 Name to inflect
+/// @param len                  Length of \c data
+/// @param kind                 Type of name (e.g., first name)
+/// @param gender               Grammatical gender
+/// @param dest                 Destination buffer, one spare byte is needed for the terminating NUL
+/// @param dest_buf_size        Size of \c dest
+/// @param dest_offsets         Offsets of forms in \c dest (one element per case plus one)
+/// @returns                    Error code (0, if succeed)
+int petr_inflect_all_cases(const petr_context_t *ctx, const char *data, size_t len, petr_name_kind_t kind,
+                           petr_gender_t gender, char *dest, size_t dest_buf_size, size_t *dest_offsets)
+{
+        const rules_set_t *rules = &ctx->image->sets[kind];
+        buf_t dest_buf = { dest, dest_buf_size };
+        cbuf_t name = { data, len };
+        size_t used = 0;
+        dest_offsets[CASE_NOMINATIVE] = 0;
+        int rc = copy_buf(name, dest_buf, &used);
+        if (rc != 0)
+                return rc;
+
+        // Names of too many parts are inflected by do_inflect, which resolves the gender itself
+        petr_gender_t full_gender = gender;
+        resolve_gender(ctx, rules, name, &gender);
+        part_match_t parts[MAX_NAME_PARTS];
+        size_t num_parts = 0;
+        bool maybe_first = true;
+        // One element is kept spare for the empty part after a trailing hyphen
+        while (name.len != 0 && num_parts + 1 < MAX_NAME_PARTS) {
+                cbuf_t part;
+                bool found_dash = next_part(&name, &part);
+                match_part(ctx, rules, part, maybe_first && found_dash, &gender, &parts[num_parts++]);
+                maybe_first = false;
+                if (found_dash && name.len == 0)
+                        match_part(ctx, rules, name, false, &gender, &parts[num_parts++]);
+        }
+
+        for (int dest_case = CASE_GENITIVE; dest_case < CASE_COUNT; dest_case++) {
+                dest_offsets[dest_case] = used;
+                if (name.len != 0) {
+                        // Too many parts, inflect case by case
+                        cbuf_t full = { data, len };
+                        petr_gender_t case_gender = full_gender;
+                        rc = do_inflect(ctx, rules, full, &case_gender, dest_case, dest_buf, &used);
+                } else {
+                        rc = emit_parts(ctx, parts, num_parts, dest_case, dest_buf, &used);
+                }
+                if (rc != 0)
+                        return rc;
+        }
+        dest_offsets[CASE_COUNT] = used;
+        return 0;
+}
+
+/// Slot of the table of names of a batch
+typedef struct {
+        size_t row;                     ///< Row index + 1 of the last name stored in the slot, 0 if empty
+        uint32_t hash;                  ///< Hash of the name
+} batch_slot_t;
+
+/// Table of the recent names of a batch, to find repeated ones
+///
+/// The table is direct-mapped and small enough to stay in cache: a name evicts the one stored in its slot, so a
+/// repeat whose first occurrence was evicted is simply inflected again. The results don't depend on it.
+typedef struct {
+        batch_slot_t *slots;
+        size_t mask;                    ///< Number of slots - 1, the number being a power of 2
+        size_t window_end;              ///< Row ending the current window of rows
+        size_t hits;                    ///< Repeated names found in the current window
+        bool enabled;                   ///< False once repeats turn out too rare to pay for the lookups
+} batch_index_t;
+
+static int batch_index_init(const petr_context_t *ctx, batch_index_t *index, size_t count)
+{
+        size_t num_slots = 1;
+        while (num_slots < count * 2 && num_slots < BATCH_INDEX_MAX_SLOTS)
+                num_slots *= 2;
+        index->slots = mem_calloc(&ctx->allocator, num_slots, sizeof(batch_slot_t));
+        if (index->slots == NULL)
+                return ERR_NOMEM;
+        index->mask = num_slots - 1;
+        index->window_end = BATCH_DEDUP_WINDOW;
+        index->hits = 0;
+        index->enabled = true;
+        return 0;
+}
+
+static void batch_index_free(const petr_context_t *ctx, batch_index_t *index)
+{
+        mem_free(&ctx->allocator, index->slots);
+}
+
+/// Hash the bytes of a name and its gender
+///
+/// Repeats are compared exactly, so there is no need for the case-insensitive \c rus_utf8_hash.
+static uint32_t batch_hash(cbuf_t name, petr_gender_t gender)
+{
+        // FNV-1a
+        uint32_t hash = 2166136261UL;
+        for (size_t i = 0; i < name.len; i++)
+                hash = (hash ^ (uint8_t)name.data[i]) * 16777619UL;
+        return (hash ^ (uint32_t)gender) * 16777619UL;
+}
+
+/// Find an earlier occurrence of the name of a row, storing the row in its slot if there is none
+///
+/// @returns    Row of the earlier occurrence, \c row itself if the name is not found
+static size_t batch_index_add(batch_index_t *index, const char *names, const size_t *name_offsets,
+                              const petr_gender_t *genders, size_t row)
+{
+        if (!index->enabled)
+                return row;
+        if (row == index->window_end) {
+                // Mostly distinct names, stop looking for repeats
+                if (index->hits < BATCH_DEDUP_MIN_HITS) {
+                        index->enabled = false;
+                        return row;
+                }
+                index->window_end += BATCH_DEDUP_WINDOW;
+                index->hits = 0;
+        }
+
+        cbuf_t name = { names + name_offsets[row], name_offsets[row + 1] - name_offsets[row] };
+        uint32_t hash = batch_hash(name, genders[row]);
+        batch_slot_t *slot = &index->slots[hash & index->mask];
+        if (slot->row != 0 && slot->hash == hash) {
+                size_t other = slot->row - 1;
+                if (genders[other] == genders[row] && name_offsets[other + 1] - name_offsets[other] == name.len
+                    && memcmp(names + name_offsets[other], name.data, name.len) == 0) {
+                        index->hits++;
+                        return other;
+                }
+        }
+        slot->row = row + 1;
+        slot->hash = hash;
+        return row;
+}
+
+/// Inflect rows of a batch into the destination buffer
+///
+/// @see petr_inflect_batch
+static int inflect_rows(const petr_context_t *ctx, size_t count, const char *names, const size_t *name_offsets,
+                        petr_name_kind_t kind, const petr_gender_t *genders, petr_case_t dest_case, char *dest,
+                        size_t dest_end, size_t *dest_offsets, int *statuses)
+{
+        const rules_set_t *rules = &ctx->image->sets[kind];
+        batch_index_t index;
+        if (batch_index_init(ctx, &index, count) != 0)
+                return ERR_NOMEM;
+
+        int result = 0;
+        size_t pos = 0;
+        for (size_t row = 0; row < count; row++) {
+                size_t first = batch_index_add(&index, names, name_offsets, genders, row);
+                dest_offsets[row] = pos;
+
+                int rc;
+                size_t res_len = 0;
+                buf_t res = { dest + pos, dest_end - pos };
+                if (first == row) {
+                        cbuf_t name = { names + name_offsets[row], name_offsets[row + 1] - name_offsets[row] };
+                        petr_gender_t gender = genders[row];
+                        rc = do_inflect(ctx, rules, name, &gender, dest_case, res, &res_len);
+                } else {
+                        // Copy the result of the first occurrence
+                        rc = statuses[first];
+                        if (rc == 0) {
+                                size_t first_len = dest_offsets[first + 1] - dest_offsets[first];
+                                cbuf_t src = { dest + dest_offsets[first], first_len };
+                                rc = copy_buf(src, res, &res_len);
+                        }
+                }
+                statuses[row] = rc;
+                if (rc != 0) {
+                        res_len = 0;
+                        if (result == 0)
+                                result = rc;
+                }
+                pos += res_len;
+        }
+        if (pos < dest_end)
+                dest[pos] = '\0';
+        dest_offsets[count] = pos;
+
+        batch_index_free(ctx, &index);
+        return result;
+}
+
+/// Inflect a column of names
+///
+/// Names are stored back to back in \c names, name \c i occupying bytes from <tt>name_offsets[i]</tt> to
+/// <tt>name_offsets[i + 1]</tt>. Results are written the same way into \c dest and \c dest_offsets. A name repeated
+/// with the same gender is usually copied from its earlier result rather than inflected again, unless the batch holds
+/// too few repeats for the lookups to pay off.
+///
+/// @param ctx                  Library context object
+/// @param count                Number of names
+/// @param names                Names to inflect
+/// @param name_offsets         Offsets of names in \c names (\c count + 1 elements)
+/// @param kind                 Type of names (e.g., first name)
+/// @param genders              Grammatical gender of each name (\c count elements)
+/// @param dest_case            Required grammatical case
+/// @param dest                 Destination buffer, one spare byte is needed for the terminating NUL
+/// @param dest_buf_size        Size of \c dest
+/// @param dest_offsets         Offsets of results in \c dest (\c count + 1 elements)
+/// @param statuses             Error code of each name (\c count elements), failed names get empty results
+/// @returns                    Error code (0, if succeed for all names)
+int petr_inflect_batch(const petr_context_t *ctx, size_t count, const char *names, const size_t *name_offsets,
+                       petr_name_kind_t kind, const petr_gender_t *genders, petr_case_t dest_case, char *dest,
+                       size_t dest_buf_size, size_t *dest_offsets, int *statuses)
+{
+        return inflect_rows(ctx, count, names, name_offsets, kind, genders, dest_case, dest, dest_buf_size,
+                            dest_offsets, statuses);
+}
+
+/// Rows of a parallel batch inflected by one task
+typedef struct {
+        size_t first_row;
+        size_t num_rows;
+        char *arena;                    ///< Results of the rows, back to back
+        size_t arena_size;              ///< Allocated size of \c arena
+        int result;
+} batch_chunk_t;
+
+/// Arguments of a parallel batch inflection
+typedef struct {
+        const petr_context_t *ctx;
+        const char *names;
+        const size_t *name_offsets;
+        petr_name_kind_t kind;
+        const petr_gender_t *genders;
+        petr_case_t dest_case;
+        char *dest;
+        size_t dest_buf_size;
+        size_t *dest_offsets;
+        int *statuses;
+        size_t *arena_offsets;          ///< Offset of the result of every row in the arena of its chunk
+        batch_chunk_t *chunks;
+        size_t num_chunks;
+} batch_job_t;
+
+/// Make room for \c size more bytes after \c used in the arena of a chunk
+static int reserve_arena(const petr_context_t *ctx, batch_chunk_t *chunk, size_t used, size_t size)
+{
+        if (chunk->arena_size - used >= size)
+                return 0;
+        size_t arena_size = chunk->arena_size * 2;
+        if (arena_size - used < size)
+                arena_size = used + size;
+        char *arena = mem_realloc(&ctx->allocator, chunk->arena, arena_size);
+        if (arena == NULL)
+                return ERR_NOMEM;
+        chunk->arena = arena;
+        chunk->arena_size = arena_size;
+        return 0;
+}
+
+/// Inflect the rows of a chunk into its arena, storing the sizes of the results in \c dest_offsets
+///
+/// A row that doesn't fit the arena is retried in a larger one, until the arena is as large as the destination
+/// buffer and the row would fail in \c petr_inflect_batch anyway.
+static void inflect_chunk(void *arg, size_t task)
+{
+        batch_job_t *job = arg;
+        batch_chunk_t *chunk = &job->chunks[task];
+        const petr_context_t *ctx = job->ctx;
+        const rules_set_t *rules = &ctx->image->sets[job->kind];
+        size_t first_row = chunk->first_row;
+        size_t end_row = first_row + chunk->num_rows;
+        batch_index_t index;
+        chunk->result = batch_index_init(ctx, &index, chunk->num_rows);
+        if (chunk->result != 0)
+                return;
+        // Inflected names are rarely much longer than the original ones
+        size_t name_bytes = job->name_offsets[end_row] - job->name_offsets[first_row];
+        chunk->result = reserve_arena(ctx, chunk, 0, name_bytes + name_bytes / 4 + 64);
+
+        size_t used = 0;
+        for (size_t row = first_row; row < end_row && chunk->result == 0; row++) {
+                size_t first = first_row + batch_index_add(&index, job->names, job->name_offsets + first_row,
+                                                           job->genders + first_row, row - first_row);
+                job->arena_offsets[row] = used;
+                int rc;
+                size_t res_len = 0;
+                if (first == row) {
+                        cbuf_t name = { job->names + job->name_offsets[row],
+                                        job->name_offsets[row + 1] - job->name_offsets[row] };
+                        for (;;) {
+                                petr_gender_t gender = job->genders[row];
+                                buf_t res = { chunk->arena + used, chunk->arena_size - used };
+                                res_len = 0;
+                                rc = do_inflect(ctx, rules, name, &gender, job->dest_case, res, &res_len);
+                                if (rc != ERR_BUF || res.len >= job->dest_buf_size)
+                                        break;
+                                chunk->result = reserve_arena(ctx, chunk, used, res.len + 1);
+                                if (chunk->result != 0)
+                                        break;
+                        }
+                } else {
+                        // Copy the result of the earlier occurrence
+                        rc = job->statuses[first];
+                        res_len = job->dest_offsets[first];
+                        if (rc == 0) {
+                                chunk->result = reserve_arena(ctx, chunk, used, res_len);
+                                if (chunk->result == 0)
+                                        memcpy(chunk->arena + used, chunk->arena + job->arena_offsets[first],
+                                               res_len);
+                        }
+                }
+                job->statuses[row] = rc;
+                if (rc != 0)
+                        res_len = 0;
+                job->dest_offsets[row] = res_len;
+                used += res_len;
+        }
+        batch_index_free(ctx, &index);
+}
+
+/// Copy the results of the rows of a chunk from its arena into the places laid out for them
+static void copy_chunk(void *arg, size_t task)
+{
+        batch_job_t *job = arg;
+        const batch_chunk_t *chunk = &job->chunks[task];
+        size_t end_row = chunk->first_row + chunk->num_rows;
+        size_t row = chunk->first_row;
+        while (row < end_row) {
+                if (job->statuses[row] != 0) {
+                        row++;
+                        continue;
+                }
+                // Results of consecutive rows are consecutive in both the arena and the destination
+                size_t start = row;
+                while (row < end_row && job->statuses[row] == 0)
+                        row++;
+                memcpy(job->dest + job->dest_offsets[start], chunk->arena + job->arena_offsets[start],
+                       job->dest_offsets[row] - job->dest_offsets[start]);
+        }
+}
+
+/// Inflect a column of names on a thread pool
+///
+/// Rows are split into chunks which the threads of the pool take in turn, stealing from each other when idle. Each
+/// chunk is inflected into an arena of its own, then the results are laid out back to back like
+/// \c petr_inflect_batch does and copied into their places. So the results are the same as those of
+/// \c petr_inflect_batch, at the cost of memory for the arenas, about the size of the results. Repeated names are
+/// looked for within a chunk.
+///
+/// @param pool                 Thread pool
+/// @returns                    Error code (0, if succeed for all names)
+/// @see petr_inflect_batch
+int petr_inflect_batch_parallel(petr_pool_t *pool, const petr_context_t *ctx, size_t count, const char *names,
+                                const size_t *name_offsets, petr_name_kind_t kind, const petr_gender_t *genders,
+                                petr_case_t dest_case, char *dest, size_t dest_buf_size, size_t *dest_offsets,
+                                int *statuses)
+{
+        if (count == 0) {
+                if (dest_buf_size != 0)
+                        dest[0] = '\0';
+                dest_offsets[0] = 0;
+                return 0;
+        }
+        // Enough chunks for stealing to even out the load, but not so small that the overhead shows
+        size_t num_chunks = (size_t)pool_num_threads(pool) * BATCH_CHUNKS_PER_THREAD;
+        if (num_chunks > count / BATCH_MIN_CHUNK_ROWS)
+                num_chunks = count / BATCH_MIN_CHUNK_ROWS;
+        if (num_chunks == 0)
+                num_chunks = 1;
+        batch_chunk_t *chunks = mem_calloc(&ctx->allocator, num_chunks, sizeof(batch_chunk_t));
+        size_t *arena_offsets = mem_calloc(&ctx->allocator, count, sizeof(size_t));
+        int result = 0;
+        if (chunks == NULL || arena_offsets == NULL) {
+                result = ERR_NOMEM;
+                goto out;
+        }
+        for (size_t i = 0; i < num_chunks; i++) {
+                chunks[i].first_row = count * i / num_chunks;
+                chunks[i].num_rows = count * (i + 1) / num_chunks - chunks[i].first_row;
+        }
+
+        batch_job_t job = { ctx, names, name_offsets, kind, genders, dest_case, dest, dest_buf_size, dest_offsets,
+                            statuses, arena_offsets, chunks, num_chunks };
+        pool_run(pool, num_chunks, inflect_chunk, &job);
+        for (size_t i = 0; i < num_chunks && result == 0; i++)
+                result = chunks[i].result;
+        if (result != 0)
+                goto out;
+
+        // Lay the results out as petr_inflect_batch would write them, failing the rows that don't fit
+        size_t pos = 0;
+        for (size_t row = 0; row < count; row++) {
+                size_t size = dest_offsets[row];
+                if (statuses[row] == 0 && pos + size >= dest_buf_size)
+                        statuses[row] = ERR_BUF;
+                dest_offsets[row] = pos;
+                if (statuses[row] == 0)
+                        pos += size;
+                else if (result == 0)
+                        result = statuses[row];
+        }
+        dest_offsets[count] = pos;
+
+        pool_run(pool, num_chunks, copy_chunk, &job);
+        if (pos < dest_buf_size)
+                dest[pos] = '\0';
+out:
+        if (chunks != NULL) {
+                for (size_t i = 0; i < num_chunks; i++)
+                        mem_free(&ctx->allocator, chunks[i].arena);
+        }
+        mem_free(&ctx->allocator, chunks);
+        mem_free(&ctx->allocator, arena_offsets);
+        return result;
+}
@@ -0,0 +1,237 @@
+/// @file pool.c
+///
+/// @copyright Copyright (c) Mail.Ru Group, 2016. All rights reserved. MIT License.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "pool.h"
+#include "alloc.h"
+
+// Tasks of a run are split into contiguous ranges, one per thread (the calling thread included). A thread takes
+// tasks from the front of its own range; when it runs out, it steals from the back of the ranges of other threads.
+// A range is packed into a single 64-bit word, so both taking and stealing are a compare-and-swap. No tasks are added
+// during a run, so a thread that finds all ranges empty is done.
+
+#define CACHE_LINE_SIZE         64
+#define MAX_POOL_THREADS        1024
+
+/// Range of tasks not yet taken: the first task in the low half, the end in the high half
+typedef struct {
+        uint64_t range;
+} __attribute__((aligned(CACHE_LINE_SIZE))) task_queue_t;
+
+struct petr_pool {
+        petr_allocator_t allocator;     ///< Allocator of the pool memory
+        unsigned num_threads;           ///< Number of worker threads, not counting the caller of a run
+        pthread_t *threads;
+        task_queue_t *queues;           ///< Queue of every worker and then the one of the caller
+        pthread_mutex_t run_lock;       ///< Serializes runs
+        pthread_mutex_t lock;           ///< Guards the fields below
+        pthread_cond_t start_cond;
+        pthread_cond_t done_cond;
+        uint64_t generation;            ///< Incremented on every run
+        unsigned active;                ///< Workers still busy with the current run
+        bool stop;
+        pool_task_fn_t fn;
+        void *arg;
+};
+
+/// Worker thread startup argument
+typedef struct {
+        petr_pool_t *pool;
+        unsigned index;
+} worker_arg_t;
+
+static bool take_task(task_queue_t *queue, bool steal, size_t *task)
+{
+        uint64_t range = __atomic_load_n(&queue->range, __ATOMIC_RELAXED);
+        for (;;) {
+                uint32_t begin = (uint32_t)range;
+                uint32_t end = (uint32_t)(range >> 32);
+                if (begin == end)
+                        return false;
+                uint64_t next = steal ? range - ((uint64_t)1 << 32) : range + 1;
+                if (__atomic_compare_exchange_n(&queue->range, &range, next, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                        *task = steal ? end - 1 : begin;
+                        return true;
+                }
+        }
+}
+
+/// Run tasks of the own queue, then steal from the others until all queues are empty
+static void run_tasks(petr_pool_t *pool, unsigned index)
+{
+        unsigned num_queues = pool->num_threads + 1;
+        size_t task;
+        while (take_task(&pool->queues[index], false, &task))
+                pool->fn(pool->arg, task);
+        for (unsigned i = 1; i < num_queues; i++) {
+                task_queue_t *victim = &pool->queues[(index + i) % num_queues];
+                while (take_task(victim, true, &task))
+                        pool->fn(pool->arg, task);
+        }
+}
+
+static void *worker_main(void *arg)
+{
+        petr_pool_t *pool = ((worker_arg_t *)arg)->pool;
+        unsigned index = ((worker_arg_t *)arg)->index;
+        mem_free(&pool->allocator, arg);
+
+        uint64_t seen = 0;
+        pthread_mutex_lock(&pool->lock);
+        for (;;) {
+                while (pool->generation == seen && !pool->stop)
+                        pthread_cond_wait(&pool->start_cond, &pool->lock);
+                if (pool->stop)
+                        break;
+                seen = pool->generation;
+                pthread_mutex_unlock(&pool->lock);
+
+                run_tasks(pool, index);
+
+                pthread_mutex_lock(&pool->lock);
+                if (--pool->active == 0)
+                        pthread_cond_signal(&pool->done_cond);
+        }
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+}
+
+static void stop_workers(petr_pool_t *pool, unsigned num_started)
+{
+        pthread_mutex_lock(&pool->lock);
+        pool->stop = true;
+        pthread_cond_broadcast(&pool->start_cond);
+        pthread_mutex_unlock(&pool->lock);
+        for (unsigned i = 0; i < num_started; i++)
+                pthread_join(pool->threads[i], NULL);
+}
+
+static void destroy_pool(petr_pool_t *pool)
+{
+        pthread_mutex_destroy(&pool->run_lock);
+        pthread_mutex_destroy(&pool->lock);
+        pthread_cond_destroy(&pool->start_cond);
+        pthread_cond_destroy(&pool->done_cond);
+        petr_allocator_t allocator = pool->allocator;
+        mem_free(&allocator, pool->threads);
+        mem_free_aligned(&allocator, pool->queues);
+        mem_free(&allocator, pool);
+}
+
+/// Create a pool of threads for parallel batch inflection
+///
+/// @param num_threads   Number of threads, 0 for the number of online CPUs. The thread calling a parallel function
+///                      takes part in the work, so one less thread is started.
+/// @param ppool         Thread pool
+/// @returns             Error code (0, if succeed)
+int petr_pool_create(unsigned num_threads, petr_pool_t **ppool)
+{
+        return petr_pool_create_with_allocator(NULL, num_threads, ppool);
+}
+
+/// Create a pool of threads for parallel batch inflection, allocating memory with the given allocator
+///
+/// @param allocator     Allocator, copied into the pool. NULL for the standard \c malloc and \c free.
+/// @see petr_pool_create
+int petr_pool_create_with_allocator(const petr_allocator_t *allocator, unsigned num_threads, petr_pool_t **ppool)
+{
+        if (allocator == NULL)
+                allocator = &g_default_allocator;
+        if (num_threads == 0) {
+                long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                num_threads = num_cpus > 0 ? (unsigned)num_cpus : 1;
+        }
+        if (num_threads > MAX_POOL_THREADS)
+                num_threads = MAX_POOL_THREADS;
+
+        petr_pool_t *pool = mem_calloc(allocator, 1, sizeof(petr_pool_t));
+        if (pool == NULL)
+                return ERR_NOMEM;
+        pool->allocator = *allocator;
+        pool->num_threads = num_threads - 1;
+        pthread_mutex_init(&pool->run_lock, NULL);
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->start_cond, NULL);
+        pthread_cond_init(&pool->done_cond, NULL);
+        pool->queues = mem_alloc_aligned(allocator, num_threads * sizeof(task_queue_t), CACHE_LINE_SIZE);
+        pool->threads = mem_calloc(allocator, num_threads, sizeof(pthread_t));
+        if (pool->queues == NULL || pool->threads == NULL) {
+                destroy_pool(pool);
+                return ERR_NOMEM;
+        }
+        memset(pool->queues, 0, num_threads * sizeof(task_queue_t));
+
+        for (unsigned i = 0; i < pool->num_threads; i++) {
+                worker_arg_t *arg = mem_alloc(allocator, sizeof(worker_arg_t));
+                if (arg != NULL) {
+                        arg->pool = pool;
+                        arg->index = i;
+                }
+                if (arg == NULL || pthread_create(&pool->threads[i], NULL, worker_main, arg) != 0) {
+                        mem_free(allocator, arg);
+                        stop_workers(pool, i);
+                        destroy_pool(pool);
+                        return ERR_NOMEM;
+                }
+        }
+        *ppool = pool;
+        return 0;
+}
+
+/// Stop the threads and free the pool
+///
+/// No parallel call may be in progress.
+void petr_pool_free(petr_pool_t *pool)
+{
+        stop_workers(pool, pool->num_threads);
+        destroy_pool(pool);
+}
+
+/// Get the number of threads taking part in a run, including the caller
+unsigned pool_num_threads(const petr_pool_t *pool)
+{
+        return pool->num_threads + 1;
+}
+
+/// Run tasks from 0 to \c num_tasks - 1 on the pool and the calling thread, return once all of them are done
+///
+/// Runs from different threads are serialized.
+///
+/// @param pool          Thread pool
+/// @param num_tasks     Number of tasks, less than 2^32
+/// @param fn            Function running a task
+/// @param arg           First argument of \c fn
+void pool_run(petr_pool_t *pool, size_t num_tasks, pool_task_fn_t fn, void *arg)
+{
+        pthread_mutex_lock(&pool->run_lock);
+        unsigned num_queues = pool->num_threads + 1;
+        for (unsigned i = 0; i < num_queues; i++) {
+                uint64_t begin = num_tasks * i / num_queues;
+                uint64_t end = num_tasks * (i + 1) / num_queues;
+                __atomic_store_n(&pool->queues[i].range, begin | (end << 32), __ATOMIC_RELAXED);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        pool->fn = fn;
+        pool->arg = arg;
+        pool->active = pool->num_threads;
+        pool->generation++;
+        pthread_cond_broadcast(&pool->start_cond);
+        pthread_mutex_unlock(&pool->lock);
+
+        run_tasks(pool, pool->num_threads);
+
+        pthread_mutex_lock(&pool->lock);
+        while (pool->active != 0)
+                pthread_cond_wait(&pool->done_cond, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+        pthread_mutex_unlock(&pool->run_lock);
+}
@@ -0,0 +1,18 @@
+/// @file pool.h
+///
+/// @copyright Copyright (c) Mail.Ru Group, 2016. All rights reserved. MIT License.
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include "petrovich.h"
+
+/// Function running a single task of \c pool_run
+typedef void (*pool_task_fn_t)(void *arg, size_t task);
+
+unsigned pool_num_threads(const petr_pool_t *pool);
+
+void pool_run(petr_pool_t *pool, size_t num_tasks, pool_task_fn_t fn, void *arg);
+
+#endif
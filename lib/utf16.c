@@ -0,0 +1,148 @@
+/// @file utf16.c
+///
+/// @copyright Copyright (c) Mail.Ru Group, 2016. All rights reserved. MIT License.
+
+#include <stdint.h>
+
+#include "utf16.h"
+#include "utf8.h"
+
+static inline bool is_high_surrogate(uint16_t unit)
+{
+        return unit >= 0xD800 && unit <= 0xDBFF;
+}
+
+static inline bool is_low_surrogate(uint16_t unit)
+{
+        return unit >= 0xDC00 && unit <= 0xDFFF;
+}
+
+/// Read one codepoint from a UTF-16 string
+///
+/// @param buf   Buffer containing the string
+/// @param cp    Destination for codepoint
+/// @return      Number of code units read. 0 in case of error
+static size_t get_codepoint_u16(cu16buf_t buf, uint32_t *cp)
+{
+        if (buf.len == 0 || is_low_surrogate(buf.data[0]))
+                return 0;
+        if (!is_high_surrogate(buf.data[0])) {
+                *cp = buf.data[0];
+                return 1;
+        }
+        if (buf.len < 2 || !is_low_surrogate(buf.data[1]))
+                return 0;
+        *cp = 0x10000 + (((uint32_t)buf.data[0] - 0xD800) << 10) + (buf.data[1] - 0xDC00);
+        return 2;
+}
+
+/// Read the last codepoint of a UTF-16 string
+///
+/// @param buf   Buffer containing the string
+/// @param cp    Destination for codepoint
+/// @return      Number of code units read. 0 in case of error
+size_t get_last_codepoint_u16(cu16buf_t buf, uint32_t *cp)
+{
+        if (buf.len == 0)
+                return 0;
+        size_t start = buf.len - 1;
+        if (is_low_surrogate(buf.data[start]) && start != 0)
+                start--;
+        cu16buf_t tail = { buf.data + start, buf.len - start };
+        if (get_codepoint_u16(tail, cp) != tail.len)
+                return 0;
+        return tail.len;
+}
+
+/// Remove \c n UTF-16 codepoints from the end of the string
+///
+/// @returns    Length of the result
+size_t pop_n_codepoints_u16(cu16buf_t str, size_t n)
+{
+        for (; n != 0 && str.len != 0; n--) {
+                str.len--;
+                if (str.len != 0 && is_low_surrogate(str.data[str.len]) && is_high_surrogate(str.data[str.len - 1]))
+                        str.len--;
+        }
+        return str.len;
+}
+
+/// Check if the string contains Cyrillic letters (any codepoint of U+0400-U+04FF)
+bool has_cyrillic_u16(cu16buf_t str)
+{
+        for (size_t i = 0; i < str.len; i++) {
+                if ((str.data[i] & 0xFF00) == 0x0400)
+                        return true;
+        }
+        return false;
+}
+
+/// Compare a Russian UTF-16 string with a UTF-8 one case-insensitive (other languages will be case-sensitive)
+///
+/// Invalid strings never compare equal to valid ones.
+///
+/// @returns    True, if strings are equal
+bool rus_utf16_streq_utf8(cu16buf_t s1, cbuf_t s2)
+{
+        while (s1.len != 0 && s2.len != 0) {
+                uint32_t cp1, cp2;
+                size_t l1 = get_codepoint_u16(s1, &cp1);
+                size_t l2 = get_codepoint(s2, &cp2);
+                if (l1 == 0 || l2 == 0 || rus_lowercase(cp1) != rus_lowercase(cp2))
+                        return false;
+                s1.data += l1;
+                s1.len -= l1;
+                s2.data += l2;
+                s2.len -= l2;
+        }
+        return s1.len == 0 && s2.len == 0;
+}
+
+/// Hash a Russian UTF-16 string case-insensitive (other languages will be case-sensitive)
+///
+/// Valid strings have the same hashes as their UTF-8 forms have according to \c rus_utf8_hash.
+uint32_t rus_utf16_hash(cu16buf_t s)
+{
+        // FNV-1a over case-folded codepoints
+        uint32_t hash = 2166136261UL;
+        while (s.len != 0) {
+                uint32_t cp;
+                size_t l = get_codepoint_u16(s, &cp);
+                if (l == 0) {
+                        // Unpaired surrogate, hash it as is
+                        cp = s.data[0];
+                        l = 1;
+                }
+                hash = (hash ^ rus_lowercase(cp)) * 16777619UL;
+                s.data += l;
+                s.len -= l;
+        }
+        return hash;
+}
+
+/// Convert a UTF-8 string to UTF-16, replacing invalid bytes with U+FFFD
+///
+/// @param src   UTF-8 string
+/// @param dest  Destination buffer of at least \c src.len code units
+/// @returns     Length of the result in code units
+size_t utf8_to_utf16(cbuf_t src, uint16_t *dest)
+{
+        size_t len = 0;
+        while (src.len != 0) {
+                uint32_t cp;
+                size_t l = get_codepoint(src, &cp);
+                if (l == 0) {
+                        cp = 0xFFFD;
+                        l = 1;
+                }
+                if (cp >= 0x10000) {
+                        dest[len++] = 0xD800 + ((cp - 0x10000) >> 10);
+                        dest[len++] = 0xDC00 + ((cp - 0x10000) & 0x3FF);
+                } else {
+                        dest[len++] = cp;
+                }
+                src.data += l;
+                src.len -= l;
+        }
+        return len;
+}
@@ -0,0 +1,24 @@
+/// @file utf16.h
+///
+/// @copyright Copyright (c) Mail.Ru Group, 2016. All rights reserved. MIT License.
+
+#ifndef UTF16_H
+#define UTF16_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "buffer.h"
+
+size_t get_last_codepoint_u16(cu16buf_t buf, uint32_t *cp);
+
+size_t pop_n_codepoints_u16(cu16buf_t str, size_t n);
+
+bool has_cyrillic_u16(cu16buf_t str);
+
+bool rus_utf16_streq_utf8(cu16buf_t s1, cbuf_t s2);
+
+uint32_t rus_utf16_hash(cu16buf_t s);
+
+size_t utf8_to_utf16(cbuf_t src, uint16_t *dest);
+
+#endif
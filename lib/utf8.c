@@ -4,8 +4,112 @@
 
 #include <stdint.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "utf8.h"
 
+// SSE2 is a part of x86-64, so the vector kernels below are always used there, without runtime dispatch. Names
+// rarely exceed 16 bytes, so wider vectors would not pay off. Other targets use the scalar code.
+
+#ifdef __SSE2__
+/// Mask of bytes of \c v that start a codepoint (all but 10xxxxxx)
+static inline unsigned lead_bytes_mask(__m128i v)
+{
+        return _mm_movemask_epi8(_mm_cmpgt_epi8(v, _mm_set1_epi8((char)0xBF)));
+}
+
+/// Mask of bytes of \c v in range [lo, hi]
+static inline __m128i bytes_in_range(__m128i v, uint8_t lo, uint8_t hi)
+{
+        __m128i d = _mm_sub_epi8(v, _mm_set1_epi8((char)lo));
+        return _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8((char)(hi - lo))), d);
+}
+
+/// Convert Russian letters of a block of UTF-8 to lowercase, byte by byte
+///
+/// @param v     Block of a string
+/// @param prev  Same block shifted one byte back (\c prev[i] precedes \c v[i] in the string)
+/// @param next  Same block shifted one byte forward
+static inline __m128i rus_lowercase_block(__m128i v, __m128i prev, __m128i next)
+{
+        // А-П (D0 90-9F) become а-п (D0 B0-BF), Р-Я (D0 A0-AF) become р-я (D1 80-8F),
+        // Ё (D0 81) becomes ё (D1 91)
+        __m128i after_d0 = _mm_cmpeq_epi8(prev, _mm_set1_epi8((char)0xD0));
+        __m128i up_a_p = _mm_and_si128(after_d0, bytes_in_range(v, 0x90, 0x9F));
+        __m128i up_r_ya = _mm_and_si128(after_d0, bytes_in_range(v, 0xA0, 0xAF));
+        __m128i up_yo = _mm_and_si128(after_d0, _mm_cmpeq_epi8(v, _mm_set1_epi8((char)0x81)));
+        __m128i lead_d1 = _mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8((char)0xD0)),
+                                        _mm_or_si128(bytes_in_range(next, 0xA0, 0xAF),
+                                                     _mm_cmpeq_epi8(next, _mm_set1_epi8((char)0x81))));
+
+        __m128i delta = _mm_sub_epi8(_mm_and_si128(up_a_p, _mm_set1_epi8(0x20)),
+                                     _mm_and_si128(up_r_ya, _mm_set1_epi8(0x20)));
+        delta = _mm_or_si128(delta, _mm_and_si128(up_yo, _mm_set1_epi8(0x10)));
+        // Masks are -1 where set, so subtracting the mask adds 1 to D0
+        return _mm_sub_epi8(_mm_add_epi8(v, delta), lead_d1);
+}
+#endif
+
+/// Remove \c n UTF-8 codepoints from the end of the string
+///
+/// @returns    Length of the result
+size_t pop_n_codepoints(cbuf_t str, size_t n)
+{
+#ifdef __SSE2__
+        while (n != 0 && str.len >= 16) {
+                unsigned mask = lead_bytes_mask(_mm_loadu_si128((const __m128i *)(str.data + str.len - 16)));
+                unsigned cnt = __builtin_popcount(mask);
+                if (cnt < n) {
+                        n -= cnt;
+                        str.len -= 16;
+                        continue;
+                }
+                // The n-th highest lead byte starts the removed tail
+                for (; n > 1; n--)
+                        mask &= ~(1U << (31 - __builtin_clz(mask)));
+                return str.len - 16 + (31 - __builtin_clz(mask));
+        }
+#endif
+        for (; n != 0; n--)
+                str.len = pop_one_codepoint(str);
+        return str.len;
+}
+
+/// Count number of UTF-8 codepoints in the string
+size_t count_codepoints(cbuf_t str)
+{
+        size_t cnt = 0;
+        size_t i = 0;
+#ifdef __SSE2__
+        for (; i + 16 <= str.len; i += 16)
+                cnt += __builtin_popcount(lead_bytes_mask(_mm_loadu_si128((const __m128i *)(str.data + i))));
+#endif
+        for (; i < str.len; i++)
+                cnt += ((uint8_t)str.data[i] & 0xC0) != 0x80;
+        return cnt;
+}
+
+/// Check if the string contains Cyrillic letters (any codepoint of U+0400-U+04FF)
+bool has_cyrillic(cbuf_t str)
+{
+        size_t i = 0;
+#ifdef __SSE2__
+        for (; i + 16 <= str.len; i += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i *)(str.data + i));
+                __m128i lead = _mm_and_si128(v, _mm_set1_epi8((char)0xFC));
+                if (_mm_movemask_epi8(_mm_cmpeq_epi8(lead, _mm_set1_epi8((char)0xD0))) != 0)
+                        return true;
+        }
+#endif
+        for (; i < str.len; i++) {
+                if (((uint8_t)str.data[i] & 0xFC) == 0xD0)
+                        return true;
+        }
+        return false;
+}
+
 /// Magic constants for get_codepoint
 static const uint32_t g_offsets_for_utf8[4] = { 0x00000000UL, 0x00003080UL, 0x000E2080UL, 0x03C82080UL };
 
@@ -14,7 +118,7 @@ static const uint32_t g_offsets_for_utf8[4] = { 0x00000000UL, 0x00003080UL, 0x00
 /// @param buf   Buffer containing the string
 /// @param cp    Destination for codepoint
 /// @return      Number of bytes read. 0 in case of error
-static size_t get_codepoint(cbuf_t buf, uint32_t *cp)
+size_t get_codepoint(cbuf_t buf, uint32_t *cp)
 {
         if (buf.len == 0)
                 return 0;
@@ -38,9 +142,9 @@ static size_t get_codepoint(cbuf_t buf, uint32_t *cp)
         uint32_t ch = 0;
         const unsigned char *source = (const unsigned char *)buf.data;
         switch (extra_len) {
-                case 3: ch += *source++; ch <<= 6;
-                case 2: ch += *source++; ch <<= 6;
-                case 1: ch += *source++; ch <<= 6;
+                case 3: ch += *source++; ch <<= 6; // fall through
+                case 2: ch += *source++; ch <<= 6; // fall through
+                case 1: ch += *source++; ch <<= 6; // fall through
                 case 0: ch += *source++;
         }
 
@@ -49,8 +153,28 @@ static size_t get_codepoint(cbuf_t buf, uint32_t *cp)
         return extra_len + 1;
 }
 
+/// Read the last codepoint of a UTF-8 string
+///
+/// @param buf   Buffer containing the string
+/// @param cp    Destination for codepoint
+/// @return      Number of bytes read. 0 in case of error
+size_t get_last_codepoint(cbuf_t buf, uint32_t *cp)
+{
+        size_t start = buf.len;
+        do {
+                if (start == 0 || buf.len - start == 4)
+                        return 0;
+                start--;
+        } while ((buf.data[start] & 0xC0) == 0x80);
+
+        cbuf_t tail = { buf.data + start, buf.len - start };
+        if (get_codepoint(tail, cp) != tail.len)
+                return 0;
+        return tail.len;
+}
+
 /// Convert a Russian unicode codepoint to lowercase. Return unchanged condepoint for all other languages.
-static uint32_t rus_lowercase(uint32_t cp)
+uint32_t rus_lowercase(uint32_t cp)
 {
         if (cp >= 0x410 && cp <= 0x042F)
                 return cp + 0x20;
@@ -59,25 +183,113 @@ static uint32_t rus_lowercase(uint32_t cp)
         return cp;
 }
 
+/// Convert Russian letters of a UTF-8 string to uppercase
+///
+/// Uppercase letters take as many bytes as lowercase ones, so \c dest receives exactly \c src.len bytes.
+void rus_utf8_upper(cbuf_t src, char *dest)
+{
+        while (src.len != 0) {
+                uint32_t cp;
+                size_t l = get_codepoint(src, &cp);
+                if (l == 2 && ((cp >= 0x430 && cp <= 0x44F) || cp == 0x451)) {
+                        cp = (cp == 0x451) ? 0x401 : cp - 0x20;
+                        dest[0] = (char)(0xC0 | (cp >> 6));
+                        dest[1] = (char)(0x80 | (cp & 0x3F));
+                } else {
+                        // Copy other codepoints and invalid bytes as-is
+                        if (l == 0)
+                                l = 1;
+                        memcpy(dest, src.data, l);
+                }
+                dest += l;
+                src.data += l;
+                src.len -= l;
+        }
+}
+
+/// Convert a byte of Russian UTF-8 to lowercase, the same way \c rus_lowercase_block does
+///
+/// @param prev  Byte preceding \c c in the string, 0 at the start
+/// @param c     Byte to convert
+/// @param next  Byte following \c c in the string, 0 at the end
+static inline uint8_t rus_lowercase_byte(uint8_t prev, uint8_t c, uint8_t next)
+{
+        if (prev == 0xD0 && c >= 0x90 && c <= 0x9F)
+                return c + 0x20;
+        if (prev == 0xD0 && c >= 0xA0 && c <= 0xAF)
+                return c - 0x20;
+        if (prev == 0xD0 && c == 0x81)
+                return 0x91;
+        if (c == 0xD0 && ((next >= 0xA0 && next <= 0xAF) || next == 0x81))
+                return 0xD1;
+        return c;
+}
+
 /// Compare two Russian UTF-8 strings case-insensitive (other languages will be case-sensitive)
 ///
+/// Only the two-byte sequences of Russian uppercase letters are folded, other bytes (including invalid UTF-8) are
+/// compared as they are, so byte-identical strings are always equal. Folding keeps lead and continuation bytes what
+/// they were, so valid UTF-8 never compares equal to invalid one.
+///
 /// @returns    True, if strings are equal
 bool rus_utf8_streq(cbuf_t s1, cbuf_t s2)
 {
-        while (s1.len != 0 && s2.len != 0) {
-                uint32_t cp1, cp2;
-                size_t l1 = get_codepoint(s1, &cp1);
-                size_t l2 = get_codepoint(s2, &cp2);
-                if (l1 == 0 && l2 == 0)
-                        break;
-                if (l1 == 0 || l2 == 0)
+        // Lowercase letters take as many bytes as uppercase ones
+        if (s1.len != s2.len)
+                return false;
+        size_t i = 0;
+#ifdef __SSE2__
+        // Compare whole blocks while the byte after the block is available
+        for (; i + 17 <= s1.len; i += 16) {
+                __m128i v1 = _mm_loadu_si128((const __m128i *)(s1.data + i));
+                __m128i v2 = _mm_loadu_si128((const __m128i *)(s2.data + i));
+                __m128i prev1 = i == 0 ? _mm_slli_si128(v1, 1) : _mm_loadu_si128((const __m128i *)(s1.data + i - 1));
+                __m128i prev2 = i == 0 ? _mm_slli_si128(v2, 1) : _mm_loadu_si128((const __m128i *)(s2.data + i - 1));
+                __m128i next1 = _mm_loadu_si128((const __m128i *)(s1.data + i + 1));
+                __m128i next2 = _mm_loadu_si128((const __m128i *)(s2.data + i + 1));
+                __m128i eq = _mm_cmpeq_epi8(rus_lowercase_block(v1, prev1, next1),
+                                            rus_lowercase_block(v2, prev2, next2));
+                if (_mm_movemask_epi8(eq) != 0xFFFF)
                         return false;
-                if (rus_lowercase(cp1) != rus_lowercase(cp2))
+        }
+#endif
+        // Finish the rest byte by byte
+        const uint8_t *d1 = (const uint8_t *)s1.data;
+        const uint8_t *d2 = (const uint8_t *)s2.data;
+        for (; i < s1.len; i++) {
+                uint8_t c1 = d1[i];
+                uint8_t c2 = d2[i];
+                if (c1 == c2 && c1 < 0x80)
+                        continue;
+                uint8_t prev1 = i == 0 ? 0 : d1[i - 1];
+                uint8_t prev2 = i == 0 ? 0 : d2[i - 1];
+                uint8_t next1 = i + 1 == s1.len ? 0 : d1[i + 1];
+                uint8_t next2 = i + 1 == s2.len ? 0 : d2[i + 1];
+                if (rus_lowercase_byte(prev1, c1, next1) != rus_lowercase_byte(prev2, c2, next2))
                         return false;
-                s1.data += l1;
-                s1.len -= l1;
-                s2.data += l2;
-                s2.len -= l2;
         }
-        return s1.len == 0 && s2.len == 0;
+        return true;
+}
+
+/// Hash a Russian UTF-8 string case-insensitive (other languages will be case-sensitive)
+///
+/// Valid strings equal according to \c rus_utf8_streq have equal hashes.
+uint32_t rus_utf8_hash(cbuf_t s)
+{
+        // FNV-1a over case-folded codepoints
+        uint32_t hash = 2166136261UL;
+        while (s.len != 0) {
+                uint32_t cp;
+                size_t l = get_codepoint(s, &cp);
+                if (l == 0) {
+                        // Invalid sequence, hash the rest as raw bytes
+                        for (size_t i = 0; i < s.len; i++)
+                                hash = (hash ^ (uint8_t)s.data[i]) * 16777619UL;
+                        break;
+                }
+                hash = (hash ^ rus_lowercase(cp)) * 16777619UL;
+                s.data += l;
+                s.len -= l;
+        }
+        return hash;
 }
@@ -6,6 +6,7 @@
 #define UTF8_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include "buffer.h"
 
 /// Remove one UTF-8 codepoint from the end of the string
@@ -13,35 +14,30 @@
 /// @returns    Length of the result
 static inline size_t pop_one_codepoint(cbuf_t str)
 {
-        do {
-                if (str.len == 0)
-                        return 0;
+        while (str.len != 0) {
                 str.len--;
-        } while ((str.data[str.len - 1] & 0xC0) == 0x80);
-        return str.len ? str.len - 1 : 0;
-}
-
-/// Remove \c n UTF-8 codepoint from the end of the string
-///
-/// @returns    Length of the result
-static inline size_t pop_n_codepoints(cbuf_t str, size_t n)
-{
-        for (size_t i = 0; i < n; i++)
-                str.len = pop_one_codepoint(str);
+                if ((str.data[str.len] & 0xC0) != 0x80)
+                        break;
+        }
         return str.len;
 }
 
-/// Count number of UTF-8 codepoints in the string
-static inline size_t count_codepoints(cbuf_t str)
-{
-        size_t cnt = 0;
-        while (str.len != 0) {
-                str.len = pop_one_codepoint(str);
-                cnt++;
-        }
-        return cnt;
-}
+size_t pop_n_codepoints(cbuf_t str, size_t n);
+
+size_t count_codepoints(cbuf_t str);
+
+bool has_cyrillic(cbuf_t str);
+
+size_t get_codepoint(cbuf_t buf, uint32_t *cp);
+
+size_t get_last_codepoint(cbuf_t buf, uint32_t *cp);
+
+uint32_t rus_lowercase(uint32_t cp);
+
+void rus_utf8_upper(cbuf_t src, char *dest);
 
 bool rus_utf8_streq(cbuf_t s1, cbuf_t s2);
 
+uint32_t rus_utf8_hash(cbuf_t s);
+
 #endif
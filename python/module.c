@@ -0,0 +1,718 @@
+/// @file module.c
+///
+/// @copyright Copyright (c) Mail.Ru Group, 2016. All rights reserved. MIT License.
+///
+/// Python extension module 'petrovich'
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "petrovich.h"
+
+#define CASE_COUNT              (CASE_PREPOSITIONAL + 1)
+#define INITIAL_BUF_SIZE        256
+
+/// Cast of a function taking keyword arguments to \c PyCFunction, as \c PyMethodDef requires
+#define KW_METHOD(fn)           ((PyCFunction)(void (*)(void))(fn))
+
+/// Rules context
+typedef struct {
+        PyObject_HEAD
+        const petr_context_t *ctx;
+        petr_context_t *owned_ctx;              ///< Context to free, NULL for the default one
+} context_object_t;
+
+/// Thread pool
+typedef struct {
+        PyObject_HEAD
+        petr_pool_t *pool;
+} pool_object_t;
+
+static PyTypeObject g_context_type;
+static PyTypeObject g_pool_type;
+static PyObject *g_error;
+
+/// Raise the exception corresponding to a library error code
+static PyObject *raise_error(int rc)
+{
+        const char *msg;
+        switch (rc) {
+        case ERR_NOMEM:
+                return PyErr_NoMemory();
+        case ERR_INVALID_RULES:
+                msg = "invalid rules";
+                break;
+        case ERR_BUF:
+                msg = "output buffer too small";
+                break;
+        case ERR_FILE:
+                msg = "error reading file";
+                break;
+        case ERR_INVALID_ARG:
+                msg = "invalid argument";
+                break;
+        default:
+                msg = "unknown error";
+                break;
+        }
+        PyObject *args = Py_BuildValue("(si)", msg, rc);
+        if (args != NULL) {
+                PyErr_SetObject(g_error, args);
+                Py_DECREF(args);
+        }
+        return NULL;
+}
+
+static bool check_enum(int value, int last, const char *what)
+{
+        if (value < 0 || value > last) {
+                PyErr_Format(PyExc_ValueError, "invalid %s %d", what, value);
+                return false;
+        }
+        return true;
+}
+
+/// Wrap a context into a new \c Context object, which takes ownership of it
+static PyObject *new_context(PyTypeObject *type, petr_context_t *ctx)
+{
+        context_object_t *self = (context_object_t *)type->tp_alloc(type, 0);
+        if (self == NULL) {
+                petr_free_context(ctx);
+                return NULL;
+        }
+        self->ctx = ctx;
+        self->owned_ctx = ctx;
+        return (PyObject *)self;
+}
+
+static PyObject *context_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+        static char *kwlist[] = { "path", "compiled", NULL };
+        PyObject *path_obj = Py_None, *path;
+        int compiled = 0;
+        if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|Op", kwlist, &path_obj, &compiled))
+                return NULL;
+        if (path_obj == Py_None) {
+                const petr_context_t *ctx = petr_default_context();
+                if (ctx == NULL) {
+                        PyErr_SetString(PyExc_ValueError, "library is built without the default rules");
+                        return NULL;
+                }
+                context_object_t *self = (context_object_t *)type->tp_alloc(type, 0);
+                if (self != NULL)
+                        self->ctx = ctx;
+                return (PyObject *)self;
+        }
+
+        if (!PyUnicode_FSConverter(path_obj, &path))
+                return NULL;
+        petr_context_t *ctx;
+        int rc;
+        const char *path_str = PyBytes_AS_STRING(path);
+        Py_BEGIN_ALLOW_THREADS
+        rc = compiled ? petr_init_from_mmap(path_str, &ctx) : petr_init_from_file(path_str, &ctx);
+        Py_END_ALLOW_THREADS
+        Py_DECREF(path);
+        if (rc != 0)
+                return raise_error(rc);
+        return new_context(type, ctx);
+}
+
+static void context_dealloc(context_object_t *self)
+{
+        if (self->owned_ctx != NULL)
+                petr_free_context(self->owned_ctx);
+        Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+PyDoc_STRVAR(context_from_string_doc,
+             "from_string(rules)\n--\n\n"
+             "Load rules from the contents of a rules file. Errors are reported with their line and column.");
+
+static PyObject *context_from_string(PyTypeObject *type, PyObject *args)
+{
+        const char *data;
+        Py_ssize_t len;
+        if (!PyArg_ParseTuple(args, "s#", &data, &len))
+                return NULL;
+        petr_context_t *ctx;
+        petr_rules_error_t error;
+        int rc = petr_init_from_string_with_error(data, len, NULL, &error, &ctx);
+        if (rc == ERR_INVALID_RULES) {
+                PyObject *exc_args = Py_BuildValue("(siII)", error.message, rc, error.line, error.column);
+                if (exc_args != NULL) {
+                        PyErr_SetObject(g_error, exc_args);
+                        Py_DECREF(exc_args);
+                }
+                return NULL;
+        }
+        if (rc != 0)
+                return raise_error(rc);
+        return new_context(type, ctx);
+}
+
+PyDoc_STRVAR(context_inflect_doc,
+             "inflect(name, kind, case, gender=UNKNOWN)\n--\n\n"
+             "Inflect a first, middle or last name.");
+
+static PyObject *context_inflect(context_object_t *self, PyObject *args, PyObject *kwargs)
+{
+        static char *kwlist[] = { "name", "kind", "case", "gender", NULL };
+        const char *name;
+        Py_ssize_t len;
+        int kind, dest_case, gender = GEND_UNKNOWN;
+        if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s#ii|i", kwlist, &name, &len, &kind, &dest_case, &gender))
+                return NULL;
+        if (!check_enum(kind, NAME_LAST, "name kind") || !check_enum(dest_case, CASE_PREPOSITIONAL, "case")
+            || !check_enum(gender, GEND_UNKNOWN, "gender"))
+                return NULL;
+
+        char buf[INITIAL_BUF_SIZE];
+        size_t res_len;
+        int rc = petr_inflect(self->ctx, name, len, kind, gender, dest_case, buf, sizeof(buf), &res_len);
+        if (rc == 0)
+                return PyUnicode_DecodeUTF8(buf, res_len, "strict");
+        if (rc != ERR_BUF)
+                return raise_error(rc);
+
+        size_t size;
+        rc = petr_inflect_size(self->ctx, name, len, kind, gender, dest_case, &size);
+        if (rc != 0)
+                return raise_error(rc);
+        // The size doesn't include the terminating NUL
+        char *dest = PyMem_Malloc(size + 1);
+        if (dest == NULL)
+                return PyErr_NoMemory();
+        rc = petr_inflect(self->ctx, name, len, kind, gender, dest_case, dest, size + 1, &res_len);
+        PyObject *res = rc == 0 ? PyUnicode_DecodeUTF8(dest, res_len, "strict") : raise_error(rc);
+        PyMem_Free(dest);
+        return res;
+}
+
+PyDoc_STRVAR(context_inflect_full_doc,
+             "inflect_full(name, case, gender=UNKNOWN, order=ORDER_LAST_FIRST_MIDDLE)\n--\n\n"
+             "Inflect a full name.");
+
+static PyObject *context_inflect_full(context_object_t *self, PyObject *args, PyObject *kwargs)
+{
+        static char *kwlist[] = { "name", "case", "gender", "order", NULL };
+        const char *name;
+        Py_ssize_t len;
+        int dest_case, gender = GEND_UNKNOWN, order = ORDER_LAST_FIRST_MIDDLE;
+        if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s#i|ii", kwlist, &name, &len, &dest_case, &gender, &order))
+                return NULL;
+        if (!check_enum(dest_case, CASE_PREPOSITIONAL, "case") || !check_enum(gender, GEND_UNKNOWN, "gender")
+            || !check_enum(order, ORDER_FIRST_MIDDLE_LAST, "order"))
+                return NULL;
+
+        char stack_buf[INITIAL_BUF_SIZE];
+        char *buf = stack_buf;
+        size_t size = sizeof(stack_buf);
+        for (;;) {
+                size_t res_len;
+                int rc = petr_inflect_full_name(self->ctx, name, len, order, gender, dest_case, buf, size, &res_len);
+                PyObject *res = NULL;
+                if (rc == 0)
+                        res = PyUnicode_DecodeUTF8(buf, res_len, "strict");
+                else if (rc != ERR_BUF)
+                        raise_error(rc);
+                if (buf != stack_buf)
+                        PyMem_Free(buf);
+                if (rc != ERR_BUF)
+                        return res;
+                size *= 2;
+                buf = PyMem_Malloc(size);
+                if (buf == NULL)
+                        return PyErr_NoMemory();
+        }
+}
+
+PyDoc_STRVAR(context_inflect_all_doc,
+             "inflect_all(name, kind, gender=UNKNOWN)\n--\n\n"
+             "Inflect a first, middle or last name to all cases, returns a list indexed by case.");
+
+static PyObject *context_inflect_all(context_object_t *self, PyObject *args, PyObject *kwargs)
+{
+        static char *kwlist[] = { "name", "kind", "gender", NULL };
+        const char *name;
+        Py_ssize_t len;
+        int kind, gender = GEND_UNKNOWN;
+        if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s#i|i", kwlist, &name, &len, &kind, &gender))
+                return NULL;
+        if (!check_enum(kind, NAME_LAST, "name kind") || !check_enum(gender, GEND_UNKNOWN, "gender"))
+                return NULL;
+
+        char stack_buf[INITIAL_BUF_SIZE * CASE_COUNT];
+        char *buf = stack_buf;
+        size_t size = sizeof(stack_buf);
+        size_t offsets[CASE_COUNT + 1];
+        int rc;
+        while ((rc = petr_inflect_all_cases(self->ctx, name, len, kind, gender, buf, size, offsets)) == ERR_BUF) {
+                if (buf != stack_buf)
+                        PyMem_Free(buf);
+                size *= 2;
+                buf = PyMem_Malloc(size);
+                if (buf == NULL)
+                        return PyErr_NoMemory();
+        }
+
+        PyObject *res = NULL;
+        if (rc != 0) {
+                raise_error(rc);
+        } else if ((res = PyList_New(CASE_COUNT)) != NULL) {
+                for (int i = 0; i < CASE_COUNT; i++) {
+                        PyObject *form = PyUnicode_DecodeUTF8(buf + offsets[i], offsets[i + 1] - offsets[i], "strict");
+                        if (form == NULL) {
+                                Py_CLEAR(res);
+                                break;
+                        }
+                        PyList_SET_ITEM(res, i, form);
+                }
+        }
+        if (buf != stack_buf)
+                PyMem_Free(buf);
+        return res;
+}
+
+/// Sum the exact sizes of the results of a batch
+static size_t batch_size(const petr_context_t *ctx, size_t count, const char *names, const size_t *name_offsets,
+                         petr_name_kind_t kind, const petr_gender_t *genders, petr_case_t dest_case)
+{
+        size_t total = 0;
+        for (size_t i = 0; i < count; i++) {
+                size_t size = 0;
+                petr_inflect_size(ctx, names + name_offsets[i], name_offsets[i + 1] - name_offsets[i], kind,
+                                  genders[i], dest_case, &size);
+                total += size;
+        }
+        return total;
+}
+
+/// Inflect a batch into a new bytes object, the results back to back as described by \c dest_offsets
+///
+/// The GIL is released while the names are inflected, so \c names must not be modified by other threads.
+///
+/// @param dest_offsets         Offsets of results (\c count + 1 elements)
+/// @param statuses             Error code of each name (\c count elements), failed names get empty results
+static PyObject *inflect_batch_bytes(const petr_context_t *ctx, petr_pool_t *pool, size_t count, const char *names,
+                                     const size_t *name_offsets, petr_name_kind_t kind, const petr_gender_t *genders,
+                                     petr_case_t dest_case, size_t *dest_offsets, int *statuses)
+{
+        // Inflected names are rarely much longer than the original ones. Otherwise the results are measured and the
+        // batch is repeated with a buffer of the exact size.
+        size_t names_size = name_offsets[count] - name_offsets[0];
+        size_t size = names_size + names_size / 2 + 8 * count + 64;
+        bool exact = false;
+        for (;;) {
+                // Bytes objects have a spare byte for the terminating NUL
+                PyObject *res = PyBytes_FromStringAndSize(NULL, size);
+                if (res == NULL)
+                        return NULL;
+                char *dest = PyBytes_AS_STRING(res);
+                int rc;
+                bool overflow = false;
+                Py_BEGIN_ALLOW_THREADS
+                if (pool == NULL) {
+                        rc = petr_inflect_batch(ctx, count, names, name_offsets, kind, genders, dest_case, dest,
+                                                size + 1, dest_offsets, statuses);
+                } else {
+                        rc = petr_inflect_batch_parallel(pool, ctx, count, names, name_offsets, kind, genders,
+                                                         dest_case, dest, size + 1, dest_offsets, statuses);
+                }
+                for (size_t i = 0; i < count && rc != 0 && rc != ERR_NOMEM; i++)
+                        overflow = overflow || statuses[i] == ERR_BUF;
+                if (overflow && !exact)
+                        size = batch_size(ctx, count, names, name_offsets, kind, genders, dest_case);
+                Py_END_ALLOW_THREADS
+
+                if (rc == ERR_NOMEM) {
+                        Py_CLEAR(res);
+                        return PyErr_NoMemory();
+                }
+                if (!overflow || exact) {
+                        _PyBytes_Resize(&res, dest_offsets[count]);
+                        return res;
+                }
+                Py_CLEAR(res);
+                exact = true;
+        }
+}
+
+/// Get the genders argument of a batch as an array of \c count elements
+static petr_gender_t *get_genders(PyObject *obj, size_t count)
+{
+        petr_gender_t *genders = PyMem_Malloc(count * sizeof(petr_gender_t) + 1);
+        if (genders == NULL)
+                return (petr_gender_t *)PyErr_NoMemory();
+        if (PyLong_Check(obj)) {
+                long gender = PyLong_AsLong(obj);
+                if (!check_enum(gender, GEND_UNKNOWN, "gender"))
+                        goto fail;
+                for (size_t i = 0; i < count; i++)
+                        genders[i] = gender;
+                return genders;
+        }
+
+        PyObject *seq = PySequence_Fast(obj, "gender must be an int or a sequence of ints");
+        if (seq == NULL)
+                goto fail;
+        if ((size_t)PySequence_Fast_GET_SIZE(seq) != count) {
+                PyErr_SetString(PyExc_ValueError, "number of genders differs from the number of names");
+                Py_DECREF(seq);
+                goto fail;
+        }
+        for (size_t i = 0; i < count; i++) {
+                long gender = PyLong_AsLong(PySequence_Fast_GET_ITEM(seq, i));
+                if ((gender == -1 && PyErr_Occurred()) || !check_enum(gender, GEND_UNKNOWN, "gender")) {
+                        Py_DECREF(seq);
+                        goto fail;
+                }
+                genders[i] = gender;
+        }
+        Py_DECREF(seq);
+        return genders;
+fail:
+        PyMem_Free(genders);
+        return NULL;
+}
+
+/// Get name offsets of a buffer batch, converting them to \c size_t if needed
+///
+/// @param view         Buffer of \c count + 1 offsets
+/// @param copy         Set to the converted offsets, to be freed by the caller, or NULL if \c view is used as is
+static const size_t *get_name_offsets(const Py_buffer *view, size_t count, size_t names_size, size_t **copy)
+{
+        const size_t *offsets = view->buf;
+        *copy = NULL;
+        const char *format = view->format ? view->format : "B";
+        if (strchr("@=<>!", *format) != NULL)
+                format++;
+        if (format[0] == '\0' || format[1] != '\0' || strchr("iIlLqQnN", format[0]) == NULL) {
+                PyErr_SetString(PyExc_TypeError, "offsets must be integers");
+                return NULL;
+        }
+        if (view->itemsize != sizeof(size_t)) {
+                if (view->itemsize != sizeof(uint32_t)) {
+                        PyErr_SetString(PyExc_TypeError, "offsets must be 32-bit or 64-bit integers");
+                        return NULL;
+                }
+                if ((*copy = PyMem_Malloc((count + 1) * sizeof(size_t))) == NULL)
+                        return (const size_t *)PyErr_NoMemory();
+                for (size_t i = 0; i <= count; i++)
+                        (*copy)[i] = ((const uint32_t *)view->buf)[i];
+                offsets = *copy;
+        }
+        for (size_t i = 0; i <= count; i++) {
+                if (offsets[i] > names_size || (i != 0 && offsets[i] < offsets[i - 1])) {
+                        PyErr_SetString(PyExc_ValueError, "offsets must be ascending and within the names");
+                        PyMem_Free(*copy);
+                        *copy = NULL;
+                        return NULL;
+                }
+        }
+        return offsets;
+}
+
+/// Inflect a batch given as a bytes-like object of names and a buffer of offsets
+static PyObject *inflect_batch_buffer(const petr_context_t *ctx, petr_pool_t *pool, PyObject *names_obj,
+                                      PyObject *offsets_obj, int kind, int dest_case, PyObject *gender_obj)
+{
+        Py_buffer names, offsets_view;
+        if (PyObject_GetBuffer(names_obj, &names, PyBUF_SIMPLE) != 0)
+                return NULL;
+        if (PyObject_GetBuffer(offsets_obj, &offsets_view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0) {
+                PyBuffer_Release(&names);
+                return NULL;
+        }
+
+        PyObject *res = NULL;
+        PyObject *dest_offsets_obj = NULL;
+        size_t *offsets_copy = NULL;
+        petr_gender_t *genders = NULL;
+        int *statuses = NULL;
+        size_t count = offsets_view.itemsize ? offsets_view.len / offsets_view.itemsize : 0;
+        if (count == 0) {
+                PyErr_SetString(PyExc_ValueError, "offsets must have at least one element");
+                goto out;
+        }
+        count--;
+        const size_t *name_offsets = get_name_offsets(&offsets_view, count, names.len, &offsets_copy);
+        if (name_offsets == NULL || (genders = get_genders(gender_obj, count)) == NULL)
+                goto out;
+        statuses = PyMem_Malloc(count * sizeof(int) + 1);
+        dest_offsets_obj = PyBytes_FromStringAndSize(NULL, (count + 1) * sizeof(size_t));
+        if (statuses == NULL || dest_offsets_obj == NULL) {
+                if (statuses == NULL)
+                        PyErr_NoMemory();
+                goto out;
+        }
+
+        PyObject *dest = inflect_batch_bytes(ctx, pool, count, names.buf, name_offsets, kind, genders, dest_case,
+                                             (size_t *)PyBytes_AS_STRING(dest_offsets_obj), statuses);
+        if (dest == NULL)
+                goto out;
+        PyObject *view = PyMemoryView_FromObject(dest_offsets_obj);
+        PyObject *dest_offsets = view ? PyObject_CallMethod(view, "cast", "s", "N") : NULL;
+        Py_XDECREF(view);
+        if (dest_offsets != NULL)
+                res = Py_BuildValue("(NN)", dest, dest_offsets);
+        else
+                Py_DECREF(dest);
+out:
+        Py_XDECREF(dest_offsets_obj);
+        PyMem_Free(statuses);
+        PyMem_Free(genders);
+        PyMem_Free(offsets_copy);
+        PyBuffer_Release(&offsets_view);
+        PyBuffer_Release(&names);
+        return res;
+}
+
+/// Inflect a batch given as a sequence of strings
+static PyObject *inflect_batch_list(const petr_context_t *ctx, petr_pool_t *pool, PyObject *names_obj, int kind,
+                                    int dest_case, PyObject *gender_obj)
+{
+        PyObject *seq = PySequence_Fast(names_obj, "names must be a sequence of strings");
+        if (seq == NULL)
+                return NULL;
+        size_t count = PySequence_Fast_GET_SIZE(seq);
+        PyObject *res = NULL;
+        char *names = NULL;
+        size_t *name_offsets = PyMem_Malloc((count + 1) * sizeof(size_t));
+        size_t *dest_offsets = PyMem_Malloc((count + 1) * sizeof(size_t));
+        int *statuses = PyMem_Malloc(count * sizeof(int) + 1);
+        petr_gender_t *genders = NULL;
+        if (name_offsets == NULL || dest_offsets == NULL || statuses == NULL) {
+                PyErr_NoMemory();
+                goto out;
+        }
+
+        // The library takes the names back to back
+        name_offsets[0] = 0;
+        for (size_t i = 0; i < count; i++) {
+                Py_ssize_t len;
+                if (PyUnicode_AsUTF8AndSize(PySequence_Fast_GET_ITEM(seq, i), &len) == NULL)
+                        goto out;
+                name_offsets[i + 1] = name_offsets[i] + len;
+        }
+        if ((names = PyMem_Malloc(name_offsets[count] + 1)) == NULL) {
+                PyErr_NoMemory();
+                goto out;
+        }
+        for (size_t i = 0; i < count; i++) {
+                const char *name = PyUnicode_AsUTF8(PySequence_Fast_GET_ITEM(seq, i));
+                memcpy(names + name_offsets[i], name, name_offsets[i + 1] - name_offsets[i]);
+        }
+        if ((genders = get_genders(gender_obj, count)) == NULL)
+                goto out;
+
+        PyObject *dest = inflect_batch_bytes(ctx, pool, count, names, name_offsets, kind, genders, dest_case,
+                                             dest_offsets, statuses);
+        if (dest == NULL)
+                goto out;
+        if ((res = PyList_New(count)) != NULL) {
+                const char *data = PyBytes_AS_STRING(dest);
+                for (size_t i = 0; i < count; i++) {
+                        PyObject *item;
+                        if (statuses[i] == 0) {
+                                size_t len = dest_offsets[i + 1] - dest_offsets[i];
+                                item = PyUnicode_DecodeUTF8(data + dest_offsets[i], len, "strict");
+                        } else {
+                                item = Py_None;
+                                Py_INCREF(item);
+                        }
+                        if (item == NULL) {
+                                Py_CLEAR(res);
+                                break;
+                        }
+                        PyList_SET_ITEM(res, i, item);
+                }
+        }
+        Py_DECREF(dest);
+out:
+        PyMem_Free(genders);
+        PyMem_Free(names);
+        PyMem_Free(statuses);
+        PyMem_Free(dest_offsets);
+        PyMem_Free(name_offsets);
+        Py_DECREF(seq);
+        return res;
+}
+
+PyDoc_STRVAR(context_inflect_batch_doc,
+             "inflect_batch(names, kind, case, gender=UNKNOWN, offsets=None, pool=None)\n--\n\n"
+             "Inflect a column of names, releasing the GIL while they are inflected.\n\n"
+             "names is either a sequence of strings, and then a list of results is returned (None for the names that\n"
+             "failed), or a bytes-like object of UTF-8 names stored back to back, name i occupying bytes from\n"
+             "offsets[i] to offsets[i + 1]. offsets is then a buffer of 32-bit or 64-bit integers, and a tuple of\n"
+             "results stored the same way and their offsets is returned (failed names get empty results).\n"
+             "gender is either the same for all names or a sequence of genders. With a Pool, the names are inflected\n"
+             "by its threads.");
+
+static PyObject *context_inflect_batch(context_object_t *self, PyObject *args, PyObject *kwargs)
+{
+        static char *kwlist[] = { "names", "kind", "case", "gender", "offsets", "pool", NULL };
+        PyObject *names, *gender = NULL, *offsets = Py_None, *pool_obj = Py_None;
+        int kind, dest_case;
+        if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Oii|OOO", kwlist, &names, &kind, &dest_case, &gender,
+                                         &offsets, &pool_obj))
+                return NULL;
+        if (!check_enum(kind, NAME_LAST, "name kind") || !check_enum(dest_case, CASE_PREPOSITIONAL, "case"))
+                return NULL;
+        petr_pool_t *pool = NULL;
+        if (pool_obj != Py_None) {
+                if (!PyObject_TypeCheck(pool_obj, &g_pool_type)) {
+                        PyErr_SetString(PyExc_TypeError, "pool must be a Pool");
+                        return NULL;
+                }
+                pool = ((pool_object_t *)pool_obj)->pool;
+        }
+
+        PyObject *unknown = NULL;
+        if (gender == NULL && (gender = unknown = PyLong_FromLong(GEND_UNKNOWN)) == NULL)
+                return NULL;
+        PyObject *res;
+        if (offsets != Py_None)
+                res = inflect_batch_buffer(self->ctx, pool, names, offsets, kind, dest_case, gender);
+        else
+                res = inflect_batch_list(self->ctx, pool, names, kind, dest_case, gender);
+        Py_XDECREF(unknown);
+        return res;
+}
+
+static PyMethodDef g_context_methods[] = {
+        { "from_string", (PyCFunction)context_from_string, METH_VARARGS | METH_CLASS, context_from_string_doc },
+        { "inflect", KW_METHOD(context_inflect), METH_VARARGS | METH_KEYWORDS, context_inflect_doc },
+        { "inflect_full", KW_METHOD(context_inflect_full), METH_VARARGS | METH_KEYWORDS, context_inflect_full_doc },
+        { "inflect_all", KW_METHOD(context_inflect_all), METH_VARARGS | METH_KEYWORDS, context_inflect_all_doc },
+        { "inflect_batch", KW_METHOD(context_inflect_batch), METH_VARARGS | METH_KEYWORDS,
+          context_inflect_batch_doc },
+        { NULL, NULL, 0, NULL }
+};
+
+PyDoc_STRVAR(context_doc,
+             "Context(path=None, compiled=False)\n--\n\n"
+             "Inflection rules: the default ones, a rules file or, if compiled is true, a file compiled by\n"
+             "petr_compile_rules.");
+
+static PyTypeObject g_context_type = {
+        PyVarObject_HEAD_INIT(NULL, 0)
+        .tp_name = "petrovich.Context",
+        .tp_basicsize = sizeof(context_object_t),
+        .tp_dealloc = (destructor)context_dealloc,
+        .tp_flags = Py_TPFLAGS_DEFAULT,
+        .tp_doc = context_doc,
+        .tp_methods = g_context_methods,
+        .tp_new = context_new,
+};
+
+static PyObject *pool_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+        static char *kwlist[] = { "threads", NULL };
+        unsigned threads = 0;
+        if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|I", kwlist, &threads))
+                return NULL;
+        pool_object_t *self = (pool_object_t *)type->tp_alloc(type, 0);
+        if (self == NULL)
+                return NULL;
+        int rc = petr_pool_create(threads, &self->pool);
+        if (rc != 0) {
+                Py_DECREF(self);
+                return raise_error(rc);
+        }
+        return (PyObject *)self;
+}
+
+static void pool_dealloc(pool_object_t *self)
+{
+        if (self->pool != NULL) {
+                Py_BEGIN_ALLOW_THREADS
+                petr_pool_free(self->pool);
+                Py_END_ALLOW_THREADS
+        }
+        Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+PyDoc_STRVAR(pool_doc,
+             "Pool(threads=0)\n--\n\n"
+             "Pool of threads for Context.inflect_batch, threads=0 for the number of CPUs.");
+
+static PyTypeObject g_pool_type = {
+        PyVarObject_HEAD_INIT(NULL, 0)
+        .tp_name = "petrovich.Pool",
+        .tp_basicsize = sizeof(pool_object_t),
+        .tp_dealloc = (destructor)pool_dealloc,
+        .tp_flags = Py_TPFLAGS_DEFAULT,
+        .tp_doc = pool_doc,
+        .tp_new = pool_new,
+};
+
+static struct PyModuleDef g_module = {
+        PyModuleDef_HEAD_INIT,
+        .m_name = "petrovich",
+        .m_doc = "Inflection of Russian names",
+        .m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit_petrovich(void);
+
+PyMODINIT_FUNC PyInit_petrovich(void)
+{
+        static const struct {
+                const char *name;
+                int value;
+        } constants[] = {
+                { "FIRST", NAME_FIRST },
+                { "MIDDLE", NAME_MIDDLE },
+                { "LAST", NAME_LAST },
+                { "MALE", GEND_MALE },
+                { "FEMALE", GEND_FEMALE },
+                { "ANDROGYNOUS", GEND_ANDROGYNOUS },
+                { "UNKNOWN", GEND_UNKNOWN },
+                { "NOMINATIVE", CASE_NOMINATIVE },
+                { "GENITIVE", CASE_GENITIVE },
+                { "DATIVE", CASE_DATIVE },
+                { "ACCUSATIVE", CASE_ACCUSATIVE },
+                { "INSTRUMENTAL", CASE_INSTRUMENTAL },
+                { "PREPOSITIONAL", CASE_PREPOSITIONAL },
+                { "ORDER_LAST_FIRST_MIDDLE", ORDER_LAST_FIRST_MIDDLE },
+                { "ORDER_FIRST_MIDDLE_LAST", ORDER_FIRST_MIDDLE_LAST },
+        };
+
+        if (PyType_Ready(&g_context_type) < 0 || PyType_Ready(&g_pool_type) < 0)
+                return NULL;
+        PyObject *module = PyModule_Create(&g_module);
+        if (module == NULL)
+                return NULL;
+        for (size_t i = 0; i < sizeof(constants) / sizeof(constants[0]); i++) {
+                if (PyModule_AddIntConstant(module, constants[i].name, constants[i].value) != 0)
+                        goto fail;
+        }
+
+        // Arguments of the exception: message, error code and, for invalid rules, line and column
+        g_error = PyErr_NewException("petrovich.Error", NULL, NULL);
+        if (g_error == NULL)
+                goto fail;
+        Py_INCREF(g_error);
+        if (PyModule_AddObject(module, "Error", g_error) != 0) {
+                Py_DECREF(g_error);
+                goto fail;
+        }
+        Py_INCREF(&g_context_type);
+        if (PyModule_AddObject(module, "Context", (PyObject *)&g_context_type) != 0) {
+                Py_DECREF(&g_context_type);
+                goto fail;
+        }
+        Py_INCREF(&g_pool_type);
+        if (PyModule_AddObject(module, "Pool", (PyObject *)&g_pool_type) != 0) {
+                Py_DECREF(&g_pool_type);
+                goto fail;
+        }
+        return module;
+fail:
+        Py_DECREF(module);
+        return NULL;
+}
@@ -8,12 +8,10 @@ rm -rf "$BUILD_DIR"
 mkdir -p "$BUILD_DIR/debug"
 
 cd "$BUILD_DIR/debug"
-cp '../../rules.yml' .
 cmake ../.. -DCMAKE_BUILD_TYPE=Debug
 make -j$(nproc)
 
 mkdir -p "$BUILD_DIR/release"
 cd "$BUILD_DIR/release"
-cp '../../rules.yml' .
 cmake ../.. -DCMAKE_BUILD_TYPE=RelWithDebInfo
 make -j$(nproc)
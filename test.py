@@ -3,22 +3,86 @@
 import unittest
 import subprocess
 import os.path
+import tempfile
+import sys
+import array
 
 BINARY_PATH = os.path.join(os.path.dirname(__file__),
                            'build', 'debug', 'petr_test')
+BATCH_BINARY_PATH = os.path.join(os.path.dirname(__file__),
+                                 'build', 'debug', 'petr_batch')
+COMPILE_BINARY_PATH = os.path.join(os.path.dirname(__file__),
+                                   'build', 'debug', 'petr_compile_rules')
+RULES_PATH = os.path.join(os.path.dirname(__file__), 'rules.yml')
+
+# The extension module runs the tests in-process, the test programs are used if it isn't built
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), 'build', 'debug'))
+try:
+    import petrovich
+except ImportError:
+    petrovich = None
 
 MALE = 'male'
 FEMALE = 'female'
+UNKNOWN = 'unknown'
 
 FIRST = 'first'
 MIDDLE = 'middle'
 LAST = 'last'
+FULL = 'full'
+
+def run_module_test(kind, gender, names):
+    ctx = petrovich.Context()
+    gender = getattr(petrovich, gender.upper())
+    cases = range(petrovich.NOMINATIVE, petrovich.PREPOSITIONAL + 1)
+    if kind == FULL:
+        res = []
+        for name in names:
+            for case in cases:
+                try:
+                    res.append(ctx.inflect_full(name, case, gender))
+                except petrovich.Error:
+                    res.append('ERROR')
+        return res
+    kind = getattr(petrovich, kind.upper())
+    if len(names) == 1:
+        res = []
+        for case in cases:
+            try:
+                res.append(ctx.inflect(names[0], kind, case, gender))
+            except petrovich.Error:
+                res.append('ERROR')
+        return res
+    by_case = [ctx.inflect_batch(names, kind, case, gender) for case in cases]
+    return ['ERROR' if forms[i] is None else forms[i] for i in range(len(names)) for forms in by_case]
 
-def run_test(kind, gender, name):
-    with subprocess.Popen([BINARY_PATH, kind, gender, name],
+def run_test(kind, gender, *names):
+    if petrovich is not None:
+        return run_module_test(kind, gender, names)
+    with subprocess.Popen([BINARY_PATH, kind, gender] + list(names),
                           stdout=subprocess.PIPE, close_fds=True) as process:
         return process.stdout.read().decode('utf-8').strip().split('\n')
 
+def run_all_cases(kind, gender, name):
+    if petrovich is not None:
+        try:
+            return petrovich.Context().inflect_all(name, getattr(petrovich, kind.upper()),
+                                                   getattr(petrovich, gender.upper()))
+        except petrovich.Error:
+            return ['ERROR'] * 6
+    with subprocess.Popen([BINARY_PATH, '--all-cases', kind, gender, name],
+                          stdout=subprocess.PIPE, close_fds=True) as process:
+        return process.stdout.read().decode('utf-8').strip().split('\n')
+
+def run_binary(*args):
+    res = subprocess.run([BINARY_PATH] + list(args), stdout=subprocess.PIPE, check=True)
+    return res.stdout.decode('utf-8').strip().split('\n')
+
+def run_batch(data, *args):
+    res = subprocess.run([BATCH_BINARY_PATH] + list(args), input=data.encode('utf-8'),
+                         stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+    return res.stdout.decode('utf-8').split('\n')[:-1]
+
 class TestPetrovich(unittest.TestCase):
     def test_male_first(self):
         res = run_test(FIRST, MALE, 'Николай')
@@ -74,15 +138,25 @@ class TestPetrovich(unittest.TestCase):
         self.assertEqual(res[4], 'Ворониной')
         self.assertEqual(res[5], 'Ворониной')
 
+    def test_double_last(self):
+        res = run_test(LAST, MALE, 'Бонч-Бруевич')
+        self.assertEqual(res[0], 'Бонч-Бруевич')
+        self.assertEqual(res[1], 'Бонч-Бруевича')
+        self.assertEqual(res[2], 'Бонч-Бруевичу')
+        self.assertEqual(res[3], 'Бонч-Бруевича')
+        self.assertEqual(res[4], 'Бонч-Бруевичем')
+        self.assertEqual(res[5], 'Бонч-Бруевиче')
+
     def test_caps(self):
         res = run_test(FIRST, FEMALE, 'ОЛЬГА')
         self.assertEqual(res[0], 'ОЛЬГА')
-        # FIXME: mixed case is ugly
-        self.assertEqual(res[1], 'ОЛЬГи')
-        self.assertEqual(res[2], 'ОЛЬГе')
-        self.assertEqual(res[3], 'ОЛЬГу')
-        self.assertEqual(res[4], 'ОЛЬГой')
-        self.assertEqual(res[5], 'ОЛЬГе')
+        self.assertEqual(res[1], 'ОЛЬГИ')
+        self.assertEqual(res[2], 'ОЛЬГЕ')
+        self.assertEqual(res[3], 'ОЛЬГУ')
+        self.assertEqual(res[4], 'ОЛЬГОЙ')
+        self.assertEqual(res[5], 'ОЛЬГЕ')
+        res = run_test(FIRST, MALE, 'ПЁТР')
+        self.assertEqual(res[1], 'ПЕТРА')
 
     def test_latin(self):
         res = run_test(FIRST, FEMALE, 'latin')
@@ -101,6 +175,234 @@ class TestPetrovich(unittest.TestCase):
         self.assertEqual(res[3], 'я')
         self.assertEqual(res[4], 'я')
         self.assertEqual(res[5], 'я')
+    def test_batch(self):
+        res = run_test(FIRST, MALE, 'Николай', 'Пётр', 'Николай', 'latin')
+        self.assertEqual(len(res), 24)
+        self.assertEqual(res[0:6], ['Николай', 'Николая', 'Николаю', 'Николая', 'Николаем', 'Николае'])
+        self.assertEqual(res[6:12], ['Пётр', 'Петра', 'Петру', 'Петра', 'Петром', 'Петре'])
+        self.assertEqual(res[12:18], res[0:6])
+        self.assertEqual(res[18:24], ['latin'] * 6)
+    def test_full_name(self):
+        res = run_test(FULL, FEMALE, 'Иванова  Татьяна Алексеевна', 'Иванова Татьяна')
+        self.assertEqual(res[0], 'Иванова  Татьяна Алексеевна')
+        self.assertEqual(res[1], 'Ивановой  Татьяны Алексеевны')
+        self.assertEqual(res[2], 'Ивановой  Татьяне Алексеевне')
+        self.assertEqual(res[3], 'Иванову  Татьяну Алексеевну')
+        self.assertEqual(res[4], 'Ивановой  Татьяной Алексеевной')
+        self.assertEqual(res[5], 'Ивановой  Татьяне Алексеевне')
+        self.assertEqual(res[8], 'Ивановой Татьяне')
+        # A name that doesn't fit leaves an empty string rather than the words inflected so far
+        name = 'Иванов Иван Иванович'
+        self.assertEqual(run_binary('--buf-size', '16', FULL, MALE, name), ['ERROR'] * 6)
+        self.assertEqual(run_binary('--buf-size', '64', FULL, MALE, name), run_test(FULL, MALE, name))
+
+    def test_unknown_gender(self):
+        res = run_test(MIDDLE, UNKNOWN, 'Алексеевна', 'Петрович')
+        self.assertEqual(res[1], 'Алексеевны')
+        self.assertEqual(res[7], 'Петровича')
+        res = run_test(LAST, UNKNOWN, 'Воронина', 'Воронин')
+        self.assertEqual(res[1], 'Ворониной')
+        self.assertEqual(res[7], 'Воронина')
+        res = run_test(FULL, UNKNOWN, 'Иванова Татьяна Алексеевна')
+        self.assertEqual(res[2], 'Ивановой Татьяне Алексеевне')
+        # The gender of a hyphenated name is inferred before any part is inflected
+        res = run_test(LAST, UNKNOWN, 'Пётр-Лев')
+        self.assertEqual(res[1], 'Пётра-Лева')
+        self.assertEqual(res, run_test(LAST, MALE, 'Пётр-Лев'))
+
+    def test_all_cases_parity(self):
+        # petr_inflect_all_cases matches the parts once, but must give the forms of petr_inflect
+        names = ['Николай', 'Пётр-Лев', 'Пётр-Иван-Сидор-Фёдор-Лев-Олег-Игорь-Павел-Ия', 'Бонч-Бруевич', 'Ия-',
+                 'Воронина', 'ОЛЬГА', 'latin', 'я']
+        for name in names:
+            for kind in (FIRST, MIDDLE, LAST):
+                for gender in (MALE, FEMALE, UNKNOWN):
+                    self.assertEqual(run_all_cases(kind, gender, name), run_test(kind, gender, name))
+
+    def test_u16(self):
+        # petr_inflect_u16 matches UTF-16 names in place, but must give the forms of petr_inflect
+        names = ['Николай', 'Пётр-Лев', 'Пётр-Иван-Сидор-Фёдор-Лев-Олег-Игорь-Павел-Ия', 'Бонч-Бруевич', 'Ия-',
+                 'Воронина', 'ОЛЬГА', 'Ёлкин', 'latin', 'я', '😀ов']
+        for kind in (FIRST, MIDDLE, LAST):
+            for gender in (MALE, FEMALE, UNKNOWN):
+                self.assertEqual(run_binary('--u16', kind, gender, *names), run_test(kind, gender, *names))
+
+    def test_prepared(self):
+        # Names prepared once give the forms of petr_inflect for any kind and gender
+        names = ['Николай', 'Пётр-Лев', 'Пётр-Иван-Сидор-Фёдор-Лев-Олег-Игорь-Павел', 'Бонч-Бруевич', 'Ия-',
+                 'Воронина', 'ОЛЬГА', 'Ёлкин', 'latin', 'я']
+        for kind in (FIRST, MIDDLE, LAST):
+            for gender in (MALE, FEMALE, UNKNOWN):
+                self.assertEqual(run_binary('--prepared', kind, gender, *names), run_test(kind, gender, *names))
+        # Names of more than PETR_PREPARED_MAX_PARTS parts cannot be prepared
+        self.assertEqual(run_binary('--prepared', FIRST, MALE, 'Пётр-Иван-Сидор-Фёдор-Лев-Олег-Игорь-Павел-Ия'),
+                         ['ERROR'] * 6)
+
+    def test_lemmatize(self):
+        cases = ['nominative', 'genitive', 'dative', 'accusative', 'instrumental', 'prepositional']
+        known = [(LAST, UNKNOWN, 'Иванову', 'Иванов\tmale\tdative'),
+                 (LAST, FEMALE, 'Петровой', 'Петрова\tfemale\tgenitive'),
+                 (FIRST, MALE, 'Николаем', 'Николай\tmale\tinstrumental'),
+                 (FIRST, MALE, 'Льва', 'Лев\tmale\taccusative'),
+                 (MIDDLE, UNKNOWN, 'Алексеевны', 'Алексеевна\tfemale\tgenitive'),
+                 (LAST, UNKNOWN, 'Бонч-Бруевича', 'Бонч-Бруевич\tmale\tgenitive')]
+        for kind, gender, name, lemma in known:
+            res = run_binary('--lemmatize', kind, gender, name)
+            self.assertIn(lemma, res)
+            # Every form inflects back into the name, which is also taken as nominative (of the inferred gender)
+            for line in res:
+                form, form_gender, form_case = line.split('\t')
+                if form_case == 'nominative':
+                    self.assertEqual(form, name)
+                elif form_gender in (MALE, FEMALE):
+                    self.assertEqual(run_test(kind, form_gender, form)[cases.index(form_case)], name)
+
+    def test_exact_size(self):
+        # A buffer of petr_inflect_size() + 1 bytes holds the result of petr_inflect
+        names = ['Николай', 'Пётр-Лев', 'Пётр-Иван-Сидор-Фёдор-Лев-Олег-Игорь-Павел-Ия', 'Бонч-Бруевич', 'Ия-',
+                 'Воронина', 'ОЛЬГА', 'latin', 'я', 'Алексеевна']
+        for kind in (FIRST, MIDDLE, LAST):
+            for gender in (MALE, FEMALE, UNKNOWN):
+                self.assertEqual(run_binary('--exact-size', kind, gender, *names), run_test(kind, gender, *names))
+
+    def test_match_rules(self):
+        self.assertEqual(run_binary('--match-rules', LAST, UNKNOWN, 'Иванова', 'Бонч-Бруевич', 'latin'),
+                         ['Иванова\tsuffix\t14\tfemale\tова', 'Бонч\texception\t0\tunknown\tбонч', 'Бруевич\tnone',
+                          'latin\tnone'])
+        self.assertEqual(run_binary('--match-rules', FIRST, MALE, 'Лев-Николай'),
+                         ['Лев\texception\t0\tmale\tлев', 'Николай\tsuffix\t14\tmale\tй'])
+        self.assertEqual(run_binary('--match-rules', MIDDLE, UNKNOWN, 'Петрович'), ['Петрович\tsuffix\t0\tmale\tич'])
+
+    def test_batch_tool(self):
+        res = run_batch('Николай\tfirst\tmale\tgenitive,dative\n'
+                        'bad\n'
+                        'Иванова Татьяна\tfull\tfemale\tinstrumental\n'
+                        'Петрович\tmiddle\n', '--threads', '2')
+        self.assertEqual(res, ['Николая\tНиколаю', '', 'Ивановой Татьяной',
+                               'Петрович\tПетровича\tПетровичу\tПетровича\tПетровичем\tПетровиче'])
+        res = run_batch('{"name": "\\u041b\\u0435\\u0432", "kind": "first", "gender": "male", "cases": ["dative"]}\n'
+                        '{"name": "Лев"}\n', '--format', 'ndjson')
+        self.assertEqual(res, ['{"dative":"Льву"}', '{"error":"missing name kind"}'])
+
+    def test_batch_tool_chunks(self):
+        # A bad record in the first chunk must not drop the output of the later ones
+        record = 'Иванов\tlast\tmale\tgenitive\n'
+        count = (4 << 20) * 2 // len(record.encode('utf-8'))
+        res = run_batch('Пётр\n' + record * count, '--threads', '2')
+        self.assertEqual(len(res), count + 1)
+        self.assertEqual(res[0], '')
+        self.assertEqual(res[-1], 'Иванова')
+
+    def test_rules_error(self):
+        with tempfile.TemporaryDirectory() as tmp_dir:
+            rules_path = os.path.join(tmp_dir, 'rules.yml')
+            with open(rules_path, 'w', encoding='utf-8') as f:
+                f.write('lastname:\n'
+                        '  exceptions:\n'
+                        '    - gender: androgynous\n'
+                        '      test: [фон]\n'
+                        '      mods: [., ., ., ., самец]\n'
+                        '      tags: [первое_слово]\n')
+            res = subprocess.run([COMPILE_BINARY_PATH, rules_path, os.path.join(tmp_dir, 'rules.bin')],
+                                 stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+            # The error is reported by the tool itself, the process doesn't abort
+            self.assertEqual(res.returncode, 1)
+            self.assertEqual(res.stderr.decode('utf-8'),
+                             rules_path + ", line 6, column 14: invalid tag 'первое_слово'\n")
+            if petrovich is not None:
+                with open(rules_path, encoding='utf-8') as f:
+                    rules = f.read()
+                with self.assertRaises(petrovich.Error) as cm:
+                    petrovich.Context.from_string(rules)
+                self.assertEqual(cm.exception.args, ("invalid tag 'первое_слово'", -1, 6, 14))
+
+    def test_compiled_rules(self):
+        # Rules saved by petr_save_compiled and mapped back inflect like the ones they were compiled from
+        names = ['Николай', 'Пётр-Лев', 'Воронина', 'Бонч-Бруевич', 'ОЛЬГА', 'latin']
+        with tempfile.TemporaryDirectory() as tmp_dir:
+            image_path = os.path.join(tmp_dir, 'rules.bin')
+            subprocess.run([COMPILE_BINARY_PATH, RULES_PATH, image_path], check=True)
+            for kind in (FIRST, MIDDLE, LAST, FULL):
+                for gender in (MALE, FEMALE, UNKNOWN):
+                    self.assertEqual(run_binary('--compiled', image_path, kind, gender, *names),
+                                     run_binary('--rules', RULES_PATH, kind, gender, *names))
+                    self.assertEqual(run_binary('--compiled', image_path, kind, gender, *names),
+                                     run_binary(kind, gender, *names))
+
+    def test_handle_swap(self):
+        # Readers see the same forms while the handle switches between freshly loaded contexts
+        names = ['Иванов', 'Петрова', 'Бонч-Бруевич']
+        res = run_binary('--rules', RULES_PATH, '--handle', LAST, UNKNOWN, *names)
+        self.assertEqual(res[:-1], run_test(LAST, UNKNOWN, *names))
+        self.assertEqual(res[-1], 'handle: 32 swaps, 4 readers, 0 mismatches')
+
+    def test_allocator(self):
+        # Loading, batches, the cache and handles allocate through the allocator of the context, and free everything
+        def count(names, *args):
+            res = run_binary('--count-allocations', *args, LAST, MALE, *names)
+            self.assertRegex(res[-1], r'^allocator: \d+ allocations, 0 live, 0 foreign$')
+            return int(res[-1].split()[1])
+        loaded = count(['Иванов'], '--rules', RULES_PATH)
+        self.assertGreater(loaded, 0)
+        self.assertGreater(count(['Иванов', 'Петров'], '--rules', RULES_PATH), loaded)
+        self.assertGreater(count(['Иванов'], '--rules', RULES_PATH, '--cache', '4096'), loaded)
+        self.assertGreater(count(['Иванов'], '--rules', RULES_PATH, '--handle'), loaded * 32)
+        # So does a thread pool created with the same allocator
+        names = ['Иванов', 'Петров', 'Иванов']
+        self.assertEqual(run_binary('--rules', RULES_PATH, '--pool', '2', LAST, MALE, *names),
+                         run_binary('--rules', RULES_PATH, LAST, MALE, *names))
+        self.assertGreater(count(names, '--rules', RULES_PATH, '--pool', '2'), count(names, '--rules', RULES_PATH))
+        with tempfile.TemporaryDirectory() as tmp_dir:
+            image_path = os.path.join(tmp_dir, 'rules.bin')
+            subprocess.run([COMPILE_BINARY_PATH, RULES_PATH, image_path], check=True)
+            self.assertGreater(count(['Иванов'], '--compiled', image_path), 0)
+
+    def test_cache(self):
+        # Repeated names are served from the cache, with the results of the uncached context
+        res = run_binary('--rules', RULES_PATH, '--cache', str(1 << 20), FIRST, MALE, 'Пётр', 'Лев', 'Пётр')
+        self.assertEqual(res[:-1], run_test(FIRST, MALE, 'Пётр', 'Лев', 'Пётр'))
+        self.assertEqual(res[-1], 'cache: 6 hits, 12 misses, 0 evictions')
+        # A single entry is replaced by every new result
+        res = run_binary('--rules', RULES_PATH, '--cache', '128', FIRST, MALE, 'Пётр', 'Пётр')
+        self.assertEqual(res[:6], res[6:12])
+        self.assertEqual(res[-1], 'cache: 0 hits, 12 misses, 11 evictions')
+        # A limit below a single entry is rejected with ERR_INVALID_ARG, the process doesn't abort
+        res = subprocess.run([BINARY_PATH, '--rules', RULES_PATH, '--cache', '64', FIRST, MALE, 'Пётр'],
+                             stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+        self.assertEqual(res.returncode, 1)
+        self.assertEqual(res.stderr.decode('utf-8'), 'Failed to load the rules: -5\n')
+
+    @unittest.skipIf(petrovich is None, 'Python module is not built')
+    def test_module_batch(self):
+        ctx = petrovich.Context()
+        names = ['Иванов', 'Петрова', 'Сидоров']
+        genders = [petrovich.MALE, petrovich.FEMALE, petrovich.UNKNOWN]
+        self.assertEqual(ctx.inflect_batch(names, petrovich.LAST, petrovich.DATIVE, genders),
+                         ['Иванову', 'Петровой', 'Сидорову'])
+        data = ''.join(names).encode('utf-8')
+        offsets = array.array('I', [0])
+        for name in names:
+            offsets.append(offsets[-1] + len(name.encode('utf-8')))
+        res, res_offsets = ctx.inflect_batch(data, petrovich.LAST, petrovich.GENITIVE, genders, offsets=offsets,
+                                             pool=petrovich.Pool(2))
+        self.assertEqual([res[res_offsets[i]:res_offsets[i + 1]].decode('utf-8') for i in range(len(names))],
+                         ['Иванова', 'Петровой', 'Сидорова'])
+        self.assertEqual(ctx.inflect('Пётр', petrovich.FIRST, petrovich.INSTRUMENTAL, petrovich.MALE), 'Петром')
+        # Longer than the stack buffer of the module
+        self.assertEqual(ctx.inflect('Иванов' * 30, petrovich.LAST, petrovich.GENITIVE, petrovich.MALE),
+                         'Иванов' * 29 + 'Иванова')
+        with self.assertRaises(ValueError):
+            ctx.inflect_batch(data, petrovich.LAST, petrovich.GENITIVE, offsets=array.array('I', [0, 100]))
+
+    @unittest.skipIf(petrovich is None, 'Python module is not built')
+    def test_module_parallel_batch(self):
+        # Enough rows for many chunks, with results longer than the names
+        ctx = petrovich.Context()
+        names = ['Иванов', 'Петров-Водкин', '', 'Лев', 'Ия', 'latin', 'Сидоров' * 20] * 3000
+        for threads in (1, 3, 8):
+            self.assertEqual(ctx.inflect_batch(names, petrovich.LAST, petrovich.INSTRUMENTAL, petrovich.MALE,
+                                               pool=petrovich.Pool(threads)),
+                             ctx.inflect_batch(names, petrovich.LAST, petrovich.INSTRUMENTAL, petrovich.MALE))
 
 if __name__ == '__main__':
     unittest.main()
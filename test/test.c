@@ -2,29 +2,433 @@
 ///
 /// @copyright Copyright (c) Mail.Ru Group, 2016. All rights reserved. MIT License.
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
 #include <assert.h>
+#include <stdint.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "petrovich.h"
 
+enum { MAX_NAMES = 64, NUM_CASES = CASE_PREPOSITIONAL + 1 };
+
+/// Counters of the allocator passed to the library by --count-allocations
+typedef struct {
+        unsigned long allocations;
+        unsigned long live;
+        unsigned long foreign;          ///< Blocks freed or reallocated, but not allocated by the allocator
+} alloc_counts_t;
+
+static alloc_counts_t g_counts;
+
+/// Header of the blocks of the counting allocator, followed by the block
+typedef union {
+        uint64_t magic;
+        long double align;              ///< Keeps the blocks aligned for any type
+} alloc_header_t;
+
+#define ALLOC_MAGIC     0x706574726f766963ULL
+
+static void *count_malloc(void *user, size_t size)
+{
+        alloc_counts_t *counts = user;
+        alloc_header_t *header = malloc(sizeof(alloc_header_t) + size);
+        if (header == NULL)
+                return NULL;
+        header->magic = ALLOC_MAGIC;
+        __atomic_fetch_add(&counts->allocations, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&counts->live, 1, __ATOMIC_RELAXED);
+        return header + 1;
+}
+
+static bool check_block(alloc_counts_t *counts, void *ptr)
+{
+        if (((alloc_header_t *)ptr - 1)->magic == ALLOC_MAGIC)
+                return true;
+        __atomic_fetch_add(&counts->foreign, 1, __ATOMIC_RELAXED);
+        return false;
+}
+
+static void *count_realloc(void *user, void *ptr, size_t size)
+{
+        if (ptr == NULL)
+                return count_malloc(user, size);
+        if (!check_block(user, ptr))
+                return NULL;
+        alloc_header_t *header = realloc((alloc_header_t *)ptr - 1, sizeof(alloc_header_t) + size);
+        return header != NULL ? header + 1 : NULL;
+}
+
+static void count_free(void *user, void *ptr)
+{
+        alloc_counts_t *counts = user;
+        if (!check_block(counts, ptr))
+                return;
+        alloc_header_t *header = (alloc_header_t *)ptr - 1;
+        header->magic = 0;
+        free(header);
+        __atomic_fetch_sub(&counts->live, 1, __ATOMIC_RELAXED);
+}
+
+static const petr_allocator_t g_count_allocator = { count_malloc, count_realloc, count_free, &g_counts };
+
+static bool g_count_allocations;
+
+static void print_alloc_counts(void)
+{
+        if (g_count_allocations)
+                printf("allocator: %lu allocations, %lu live, %lu foreign\n", g_counts.allocations, g_counts.live,
+                       g_counts.foreign);
+}
+
+/// Load the rules from a file, with the counting allocator if it is enabled
+static int load_rules(const char *path, bool compiled, petr_context_t **pctx)
+{
+        const petr_allocator_t *allocator = g_count_allocations ? &g_count_allocator : NULL;
+        if (compiled)
+                return petr_init_from_mmap_with_allocator(path, allocator, pctx);
+        return petr_init_from_file_with_allocator(path, allocator, pctx);
+}
+
+/// Names inflected by the readers of a handle, and their forms inflected before any swap
+typedef struct {
+        petr_handle_t *handle;
+        petr_name_kind_t kind;
+        petr_gender_t gender;
+        size_t count;
+        char **names;
+        char forms[MAX_NAMES][NUM_CASES][256];
+        bool stop;
+        unsigned long reads;
+        unsigned long mismatches;
+} handle_test_t;
+
+static void *read_handle(void *arg)
+{
+        handle_test_t *test = arg;
+        char buf[256];
+        while (!__atomic_load_n(&test->stop, __ATOMIC_RELAXED)) {
+                for (size_t i = 0; i < test->count; i++) {
+                        for (int dest_case = CASE_NOMINATIVE; dest_case <= CASE_PREPOSITIONAL; dest_case++) {
+                                size_t res_size;
+                                int rc = petr_handle_inflect(test->handle, test->names[i], strlen(test->names[i]),
+                                                             test->kind, test->gender, dest_case, buf, sizeof(buf),
+                                                             &res_size);
+                                if (rc != 0 || strcmp(buf, test->forms[i][dest_case]) != 0)
+                                        __atomic_fetch_add(&test->mismatches, 1, __ATOMIC_RELAXED);
+                                __atomic_fetch_add(&test->reads, 1, __ATOMIC_RELAXED);
+                        }
+                }
+        }
+        return NULL;
+}
+
+/// Inflect names on several threads through a handle while its context is replaced by freshly loaded ones
+static int test_handle(const char *rules_path, bool compiled, petr_name_kind_t kind, petr_gender_t gender,
+                       size_t count, char **names)
+{
+        enum { NUM_READERS = 4, NUM_SWAPS = 32 };
+        static handle_test_t test;
+        test.kind = kind;
+        test.gender = gender;
+        test.count = count;
+        test.names = names;
+
+        // The handle frees its contexts, so it must not take the static one
+        petr_context_t *default_ctx = (petr_context_t *)petr_default_context();
+        if (petr_handle_create(default_ctx, &test.handle) != ERR_INVALID_ARG)
+                return 1;
+        petr_context_t *ctx;
+        int rc = load_rules(rules_path, compiled, &ctx);
+        if (rc != 0)
+                return rc;
+        rc = petr_handle_create(ctx, &test.handle);
+        if (rc != 0) {
+                petr_free_context(ctx);
+                return rc;
+        }
+        if (petr_handle_swap(test.handle, default_ctx) != ERR_INVALID_ARG) {
+                petr_handle_free(test.handle);
+                return 1;
+        }
+        for (size_t i = 0; i < count; i++) {
+                for (int dest_case = CASE_NOMINATIVE; dest_case <= CASE_PREPOSITIONAL; dest_case++) {
+                        size_t res_size;
+                        rc = petr_handle_inflect(test.handle, names[i], strlen(names[i]), kind, gender, dest_case,
+                                                 test.forms[i][dest_case], sizeof(test.forms[i][dest_case]),
+                                                 &res_size);
+                        printf("%s\n", rc == 0 ? test.forms[i][dest_case] : "ERROR");
+                }
+        }
+
+        pthread_t readers[NUM_READERS];
+        int num_readers = 0;
+        while (num_readers < NUM_READERS && pthread_create(&readers[num_readers], NULL, read_handle, &test) == 0)
+                num_readers++;
+        int swaps = 0;
+        for (; swaps < NUM_SWAPS; swaps++) {
+                rc = load_rules(rules_path, compiled, &ctx);
+                if (rc != 0)
+                        break;
+                rc = petr_handle_swap(test.handle, ctx);
+                if (rc != 0) {
+                        petr_free_context(ctx);
+                        break;
+                }
+        }
+        __atomic_store_n(&test.stop, true, __ATOMIC_RELAXED);
+        for (int i = 0; i < num_readers; i++)
+                pthread_join(readers[i], NULL);
+        petr_handle_free(test.handle);
+        printf("handle: %d swaps, %d readers, %lu mismatches\n", swaps, num_readers, test.mismatches);
+        return rc;
+}
+
+/// Inflect a name into a buffer of exactly the size reported by \c petr_inflect_size
+static int inflect_exact_size(const petr_context_t *ctx, const char *name, petr_name_kind_t kind,
+                              petr_gender_t gender, petr_case_t dest_case, char *dest, size_t dest_buf_size,
+                              size_t *dest_len)
+{
+        size_t size;
+        int rc = petr_inflect_size(ctx, name, strlen(name), kind, gender, dest_case, &size);
+        if (rc != 0)
+                return rc;
+        char *buf = malloc(size + 1);
+        if (buf == NULL)
+                return ERR_NOMEM;
+        rc = petr_inflect(ctx, name, strlen(name), kind, gender, dest_case, buf, size + 1, dest_len);
+        if (rc == 0 && (*dest_len != size || size >= dest_buf_size))
+                rc = ERR_BUF;
+        if (rc == 0)
+                memcpy(dest, buf, size + 1);
+        free(buf);
+        return rc;
+}
+
+/// Print the nominative forms of a name of the given kind, one per line, skipping the ones of another gender
+static int print_lemmas(const petr_context_t *ctx, const char *name, petr_name_kind_t kind, petr_gender_t gender)
+{
+        static const char *const cases[] = {
+                "nominative", "genitive", "dative", "accusative", "instrumental", "prepositional"
+        };
+        static const char *const genders[] = { "male", "female", "androgynous", "unknown" };
+        char buf[4096];
+        petr_lemma_t lemmas[64];
+        size_t num_lemmas;
+        int rc = petr_lemmatize(ctx, name, strlen(name), buf, sizeof(buf), lemmas, 64, &num_lemmas);
+        if (rc != 0)
+                return rc;
+        for (size_t i = 0; i < num_lemmas; i++) {
+                const petr_lemma_t *lemma = &lemmas[i];
+                bool any_gender = lemma->gender == GEND_ANDROGYNOUS || lemma->gender == GEND_UNKNOWN;
+                if (lemma->kind != kind || (gender != GEND_UNKNOWN && lemma->gender != gender && !any_gender))
+                        continue;
+                printf("%.*s\t%s\t%s\n", (int)lemma->len, buf + lemma->off, genders[lemma->gender],
+                       cases[lemma->name_case]);
+        }
+        return 0;
+}
+
+/// Convert a valid UTF-8 string to UTF-16
+///
+/// @returns             Number of code units, or \c SIZE_MAX if \c dest is too small
+static size_t utf8_to_u16(const char *src, uint16_t *dest, size_t dest_size)
+{
+        const unsigned char *s = (const unsigned char *)src;
+        size_t len = 0;
+        while (*s != 0) {
+                uint32_t cp = *s++;
+                int extra = cp >= 0xF0 ? 3 : cp >= 0xE0 ? 2 : cp >= 0xC0 ? 1 : 0;
+                cp &= 0x7F >> extra;
+                for (; extra > 0 && (*s & 0xC0) == 0x80; extra--)
+                        cp = (cp << 6) | (*s++ & 0x3F);
+                if (len + 2 > dest_size)
+                        return SIZE_MAX;
+                if (cp >= 0x10000) {
+                        dest[len++] = 0xD800 | ((cp - 0x10000) >> 10);
+                        dest[len++] = 0xDC00 | (cp & 0x3FF);
+                } else {
+                        dest[len++] = cp;
+                }
+        }
+        return len;
+}
+
+/// Convert UTF-16 to UTF-8, the destination must have room for three bytes per code unit and NUL
+static void u16_to_utf8(const uint16_t *src, size_t len, char *dest)
+{
+        unsigned char *d = (unsigned char *)dest;
+        for (size_t i = 0; i < len; i++) {
+                uint32_t cp = src[i];
+                if (cp >= 0xD800 && cp < 0xDC00 && i + 1 < len)
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (src[++i] - 0xDC00);
+                if (cp < 0x80) {
+                        *d++ = cp;
+                } else if (cp < 0x800) {
+                        *d++ = 0xC0 | (cp >> 6);
+                        *d++ = 0x80 | (cp & 0x3F);
+                } else if (cp < 0x10000) {
+                        *d++ = 0xE0 | (cp >> 12);
+                        *d++ = 0x80 | ((cp >> 6) & 0x3F);
+                        *d++ = 0x80 | (cp & 0x3F);
+                } else {
+                        *d++ = 0xF0 | (cp >> 18);
+                        *d++ = 0x80 | ((cp >> 12) & 0x3F);
+                        *d++ = 0x80 | ((cp >> 6) & 0x3F);
+                        *d++ = 0x80 | (cp & 0x3F);
+                }
+        }
+        *d = 0;
+}
+
+/// Inflect a name converted to UTF-16 with \c petr_inflect_u16, the result is converted back
+static int inflect_u16(const petr_context_t *ctx, const char *name, petr_name_kind_t kind, petr_gender_t gender,
+                       petr_case_t dest_case, char *dest, size_t dest_buf_size, size_t *dest_len)
+{
+        uint16_t src[256];
+        uint16_t res[256];
+        size_t len = utf8_to_u16(name, src, 256);
+        if (len == SIZE_MAX)
+                return ERR_BUF;
+        size_t res_len;
+        int rc = petr_inflect_u16(ctx, src, len, kind, gender, dest_case, res, 256, &res_len);
+        if (rc != 0)
+                return rc;
+        if (res_len * 3 >= dest_buf_size)
+                return ERR_BUF;
+        u16_to_utf8(res, res_len, dest);
+        *dest_len = strlen(dest);
+        return 0;
+}
+
+/// Print the rule matched for every part of a name, one line per part
+static int print_matches(const petr_context_t *ctx, const char *name, petr_name_kind_t kind, petr_gender_t gender)
+{
+        static const char *const match_kinds[] = { "none", "exception", "suffix" };
+        static const char *const genders[] = { "male", "female", "androgynous", "unknown" };
+        petr_rule_match_t matches[16];
+        size_t num_matches;
+        int rc = petr_match_rules(ctx, name, strlen(name), kind, gender, matches, 16, &num_matches);
+        if (rc != 0)
+                return rc;
+        for (size_t i = 0; i < num_matches; i++) {
+                const petr_rule_match_t *match = &matches[i];
+                printf("%.*s\t%s", (int)match->part_len, name + match->part_off, match_kinds[match->kind]);
+                if (match->kind != MATCH_NONE)
+                        printf("\t%u\t%s\t%.*s", match->rule, genders[match->gender], (int)match->test_len,
+                               match->test);
+                printf("\n");
+        }
+        return 0;
+}
+
 static void print_usage(void)
 {
-        fprintf(stderr, "Usage: petr_test <type> <gender> name\n"
-                        "    type: first | middle | last\n"
-                        "    gender: male | female\n");
+        fprintf(stderr, "Usage: petr_test [options] <type> <gender> name...\n"
+                        "    type: first | middle | last | full\n"
+                        "    gender: male | female | unknown\n"
+                        "Options:\n"
+                        "    --all-cases: inflect a single name with petr_inflect_all_cases\n"
+                        "    --rules <file>: load the rules from a file instead of the default ones\n"
+                        "    --compiled <file>: load the rules compiled by petr_compile_rules with petr_init_from_mmap\n"
+                        "    --cache <bytes>: inflect names one by one through a cache and print its counters\n"
+                        "    --handle: inflect names on several threads through a handle while its rules are reloaded\n"
+                        "    --count-allocations: load the rules with a counting allocator and print its counters\n"
+                        "    --exact-size: inflect names one by one into buffers sized by petr_inflect_size\n"
+                        "    --match-rules: print the rules matched for every part of the names\n"
+                        "    --u16: inflect names one by one in UTF-16 with petr_inflect_u16\n"
+                        "    --prepared: prepare every name once and inflect it with petr_inflect_prepared\n"
+                        "    --lemmatize: print the nominative forms of the names recovered by petr_lemmatize\n"
+                        "    --pool <threads>: inflect a batch with petr_inflect_batch_parallel on a thread pool\n"
+                        "    --buf-size <bytes>: inflect full names into a buffer of the given size (at most 1024)\n");
 }
 
 int main(int argc, char **argv)
 {
-        if (argc != 4) {
+        bool all_cases = false;
+        const char *rules_path = NULL;
+        bool compiled = false;
+        size_t cache_size = 0;
+        bool handle = false;
+        bool exact_size = false;
+        bool match_rules = false;
+        bool u16 = false;
+        bool prepared = false;
+        bool lemmatize = false;
+        unsigned pool_threads = 0;
+        size_t buf_size = 1024;
+        petr_context_t *file_ctx = NULL;
+        int arg = 1;
+        for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+                if (strcmp(argv[arg], "--all-cases") == 0) {
+                        all_cases = true;
+                } else if ((strcmp(argv[arg], "--rules") == 0 || strcmp(argv[arg], "--compiled") == 0)
+                           && arg + 1 < argc) {
+                        compiled = strcmp(argv[arg], "--compiled") == 0;
+                        rules_path = argv[++arg];
+                } else if (strcmp(argv[arg], "--count-allocations") == 0) {
+                        g_count_allocations = true;
+                } else if (strcmp(argv[arg], "--exact-size") == 0) {
+                        exact_size = true;
+                } else if (strcmp(argv[arg], "--match-rules") == 0) {
+                        match_rules = true;
+                } else if (strcmp(argv[arg], "--u16") == 0) {
+                        u16 = true;
+                } else if (strcmp(argv[arg], "--prepared") == 0) {
+                        prepared = true;
+                } else if (strcmp(argv[arg], "--lemmatize") == 0) {
+                        lemmatize = true;
+                } else if (strcmp(argv[arg], "--handle") == 0) {
+                        handle = true;
+                } else if (strcmp(argv[arg], "--cache") == 0 && arg + 1 < argc) {
+                        cache_size = strtoul(argv[++arg], NULL, 10);
+                } else if (strcmp(argv[arg], "--buf-size") == 0 && arg + 1 < argc) {
+                        buf_size = strtoul(argv[++arg], NULL, 10);
+                        if (buf_size > 1024) {
+                                fprintf(stderr, "Invalid buffer size\n");
+                                goto err;
+                        }
+                } else if (strcmp(argv[arg], "--pool") == 0 && arg + 1 < argc) {
+                        pool_threads = strtoul(argv[++arg], NULL, 10);
+                        if (pool_threads == 0) {
+                                fprintf(stderr, "Invalid number of threads\n");
+                                goto err;
+                        }
+                } else {
+                        fprintf(stderr, "Invalid option %s\n", argv[arg]);
+                        goto err;
+                }
+        }
+        argc -= arg - 1;
+        argv += arg - 1;
+        if (argc < 4 || (all_cases && argc != 4)) {
                 fprintf(stderr, "Invalid number of arguments\n");
                 goto err;
         }
+        if ((cache_size != 0 || handle || g_count_allocations) && rules_path == NULL) {
+                fprintf(stderr, "The default context cannot have a cache, a handle or an allocator\n");
+                goto err;
+        }
+        if (handle && (all_cases || cache_size != 0 || argc - 3 > MAX_NAMES)) {
+                fprintf(stderr, "Invalid arguments of --handle\n");
+                goto err;
+        }
+        if (pool_threads != 0
+            && (argc == 4 || all_cases || handle || cache_size != 0 || exact_size || u16 || prepared)) {
+                fprintf(stderr, "Invalid arguments of --pool\n");
+                goto err;
+        }
 
         const char *kind_str = argv[1];
-        petr_name_kind_t kind;
-        if (strcmp(kind_str, "first") == 0) {
+        petr_name_kind_t kind = NAME_FIRST;
+        bool full_name = false;
+        if (strcmp(kind_str, "full") == 0) {
+                full_name = true;
+        } else if (strcmp(kind_str, "first") == 0) {
                 kind = NAME_FIRST;
         } else if (strcmp(kind_str, "middle") == 0) {
                 kind = NAME_MIDDLE;
@@ -41,32 +445,179 @@ int main(int argc, char **argv)
                 gender = GEND_MALE;
         } else if (strcmp(gender_str, "female") == 0) {
                 gender = GEND_FEMALE;
+        } else if (strcmp(gender_str, "unknown") == 0) {
+                gender = GEND_UNKNOWN;
         } else {
                 fprintf(stderr, "Invalid gender\n");
                 goto err;
         }
 
-        const char *name_str = argv[3];
-        size_t name_len = strlen(name_str);
+        if (handle) {
+                if (full_name) {
+                        fprintf(stderr, "Full names cannot be inflected through a handle\n");
+                        goto err;
+                }
+                int rc = test_handle(rules_path, compiled, kind, gender, argc - 3, argv + 3);
+                if (rc != 0)
+                        fprintf(stderr, "Handle test failed: %d\n", rc);
+                print_alloc_counts();
+                return rc != 0;
+        }
 
-        petr_context_t *ctx;
-        int rc = petr_init_from_file("rules.yml", &ctx);
-        if (rc != 0) {
-                fprintf(stderr, "Failed to read the rules");
+        const petr_context_t *ctx = petr_default_context();
+        if (rules_path != NULL) {
+                int rc = load_rules(rules_path, compiled, &file_ctx);
+                if (rc == 0 && cache_size != 0)
+                        rc = petr_enable_cache(file_ctx, cache_size);
+                if (rc != 0) {
+                        fprintf(stderr, "Failed to load the rules: %d\n", rc);
+                        if (file_ctx != NULL)
+                                petr_free_context(file_ctx);
+                        return 1;
+                }
+                ctx = file_ctx;
+        } else if (ctx == NULL) {
+                fprintf(stderr, "Library is built without the default rules\n");
                 return 1;
         }
-        char buf[1024];
-        for (int dest_case = CASE_NOMINATIVE; dest_case <= CASE_PREPOSITIONAL; dest_case++) {
-                size_t res_size;
-                int rc = petr_inflect(ctx, name_str, name_len, kind, gender, dest_case, buf, sizeof(buf), &res_size);
-                if (rc == 0)
-                        printf("%.*s\n", (int)res_size, buf);
-                else
-                        printf("ERROR\n");
+        if (full_name) {
+                char buf[1024];
+                for (int i = 3; i < argc; i++) {
+                        for (int dest_case = CASE_NOMINATIVE; dest_case <= CASE_PREPOSITIONAL; dest_case++) {
+                                size_t res_size;
+                                buf[0] = 'X';
+                                int rc = petr_inflect_full_name(ctx, argv[i], strlen(argv[i]), ORDER_LAST_FIRST_MIDDLE,
+                                                                gender, dest_case, buf, buf_size, &res_size);
+                                if (rc == 0)
+                                        printf("%.*s\n", (int)res_size, buf);
+                                else if (res_size != 0 || (buf_size != 0 && buf[0] != '\0'))
+                                        printf("ERROR (partial result)\n");
+                                else
+                                        printf("ERROR\n");
+                        }
+                }
+                goto out;
+        }
+        if (match_rules || lemmatize) {
+                for (int i = 3; i < argc; i++) {
+                        int rc = match_rules ? print_matches(ctx, argv[i], kind, gender)
+                                             : print_lemmas(ctx, argv[i], kind, gender);
+                        if (rc != 0)
+                                printf("ERROR\n");
+                }
+                goto out;
+        }
+        if (all_cases) {
+                const char *name_str = argv[3];
+                size_t name_len = strlen(name_str);
+                char buf[1024];
+                size_t offsets[CASE_PREPOSITIONAL + 2];
+                int rc = petr_inflect_all_cases(ctx, name_str, name_len, kind, gender, buf, sizeof(buf), offsets);
+                for (int dest_case = CASE_NOMINATIVE; dest_case <= CASE_PREPOSITIONAL; dest_case++) {
+                        if (rc == 0)
+                                printf("%.*s\n", (int)(offsets[dest_case + 1] - offsets[dest_case]),
+                                       buf + offsets[dest_case]);
+                        else
+                                printf("ERROR\n");
+                }
+                goto out;
+        }
+        if (argc == 4 || cache_size != 0 || exact_size || u16 || prepared) {
+                char buf[1024];
+                for (int i = 3; i < argc; i++) {
+                        petr_prepared_name_t name;
+                        int prepare_rc = prepared ? petr_prepare_name(argv[i], strlen(argv[i]), &name) : 0;
+                        for (int dest_case = CASE_NOMINATIVE; dest_case <= CASE_PREPOSITIONAL; dest_case++) {
+                                size_t res_size;
+                                int rc;
+                                if (prepare_rc != 0)
+                                        rc = prepare_rc;
+                                else if (prepared)
+                                        rc = petr_inflect_prepared(ctx, &name, kind, gender, dest_case, buf,
+                                                                   sizeof(buf), &res_size);
+                                else if (exact_size)
+                                        rc = inflect_exact_size(ctx, argv[i], kind, gender, dest_case, buf,
+                                                                sizeof(buf), &res_size);
+                                else if (u16)
+                                        rc = inflect_u16(ctx, argv[i], kind, gender, dest_case, buf, sizeof(buf),
+                                                         &res_size);
+                                else
+                                        rc = petr_inflect(ctx, argv[i], strlen(argv[i]), kind, gender, dest_case,
+                                                          buf, sizeof(buf), &res_size);
+                                if (rc == 0)
+                                        printf("%.*s\n", (int)res_size, buf);
+                                else
+                                        printf("ERROR\n");
+                        }
+                }
+                goto out;
+        }
+
+        // Several names are inflected as a batch, results are printed name by name
+        size_t count = argc - 3;
+        if (count > MAX_NAMES) {
+                fprintf(stderr, "Too many names\n");
+                goto err;
+        }
+        char names[4096];
+        size_t name_offsets[MAX_NAMES + 1] = { 0 };
+        petr_gender_t genders[MAX_NAMES];
+        for (size_t i = 0; i < count; i++) {
+                size_t name_len = strlen(argv[i + 3]);
+                if (name_offsets[i] + name_len > sizeof(names)) {
+                        fprintf(stderr, "Names are too long\n");
+                        goto err;
+                }
+                memcpy(names + name_offsets[i], argv[i + 3], name_len);
+                name_offsets[i + 1] = name_offsets[i] + name_len;
+                genders[i] = gender;
+        }
+        static char bufs[CASE_PREPOSITIONAL + 1][16384];
+        size_t dest_offsets[CASE_PREPOSITIONAL + 1][MAX_NAMES + 1];
+        int statuses[CASE_PREPOSITIONAL + 1][MAX_NAMES];
+        if (pool_threads != 0) {
+                // The pool allocates through the allocator of the context
+                petr_pool_t *pool;
+                if (petr_pool_create_with_allocator(g_count_allocations ? &g_count_allocator : NULL, pool_threads,
+                                                    &pool) != 0) {
+                        fprintf(stderr, "Failed to create the thread pool\n");
+                        if (file_ctx != NULL)
+                                petr_free_context(file_ctx);
+                        return 1;
+                }
+                for (int dest_case = CASE_NOMINATIVE; dest_case <= CASE_PREPOSITIONAL; dest_case++)
+                        petr_inflect_batch_parallel(pool, ctx, count, names, name_offsets, kind, genders, dest_case,
+                                                    bufs[dest_case], sizeof(bufs[dest_case]), dest_offsets[dest_case],
+                                                    statuses[dest_case]);
+                petr_pool_free(pool);
+        } else {
+                for (int dest_case = CASE_NOMINATIVE; dest_case <= CASE_PREPOSITIONAL; dest_case++)
+                        petr_inflect_batch(ctx, count, names, name_offsets, kind, genders, dest_case, bufs[dest_case],
+                                           sizeof(bufs[dest_case]), dest_offsets[dest_case], statuses[dest_case]);
+        }
+        for (size_t i = 0; i < count; i++) {
+                for (int dest_case = CASE_NOMINATIVE; dest_case <= CASE_PREPOSITIONAL; dest_case++) {
+                        const size_t *offsets = dest_offsets[dest_case];
+                        if (statuses[dest_case][i] == 0)
+                                printf("%.*s\n", (int)(offsets[i + 1] - offsets[i]), bufs[dest_case] + offsets[i]);
+                        else
+                                printf("ERROR\n");
+                }
+        }
+out:
+        if (cache_size != 0) {
+                petr_cache_stats_t stats;
+                petr_get_cache_stats(ctx, &stats);
+                printf("cache: %llu hits, %llu misses, %llu evictions\n", (unsigned long long)stats.hits,
+                       (unsigned long long)stats.misses, (unsigned long long)stats.evictions);
         }
-        petr_free_context(ctx);
+        if (file_ctx != NULL)
+                petr_free_context(file_ctx);
+        print_alloc_counts();
         return 0;
 err:
         print_usage();
+        if (file_ctx != NULL)
+                petr_free_context(file_ctx);
         return 1;
 }
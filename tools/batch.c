@@ -0,0 +1,740 @@
+/// @file batch.c
+///
+/// @copyright Copyright (c) Mail.Ru Group, 2016. All rights reserved. MIT License.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "petrovich.h"
+
+// The main thread reads the input in chunks that end at a line boundary and hands them to the workers through a ring
+// of jobs. Workers inflect every record of a chunk into the output buffer of its job; the main thread writes the
+// buffers out in the order of the chunks, so the output lines match the input lines one to one.
+
+#define ARRAY_SIZE(a)           (sizeof(a) / sizeof((a)[0]))
+#define CASE_COUNT              (CASE_PREPOSITIONAL + 1)
+#define CHUNK_SIZE              (4 << 20)
+#define MAX_THREADS             256
+#define MAX_CASES               16
+#define KIND_FULL               (NAME_LAST + 1)
+#define NAME_BUF_SIZE           4096
+
+typedef enum {
+        FORMAT_TSV,
+        FORMAT_NDJSON,
+} format_t;
+
+static const char *g_case_names[CASE_COUNT] = {
+        "nominative", "genitive", "dative", "accusative", "instrumental", "prepositional",
+};
+
+/// Growable byte buffer
+typedef struct {
+        char *data;
+        size_t len;
+        size_t size;
+} text_t;
+
+/// Record which could not be inflected
+typedef struct {
+        size_t line;                    ///< Line number within the chunk, starting from 0
+        const char *msg;
+} record_error_t;
+
+/// Chunk of the input and its output
+typedef struct {
+        text_t in;
+        text_t out;
+        record_error_t *errors;
+        size_t num_errors;
+        size_t errors_size;
+        size_t num_lines;
+        bool done;                      ///< Output is ready to be written
+} job_t;
+
+/// Parsed input record
+typedef struct {
+        const char *name;
+        size_t name_len;
+        int kind;                       ///< \c petr_name_kind_t or \c KIND_FULL
+        petr_gender_t gender;
+        petr_case_t cases[MAX_CASES];
+        size_t num_cases;
+} record_t;
+
+static const petr_context_t *g_ctx;
+static format_t g_format = FORMAT_TSV;
+static job_t *g_jobs;
+static size_t g_num_jobs;
+static size_t g_read_seq;               ///< Number of jobs filled with input
+static size_t g_take_seq;               ///< Number of jobs taken by workers
+static size_t g_write_seq;              ///< Number of jobs written out
+static bool g_stop;
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t g_main_cond = PTHREAD_COND_INITIALIZER;
+
+static void text_reserve(text_t *text, size_t extra)
+{
+        if (text->len + extra <= text->size)
+                return;
+        size_t size = text->size ? text->size : 4096;
+        while (size < text->len + extra)
+                size *= 2;
+        char *data = realloc(text->data, size);
+        if (data == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+        }
+        text->data = data;
+        text->size = size;
+}
+
+static void text_append(text_t *text, const char *data, size_t len)
+{
+        if (len == 0)
+                return;
+        text_reserve(text, len);
+        memcpy(text->data + text->len, data, len);
+        text->len += len;
+}
+
+static void text_append_char(text_t *text, char c)
+{
+        text_reserve(text, 1);
+        text->data[text->len++] = c;
+}
+
+static void add_error(job_t *job, size_t line, const char *msg)
+{
+        if (job->num_errors == job->errors_size) {
+                size_t size = job->errors_size ? job->errors_size * 2 : 16;
+                record_error_t *errors = realloc(job->errors, size * sizeof(record_error_t));
+                if (errors == NULL) {
+                        fprintf(stderr, "Out of memory\n");
+                        exit(1);
+                }
+                job->errors = errors;
+                job->errors_size = size;
+        }
+        job->errors[job->num_errors].line = line;
+        job->errors[job->num_errors].msg = msg;
+        job->num_errors++;
+}
+
+static bool token_eq(const char *data, size_t len, const char *str)
+{
+        return strlen(str) == len && memcmp(data, str, len) == 0;
+}
+
+static bool parse_kind(const char *data, size_t len, int *kind)
+{
+        if (token_eq(data, len, "first"))
+                *kind = NAME_FIRST;
+        else if (token_eq(data, len, "middle"))
+                *kind = NAME_MIDDLE;
+        else if (token_eq(data, len, "last"))
+                *kind = NAME_LAST;
+        else if (token_eq(data, len, "full"))
+                *kind = KIND_FULL;
+        else
+                return false;
+        return true;
+}
+
+static bool parse_gender(const char *data, size_t len, petr_gender_t *gender)
+{
+        if (token_eq(data, len, "male"))
+                *gender = GEND_MALE;
+        else if (token_eq(data, len, "female"))
+                *gender = GEND_FEMALE;
+        else if (token_eq(data, len, "androgynous"))
+                *gender = GEND_ANDROGYNOUS;
+        else if (len == 0 || token_eq(data, len, "unknown"))
+                *gender = GEND_UNKNOWN;
+        else
+                return false;
+        return true;
+}
+
+/// Parse a comma-separated list of cases and append them to the record. Empty list or "all" means all cases.
+static bool parse_cases(const char *data, size_t len, record_t *rec)
+{
+        if (len == 0 || token_eq(data, len, "all")) {
+                for (int i = 0; i < CASE_COUNT && rec->num_cases < MAX_CASES; i++)
+                        rec->cases[rec->num_cases++] = i;
+                return true;
+        }
+        const char *end = data + len;
+        while (data < end) {
+                const char *comma = memchr(data, ',', end - data);
+                size_t token_len = (comma ? comma : end) - data;
+                int i = 0;
+                while (i < CASE_COUNT && !token_eq(data, token_len, g_case_names[i]))
+                        i++;
+                if (i == CASE_COUNT || rec->num_cases == MAX_CASES)
+                        return false;
+                rec->cases[rec->num_cases++] = i;
+                data += token_len + (comma ? 1 : 0);
+        }
+        return true;
+}
+
+/// Parse a line of tab-separated name, kind, gender and cases
+static const char *parse_tsv(const char *line, size_t len, record_t *rec)
+{
+        const char *fields[4] = { NULL };
+        size_t lens[4] = { 0 };
+        const char *end = line + len;
+        size_t num_fields = 0;
+        while (num_fields < ARRAY_SIZE(fields)) {
+                const char *tab = memchr(line, '\t', end - line);
+                fields[num_fields] = line;
+                lens[num_fields] = (tab ? tab : end) - line;
+                num_fields++;
+                if (tab == NULL)
+                        break;
+                line = tab + 1;
+        }
+        if (num_fields < 2)
+                return "missing name kind";
+        rec->name = fields[0];
+        rec->name_len = lens[0];
+        if (!parse_kind(fields[1], lens[1], &rec->kind))
+                return "invalid name kind";
+        if (!parse_gender(fields[2], lens[2], &rec->gender))
+                return "invalid gender";
+        if (!parse_cases(fields[3], lens[3], rec))
+                return "invalid cases";
+        return NULL;
+}
+
+static const char *skip_ws(const char *p, const char *end)
+{
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+                p++;
+        return p;
+}
+
+static bool parse_hex4(const char *p, const char *end, uint32_t *value)
+{
+        if (end - p < 4)
+                return false;
+        *value = 0;
+        for (int i = 0; i < 4; i++) {
+                char c = p[i];
+                int digit = c >= '0' && c <= '9' ? c - '0'
+                          : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                          : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+                if (digit < 0)
+                        return false;
+                *value = *value * 16 + digit;
+        }
+        return true;
+}
+
+/// Parse a JSON string starting at the opening quote
+///
+/// Strings without escapes point into the line, others are decoded into \c buf.
+static bool parse_json_string(const char **pp, const char *end, char *buf, size_t *buf_used, const char **str,
+                              size_t *len)
+{
+        const char *p = *pp + 1;
+        const char *start = p;
+        while (p < end && *p != '"' && *p != '\\')
+                p++;
+        if (p < end && *p == '"') {
+                *str = start;
+                *len = p - start;
+                *pp = p + 1;
+                return true;
+        }
+
+        char *dest = buf + *buf_used;
+        char *dest_end = buf + NAME_BUF_SIZE;
+        if ((size_t)(p - start) > (size_t)(dest_end - dest))
+                return false;
+        memcpy(dest, start, p - start);
+        char *out = dest + (p - start);
+        while (p < end && *p != '"') {
+                char c = *p++;
+                if (c == '\\') {
+                        if (p == end)
+                                return false;
+                        c = *p++;
+                        uint32_t cp;
+                        switch (c) {
+                        case '"': case '\\': case '/': cp = c; break;
+                        case 'b': cp = '\b'; break;
+                        case 'f': cp = '\f'; break;
+                        case 'n': cp = '\n'; break;
+                        case 'r': cp = '\r'; break;
+                        case 't': cp = '\t'; break;
+                        case 'u':
+                                if (!parse_hex4(p, end, &cp))
+                                        return false;
+                                p += 4;
+                                uint32_t low;
+                                if (cp >= 0xD800 && cp < 0xDC00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u'
+                                    && parse_hex4(p + 2, end, &low) && low >= 0xDC00 && low < 0xE000) {
+                                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                                        p += 6;
+                                }
+                                break;
+                        default:
+                                return false;
+                        }
+                        if (dest_end - out < 4)
+                                return false;
+                        if (cp < 0x80) {
+                                *out++ = cp;
+                        } else if (cp < 0x800) {
+                                *out++ = 0xC0 | (cp >> 6);
+                                *out++ = 0x80 | (cp & 0x3F);
+                        } else if (cp < 0x10000) {
+                                *out++ = 0xE0 | (cp >> 12);
+                                *out++ = 0x80 | ((cp >> 6) & 0x3F);
+                                *out++ = 0x80 | (cp & 0x3F);
+                        } else {
+                                *out++ = 0xF0 | (cp >> 18);
+                                *out++ = 0x80 | ((cp >> 12) & 0x3F);
+                                *out++ = 0x80 | ((cp >> 6) & 0x3F);
+                                *out++ = 0x80 | (cp & 0x3F);
+                        }
+                } else {
+                        if (out == dest_end)
+                                return false;
+                        *out++ = c;
+                }
+        }
+        if (p == end)
+                return false;
+        *str = dest;
+        *len = out - dest;
+        *buf_used += out - dest;
+        *pp = p + 1;
+        return true;
+}
+
+/// Parse a line with a flat JSON object: {"name": ..., "kind": ..., "gender": ..., "cases": ...}
+///
+/// "cases" is either a comma-separated string or an array of strings.
+static const char *parse_ndjson(const char *line, size_t len, char *buf, record_t *rec)
+{
+        const char *p = line;
+        const char *end = line + len;
+        size_t buf_used = 0;
+        bool has_name = false, has_kind = false, has_cases = false;
+        rec->gender = GEND_UNKNOWN;
+
+        p = skip_ws(p, end);
+        if (p == end || *p != '{')
+                return "invalid JSON";
+        p = skip_ws(p + 1, end);
+        while (p < end && *p != '}') {
+                const char *key, *value;
+                size_t key_len, value_len;
+                if (*p != '"' || !parse_json_string(&p, end, buf, &buf_used, &key, &key_len))
+                        return "invalid JSON";
+                p = skip_ws(p, end);
+                if (p == end || *p != ':')
+                        return "invalid JSON";
+                p = skip_ws(p + 1, end);
+                if (p < end && *p == '[' && token_eq(key, key_len, "cases")) {
+                        p = skip_ws(p + 1, end);
+                        while (p < end && *p != ']') {
+                                if (*p != '"' || !parse_json_string(&p, end, buf, &buf_used, &value, &value_len))
+                                        return "invalid JSON";
+                                if (value_len == 0 || !parse_cases(value, value_len, rec))
+                                        return "invalid cases";
+                                p = skip_ws(p, end);
+                                if (p < end && *p == ',')
+                                        p = skip_ws(p + 1, end);
+                        }
+                        if (p == end)
+                                return "invalid JSON";
+                        p++;
+                        has_cases = true;
+                } else {
+                        if (p == end || *p != '"' || !parse_json_string(&p, end, buf, &buf_used, &value, &value_len))
+                                return "invalid JSON";
+                        if (token_eq(key, key_len, "name")) {
+                                rec->name = value;
+                                rec->name_len = value_len;
+                                has_name = true;
+                        } else if (token_eq(key, key_len, "kind")) {
+                                if (!parse_kind(value, value_len, &rec->kind))
+                                        return "invalid name kind";
+                                has_kind = true;
+                        } else if (token_eq(key, key_len, "gender")) {
+                                if (!parse_gender(value, value_len, &rec->gender))
+                                        return "invalid gender";
+                        } else if (token_eq(key, key_len, "cases")) {
+                                if (!parse_cases(value, value_len, rec))
+                                        return "invalid cases";
+                                has_cases = true;
+                        }
+                }
+                p = skip_ws(p, end);
+                if (p < end && *p == ',')
+                        p = skip_ws(p + 1, end);
+        }
+        if (p == end)
+                return "invalid JSON";
+        if (!has_name)
+                return "missing name";
+        if (!has_kind)
+                return "missing name kind";
+        if (!has_cases)
+                parse_cases(NULL, 0, rec);
+        return NULL;
+}
+
+static void append_json_string(text_t *out, const char *data, size_t len)
+{
+        static const char hex[] = "0123456789abcdef";
+        text_reserve(out, len * 6 + 2);
+        char *dest = out->data + out->len;
+        *dest++ = '"';
+        for (size_t i = 0; i < len; i++) {
+                unsigned char c = data[i];
+                if (c == '"' || c == '\\') {
+                        *dest++ = '\\';
+                        *dest++ = c;
+                } else if (c < 0x20) {
+                        memcpy(dest, "\\u00", 4);
+                        dest[4] = hex[c >> 4];
+                        dest[5] = hex[c & 0xF];
+                        dest += 6;
+                } else {
+                        *dest++ = c;
+                }
+        }
+        *dest++ = '"';
+        out->len = dest - out->data;
+}
+
+/// Inflect a record and append its forms to the output
+static const char *inflect_record(const record_t *rec, text_t *out)
+{
+        char buf[NAME_BUF_SIZE];
+        size_t offsets[CASE_COUNT + 1];
+        char full_buf[CASE_COUNT][NAME_BUF_SIZE / CASE_COUNT];
+        size_t full_lens[CASE_COUNT];
+        bool full_done[CASE_COUNT] = { false };
+
+        if (rec->kind != KIND_FULL) {
+                if (petr_inflect_all_cases(g_ctx, rec->name, rec->name_len, rec->kind, rec->gender, buf, sizeof(buf),
+                                           offsets) != 0)
+                        return "failed to inflect";
+        }
+        for (size_t i = 0; i < rec->num_cases; i++) {
+                petr_case_t dest_case = rec->cases[i];
+                const char *form;
+                size_t form_len;
+                if (rec->kind == KIND_FULL) {
+                        if (!full_done[dest_case]) {
+                                if (petr_inflect_full_name(g_ctx, rec->name, rec->name_len, ORDER_LAST_FIRST_MIDDLE,
+                                                           rec->gender, dest_case, full_buf[dest_case],
+                                                           sizeof(full_buf[dest_case]), &full_lens[dest_case]) != 0)
+                                        return "failed to inflect";
+                                full_done[dest_case] = true;
+                        }
+                        form = full_buf[dest_case];
+                        form_len = full_lens[dest_case];
+                } else {
+                        form = buf + offsets[dest_case];
+                        form_len = offsets[dest_case + 1] - offsets[dest_case];
+                }
+
+                if (g_format == FORMAT_TSV) {
+                        if (i != 0)
+                                text_append_char(out, '\t');
+                        text_append(out, form, form_len);
+                } else {
+                        text_append_char(out, i == 0 ? '{' : ',');
+                        append_json_string(out, g_case_names[dest_case], strlen(g_case_names[dest_case]));
+                        text_append_char(out, ':');
+                        append_json_string(out, form, form_len);
+                }
+        }
+        if (g_format == FORMAT_NDJSON)
+                text_append(out, rec->num_cases == 0 ? "{}" : "}", rec->num_cases == 0 ? 2 : 1);
+        return NULL;
+}
+
+/// Inflect all records of a job. Failed records produce empty lines (or {"error": ...} objects).
+static void process_job(job_t *job)
+{
+        char name_buf[NAME_BUF_SIZE];
+        const char *p = job->in.data;
+        const char *end = p + job->in.len;
+        job->out.len = 0;
+        job->num_errors = 0;
+        job->num_lines = 0;
+        while (p < end) {
+                const char *nl = memchr(p, '\n', end - p);
+                const char *line_end = nl ? nl : end;
+                size_t len = line_end - p;
+                if (len > 0 && p[len - 1] == '\r')
+                        len--;
+
+                if (len > 0) {
+                        record_t rec;
+                        rec.num_cases = 0;
+                        rec.gender = GEND_UNKNOWN;
+                        size_t out_len = job->out.len;
+                        const char *err = g_format == FORMAT_TSV ? parse_tsv(p, len, &rec)
+                                                                 : parse_ndjson(p, len, name_buf, &rec);
+                        if (err == NULL)
+                                err = inflect_record(&rec, &job->out);
+                        if (err != NULL) {
+                                job->out.len = out_len;
+                                if (g_format == FORMAT_NDJSON) {
+                                        text_append(&job->out, "{\"error\":", 9);
+                                        append_json_string(&job->out, err, strlen(err));
+                                        text_append_char(&job->out, '}');
+                                }
+                                add_error(job, job->num_lines, err);
+                        }
+                }
+                text_append_char(&job->out, '\n');
+                job->num_lines++;
+                p = line_end + 1;
+        }
+}
+
+static void *worker_main(void *arg)
+{
+        (void)arg;
+        pthread_mutex_lock(&g_lock);
+        for (;;) {
+                while (g_take_seq == g_read_seq && !g_stop)
+                        pthread_cond_wait(&g_work_cond, &g_lock);
+                if (g_take_seq == g_read_seq)
+                        break;
+                job_t *job = &g_jobs[g_take_seq++ % g_num_jobs];
+                pthread_mutex_unlock(&g_lock);
+
+                process_job(job);
+
+                pthread_mutex_lock(&g_lock);
+                job->done = true;
+                pthread_cond_signal(&g_main_cond);
+        }
+        pthread_mutex_unlock(&g_lock);
+        return NULL;
+}
+
+/// Read the next chunk of whole lines into the job
+///
+/// @param fd           Input file descriptor
+/// @param job          Job to fill
+/// @param carry        Incomplete line left from the previous chunk, replaced with the one left from this chunk
+/// @param eof          Set once the input is exhausted
+/// @returns            0 on success, -1 on read error
+static int fill_job(int fd, job_t *job, text_t *carry, bool *eof)
+{
+        job->in.len = 0;
+        text_append(&job->in, carry->data, carry->len);
+        carry->len = 0;
+        for (;;) {
+                text_reserve(&job->in, CHUNK_SIZE);
+                size_t scanned = job->in.len;
+                while (job->in.len < job->in.size) {
+                        ssize_t rc = read(fd, job->in.data + job->in.len, job->in.size - job->in.len);
+                        if (rc < 0 && errno == EINTR)
+                                continue;
+                        if (rc < 0)
+                                return -1;
+                        if (rc == 0) {
+                                *eof = true;
+                                return 0;
+                        }
+                        job->in.len += rc;
+                }
+                // Cut the chunk after the last newline
+                const char *start = job->in.data + scanned;
+                for (const char *p = job->in.data + job->in.len; p > start; p--) {
+                        if (p[-1] == '\n') {
+                                size_t cut = p - job->in.data;
+                                text_append(carry, p, job->in.len - cut);
+                                job->in.len = cut;
+                                return 0;
+                        }
+                }
+                // The line does not fit into the chunk, keep reading it
+        }
+}
+
+static int write_all(int fd, const char *data, size_t len)
+{
+        while (len > 0) {
+                ssize_t rc = write(fd, data, len);
+                if (rc < 0 && errno == EINTR)
+                        continue;
+                if (rc < 0)
+                        return -1;
+                data += rc;
+                len -= rc;
+        }
+        return 0;
+}
+
+static void print_usage(void)
+{
+        fprintf(stderr, "Usage: petr_batch [--format tsv|ndjson] [--threads N] [--rules rules.yml] [input]\n"
+                        "    Reads records from the input file (or stdin) and writes one line of forms per record\n"
+                        "    tsv: name <TAB> kind [<TAB> gender [<TAB> cases]]\n"
+                        "    ndjson: {\"name\": ..., \"kind\": ..., \"gender\": ..., \"cases\": ...}\n"
+                        "    kind: first | middle | last | full\n"
+                        "    gender: male | female | androgynous | unknown (default)\n"
+                        "    cases: comma-separated list of nominative, genitive, dative, accusative, instrumental,\n"
+                        "           prepositional (default: all)\n");
+}
+
+int main(int argc, char **argv)
+{
+        long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        const char *rules_path = NULL;
+        const char *input_path = NULL;
+        for (int i = 1; i < argc; i++) {
+                if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+                        i++;
+                        if (strcmp(argv[i], "tsv") == 0) {
+                                g_format = FORMAT_TSV;
+                        } else if (strcmp(argv[i], "ndjson") == 0) {
+                                g_format = FORMAT_NDJSON;
+                        } else {
+                                print_usage();
+                                return 1;
+                        }
+                } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+                        num_threads = strtol(argv[++i], NULL, 10);
+                } else if (strcmp(argv[i], "--rules") == 0 && i + 1 < argc) {
+                        rules_path = argv[++i];
+                } else if (argv[i][0] != '-' && input_path == NULL) {
+                        input_path = argv[i];
+                } else {
+                        print_usage();
+                        return 1;
+                }
+        }
+        if (num_threads < 1) {
+                print_usage();
+                return 1;
+        }
+        if (num_threads > MAX_THREADS)
+                num_threads = MAX_THREADS;
+
+        petr_context_t *loaded_ctx = NULL;
+        g_ctx = petr_default_context();
+        if (rules_path != NULL) {
+                if (petr_init_from_file(rules_path, &loaded_ctx) != 0) {
+                        fprintf(stderr, "Failed to load rules from %s\n", rules_path);
+                        return 1;
+                }
+                g_ctx = loaded_ctx;
+        }
+        if (g_ctx == NULL) {
+                fprintf(stderr, "Library is built without the default rules, use --rules\n");
+                return 1;
+        }
+
+        int fd = STDIN_FILENO;
+        if (input_path != NULL) {
+                fd = open(input_path, O_RDONLY);
+                if (fd < 0) {
+                        fprintf(stderr, "Failed to open %s\n", input_path);
+                        return 1;
+                }
+        }
+
+        g_num_jobs = num_threads * 2;
+        g_jobs = calloc(g_num_jobs, sizeof(job_t));
+        pthread_t threads[MAX_THREADS];
+        if (g_jobs == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                return 1;
+        }
+        for (long i = 0; i < num_threads; i++) {
+                if (pthread_create(&threads[i], NULL, worker_main, NULL) != 0) {
+                        fprintf(stderr, "Failed to start thread\n");
+                        return 1;
+                }
+        }
+
+        text_t carry = { NULL, 0, 0 };
+        bool eof = false;
+        int status = 0;
+        bool write_failed = false;
+        size_t line = 1;
+        pthread_mutex_lock(&g_lock);
+        for (;;) {
+                job_t *job = &g_jobs[g_write_seq % g_num_jobs];
+                if (g_write_seq < g_read_seq && job->done) {
+                        pthread_mutex_unlock(&g_lock);
+                        // Bad records only fail their own lines, the output stops at a write error
+                        if (!write_failed && write_all(STDOUT_FILENO, job->out.data, job->out.len) != 0) {
+                                fprintf(stderr, "Failed to write output\n");
+                                write_failed = true;
+                                status = 1;
+                                eof = true;
+                        }
+                        for (size_t i = 0; i < job->num_errors; i++) {
+                                fprintf(stderr, "line %lu: %s\n", (unsigned long)(line + job->errors[i].line),
+                                        job->errors[i].msg);
+                                status = 1;
+                        }
+                        line += job->num_lines;
+                        pthread_mutex_lock(&g_lock);
+                        job->done = false;
+                        g_write_seq++;
+                } else if (!eof && g_read_seq - g_write_seq < g_num_jobs) {
+                        job = &g_jobs[g_read_seq % g_num_jobs];
+                        pthread_mutex_unlock(&g_lock);
+                        if (fill_job(fd, job, &carry, &eof) != 0) {
+                                fprintf(stderr, "Failed to read input\n");
+                                status = 1;
+                                eof = true;
+                                job->in.len = 0;
+                        }
+                        pthread_mutex_lock(&g_lock);
+                        if (job->in.len > 0) {
+                                g_read_seq++;
+                                pthread_cond_signal(&g_work_cond);
+                        }
+                } else if (eof && g_write_seq == g_read_seq) {
+                        break;
+                } else {
+                        pthread_cond_wait(&g_main_cond, &g_lock);
+                }
+        }
+        g_stop = true;
+        pthread_cond_broadcast(&g_work_cond);
+        pthread_mutex_unlock(&g_lock);
+
+        for (long i = 0; i < num_threads; i++)
+                pthread_join(threads[i], NULL);
+        for (size_t i = 0; i < g_num_jobs; i++) {
+                free(g_jobs[i].in.data);
+                free(g_jobs[i].out.data);
+                free(g_jobs[i].errors);
+        }
+        free(g_jobs);
+        free(carry.data);
+        if (fd != STDIN_FILENO)
+                close(fd);
+        if (loaded_ctx != NULL)
+                petr_free_context(loaded_ctx);
+        return status;
+}
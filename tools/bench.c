@@ -0,0 +1,433 @@
+/// @file bench.c
+///
+/// @copyright Copyright (c) Mail.Ru Group, 2016. All rights reserved. MIT License.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "petrovich.h"
+
+#define ARRAY_SIZE(a)           (sizeof(a) / sizeof((a)[0]))
+#define CASE_COUNT              (CASE_PREPOSITIONAL + 1)
+#define NAME_KIND_COUNT         (NAME_LAST + 1)
+#define MAX_THREADS             64
+#define BATCH_ROWS              4096
+
+// The corpus is generated from the lists below with a fixed seed, so that every run measures the same names
+
+static const char *g_male_first[] = {
+        "Александр", "Алексей", "Андрей", "Антон", "Аркадий", "Борис", "Вадим", "Валентин", "Василий", "Виктор",
+        "Владимир", "Вячеслав", "Геннадий", "Георгий", "Григорий", "Даниил", "Денис", "Дмитрий", "Евгений", "Егор",
+        "Иван", "Игорь", "Илья", "Кирилл", "Константин", "Леонид", "Максим", "Михаил", "Никита", "Николай",
+        "Олег", "Роман", "Руслан", "Сергей", "Станислав", "Степан", "Тимофей", "Фёдор", "Юрий", "Ярослав",
+};
+
+static const char *g_female_first[] = {
+        "Алина", "Алла", "Анастасия", "Анна", "Валентина", "Валерия", "Вера", "Виктория", "Галина", "Дарья",
+        "Евгения", "Екатерина", "Елена", "Елизавета", "Жанна", "Зоя", "Инна", "Ирина", "Кристина", "Ксения",
+        "Лариса", "Лидия", "Любовь", "Людмила", "Маргарита", "Марина", "Мария", "Надежда", "Наталья", "Нина",
+        "Ольга", "Полина", "Раиса", "Светлана", "Софья", "Тамара", "Татьяна", "Ульяна", "Юлия", "Яна",
+};
+
+/// Stems of middle names, followed by male and female endings
+static const struct {
+        const char *stem;
+        const char *male;
+        const char *female;
+} g_middle[] = {
+        { "Александр", "ович", "овна" }, { "Алексе", "евич", "евна" }, { "Андре", "евич", "евна" },
+        { "Борис", "ович", "овна" }, { "Валерь", "евич", "евна" }, { "Васильев", "ич", "на" },
+        { "Викторо", "вич", "вна" }, { "Владимир", "ович", "овна" }, { "Геннадь", "евич", "евна" },
+        { "Дмитри", "евич", "евна" }, { "Евгень", "евич", "евна" }, { "Иван", "ович", "овна" },
+        { "Игор", "евич", "евна" }, { "Ильинич", "", "на" }, { "Константин", "ович", "овна" },
+        { "Михайло", "вич", "вна" }, { "Николае", "вич", "вна" }, { "Олег", "ович", "овна" },
+        { "Павло", "вич", "вна" }, { "Петро", "вич", "вна" }, { "Романо", "вич", "вна" },
+        { "Сергее", "вич", "вна" }, { "Степано", "вич", "вна" }, { "Фомич", "", "на" }, { "Юрь", "евич", "евна" },
+};
+
+static const char *g_last_stems[] = {
+        "Абрам", "Алекс", "Андре", "Баран", "Беля", "Богдан", "Бор", "Васил", "Виногра", "Волк", "Воробь",
+        "Гаври", "Голуб", "Гонча", "Горб", "Греч", "Давыд", "Дмитри", "Евдоким", "Егор", "Жук", "Забол",
+        "Зайц", "Захар", "Иван", "Игнать", "Калин", "Кисел", "Ковал", "Козл", "Комар", "Королё", "Крыл", "Кузнец",
+        "Лебед", "Леон", "Макар", "Медвед", "Мельник", "Миронен", "Мороз", "Никит", "Новик", "Орл", "Осип",
+        "Павл", "Петр", "Полян", "Попов", "Рыб", "Савельч", "Семён", "Сидор", "Смирн", "Сокол", "Степан",
+        "Тимоф", "Устин", "Фёдор", "Филипп", "Харит", "Цвет", "Чернышёв", "Шевел", "Щерб", "Юдин", "Яков",
+};
+
+/// Last name endings by gender (0 - male, 1 - female)
+static const char *g_last_endings[][2] = {
+        { "ов", "ова" }, { "ев", "ева" }, { "ин", "ина" }, { "ский", "ская" }, { "цкий", "цкая" },
+        { "ой", "ая" }, { "енко", "енко" }, { "ук", "ук" }, { "ых", "ых" }, { "ич", "ич" },
+};
+
+/// Names matched by exceptions of the rules
+static const char *g_exc_first[] = { "Лев", "Пётр", "Павел", "Яша", "Шота" };
+static const char *g_exc_last[] = { "Дюма", "Тома", "Гусь", "Ремень", "Камень", "Цой", "Хой", "Бонч-Бруевич" };
+
+/// Names not matched by any rule
+static const char *g_no_match[] = { "Smith", "John", "Müller", "O'Brien", "Nguyen", "Kowalski", "Garcia", "Lee" };
+
+static const char *g_case_names[CASE_COUNT] = {
+        "nominative", "genitive", "dative", "accusative", "instrumental", "prepositional",
+};
+static const char *g_kind_names[NAME_KIND_COUNT] = { "first", "middle", "last" };
+
+/// Column of names of a single kind
+typedef struct {
+        char *data;
+        size_t *offsets;                ///< \c count + 1 offsets of names in \c data
+        petr_gender_t *genders;
+        size_t count;
+        size_t size;                    ///< Allocated size of \c data
+} column_t;
+
+static uint32_t g_seed = 12345;
+
+static uint32_t next_random(void)
+{
+        g_seed = g_seed * 1103515245U + 12345U;
+        return g_seed >> 8;
+}
+
+static void column_init(column_t *col, size_t count)
+{
+        col->size = count * 64;
+        col->data = malloc(col->size);
+        col->offsets = malloc((count + 1) * sizeof(size_t));
+        col->genders = malloc(count * sizeof(petr_gender_t));
+        col->count = 0;
+        col->offsets[0] = 0;
+        if (!col->data || !col->offsets || !col->genders) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+        }
+}
+
+static void column_free(column_t *col)
+{
+        free(col->data);
+        free(col->offsets);
+        free(col->genders);
+}
+
+/// Append a name made of up to 3 pieces
+static void column_add(column_t *col, petr_gender_t gender, const char *p1, const char *p2, const char *p3)
+{
+        size_t off = col->offsets[col->count];
+        const char *pieces[] = { p1, p2, p3 };
+        for (size_t i = 0; i < ARRAY_SIZE(pieces); i++) {
+                size_t len = pieces[i] ? strlen(pieces[i]) : 0;
+                if (off + len > col->size)
+                        return;
+                memcpy(col->data + off, pieces[i], len);
+                off += len;
+        }
+        col->genders[col->count] = gender;
+        col->offsets[++col->count] = off;
+}
+
+#define PICK(arr)       ((arr)[next_random() % ARRAY_SIZE(arr)])
+
+/// Generate the corpus of full names, one column per name kind
+static void generate_corpus(column_t cols[NAME_KIND_COUNT], size_t count)
+{
+        for (int kind = 0; kind < NAME_KIND_COUNT; kind++)
+                column_init(&cols[kind], count);
+        for (size_t i = 0; i < count; i++) {
+                petr_gender_t gender = next_random() % 2 ? GEND_FEMALE : GEND_MALE;
+                bool female = gender == GEND_FEMALE;
+                column_add(&cols[NAME_FIRST], gender, female ? PICK(g_female_first) : PICK(g_male_first), NULL, NULL);
+                unsigned m = next_random() % ARRAY_SIZE(g_middle);
+                column_add(&cols[NAME_MIDDLE], gender, g_middle[m].stem, female ? g_middle[m].female : g_middle[m].male,
+                           NULL);
+                const char *ending = PICK(g_last_endings)[female];
+                if (next_random() % 10 == 0) {
+                        // Hyphenated last name
+                        char first_part[64];
+                        snprintf(first_part, sizeof(first_part), "%s%s-", PICK(g_last_stems), ending);
+                        column_add(&cols[NAME_LAST], gender, first_part, PICK(g_last_stems), ending);
+                } else {
+                        column_add(&cols[NAME_LAST], gender, PICK(g_last_stems), ending, NULL);
+                }
+        }
+}
+
+/// Fill a column by repeating names of a list
+static void generate_list(column_t *col, const char **names, size_t num_names, petr_gender_t gender, size_t count)
+{
+        column_init(col, count);
+        for (size_t i = 0; i < count; i++)
+                column_add(col, gender, names[i % num_names], NULL, NULL);
+}
+
+static double now_ns(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/// Inflect every name of the column, returns elapsed nanoseconds
+static double run_column(const petr_context_t *ctx, const column_t *col, petr_name_kind_t kind, petr_case_t dest_case,
+                         size_t *errors)
+{
+        char buf[512];
+        double start = now_ns();
+        for (size_t i = 0; i < col->count; i++) {
+                size_t len;
+                if (petr_inflect(ctx, col->data + col->offsets[i], col->offsets[i + 1] - col->offsets[i], kind,
+                                 col->genders[i], dest_case, buf, sizeof(buf), &len) != 0)
+                        (*errors)++;
+        }
+        return now_ns() - start;
+}
+
+/// Inflect the column by \c petr_inflect_batch in batches of up to \c batch_rows names, returns elapsed nanoseconds
+static double run_batch(const petr_context_t *ctx, const column_t *col, petr_name_kind_t kind, petr_case_t dest_case,
+                        size_t batch_rows, size_t *errors)
+{
+        size_t dest_size = col->offsets[col->count] * 2 + 64;
+        char *dest = malloc(dest_size);
+        size_t *dest_offsets = malloc((batch_rows + 1) * sizeof(size_t));
+        int *statuses = malloc(batch_rows * sizeof(int));
+        if (!dest || !dest_offsets || !statuses) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+        }
+        double start = now_ns();
+        for (size_t i = 0; i < col->count; i += batch_rows) {
+                size_t count = col->count - i < batch_rows ? col->count - i : batch_rows;
+                if (petr_inflect_batch(ctx, count, col->data, col->offsets + i, kind, col->genders + i, dest_case, dest,
+                                       dest_size, dest_offsets, statuses) != 0)
+                        (*errors)++;
+        }
+        double ns = now_ns() - start;
+        free(dest);
+        free(dest_offsets);
+        free(statuses);
+        return ns;
+}
+
+/// Inflect the whole column on a thread pool
+static int run_parallel(petr_pool_t *pool, const petr_context_t *ctx, const column_t *col, petr_name_kind_t kind,
+                        petr_case_t dest_case)
+{
+        size_t dest_size = col->offsets[col->count] * 2 + 64;
+        char *dest = malloc(dest_size);
+        size_t *dest_offsets = malloc((col->count + 1) * sizeof(size_t));
+        int *statuses = malloc(col->count * sizeof(int));
+        int rc = ERR_NOMEM;
+        if (dest && dest_offsets && statuses)
+                rc = petr_inflect_batch_parallel(pool, ctx, col->count, col->data, col->offsets, kind, col->genders,
+                                                 dest_case, dest, dest_size, dest_offsets, statuses);
+        free(dest);
+        free(dest_offsets);
+        free(statuses);
+        return rc;
+}
+
+/// Single measurement
+typedef struct {
+        char name[64];
+        size_t ops;
+        double ns;
+} result_t;
+
+static result_t g_results[256];
+static size_t g_num_results;
+
+static void add_result(const char *name, size_t ops, double ns)
+{
+        if (g_num_results == ARRAY_SIZE(g_results))
+                return;
+        result_t *res = &g_results[g_num_results++];
+        snprintf(res->name, sizeof(res->name), "%s", name);
+        res->ops = ops;
+        res->ns = ns;
+}
+
+/// Work of one thread in the scaling test
+typedef struct {
+        pthread_t thread;
+        const petr_context_t *ctx;
+        const column_t *cols;
+        size_t errors;
+} worker_t;
+
+static void *worker_main(void *arg)
+{
+        worker_t *worker = arg;
+        for (int kind = 0; kind < NAME_KIND_COUNT; kind++)
+                run_column(worker->ctx, &worker->cols[kind], kind, CASE_GENITIVE, &worker->errors);
+        return NULL;
+}
+
+static void print_usage(void)
+{
+        fprintf(stderr, "Usage: petr_bench [--json] [--names N] [--threads N] [--rules rules.yml]\n"
+                        "    --json: print results as JSON\n"
+                        "    --names: number of generated full names (default 300000)\n"
+                        "    --threads: maximum number of threads in the scaling test (default: number of CPUs)\n"
+                        "    --rules: rules file to load instead of the default rules\n");
+}
+
+int main(int argc, char **argv)
+{
+        bool json = false;
+        size_t num_names = 300000;
+        long max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        const char *rules_path = NULL;
+        for (int i = 1; i < argc; i++) {
+                if (strcmp(argv[i], "--json") == 0) {
+                        json = true;
+                } else if (strcmp(argv[i], "--names") == 0 && i + 1 < argc) {
+                        num_names = strtoul(argv[++i], NULL, 10);
+                } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+                        max_threads = strtol(argv[++i], NULL, 10);
+                } else if (strcmp(argv[i], "--rules") == 0 && i + 1 < argc) {
+                        rules_path = argv[++i];
+                } else {
+                        print_usage();
+                        return 1;
+                }
+        }
+        if (num_names == 0 || max_threads < 1) {
+                print_usage();
+                return 1;
+        }
+        if (max_threads > MAX_THREADS)
+                max_threads = MAX_THREADS;
+
+        petr_context_t *loaded_ctx = NULL;
+        const petr_context_t *ctx = petr_default_context();
+        if (rules_path != NULL) {
+                if (petr_init_from_file(rules_path, &loaded_ctx) != 0) {
+                        fprintf(stderr, "Failed to load rules from %s\n", rules_path);
+                        return 1;
+                }
+                ctx = loaded_ctx;
+        }
+        if (ctx == NULL) {
+                fprintf(stderr, "Library is built without the default rules, use --rules\n");
+                return 1;
+        }
+
+        column_t cols[NAME_KIND_COUNT];
+        generate_corpus(cols, num_names);
+        size_t errors = 0;
+
+        // Every kind and case over the whole corpus
+        for (int kind = 0; kind < NAME_KIND_COUNT; kind++) {
+                for (int dest_case = 0; dest_case < CASE_COUNT; dest_case++) {
+                        char name[64];
+                        snprintf(name, sizeof(name), "%s/%s", g_kind_names[kind], g_case_names[dest_case]);
+                        add_result(name, cols[kind].count, run_column(ctx, &cols[kind], kind, dest_case, &errors));
+                }
+        }
+
+        // Exception hits, suffix hits and names without a match
+        column_t exc_first, exc_last, no_match;
+        generate_list(&exc_first, g_exc_first, ARRAY_SIZE(g_exc_first), GEND_MALE, num_names);
+        generate_list(&exc_last, g_exc_last, ARRAY_SIZE(g_exc_last), GEND_MALE, num_names);
+        generate_list(&no_match, g_no_match, ARRAY_SIZE(g_no_match), GEND_MALE, num_names);
+        add_result("match/exception/first", exc_first.count,
+                   run_column(ctx, &exc_first, NAME_FIRST, CASE_GENITIVE, &errors));
+        add_result("match/exception/last", exc_last.count,
+                   run_column(ctx, &exc_last, NAME_LAST, CASE_GENITIVE, &errors));
+        add_result("match/suffix/first", cols[NAME_FIRST].count,
+                   run_column(ctx, &cols[NAME_FIRST], NAME_FIRST, CASE_GENITIVE, &errors));
+        add_result("match/suffix/last", cols[NAME_LAST].count,
+                   run_column(ctx, &cols[NAME_LAST], NAME_LAST, CASE_GENITIVE, &errors));
+        add_result("match/none/last", no_match.count, run_column(ctx, &no_match, NAME_LAST, CASE_GENITIVE, &errors));
+
+        // The same columns by petr_inflect_batch, to compare with the loops of petr_inflect above
+        for (int kind = 0; kind < NAME_KIND_COUNT; kind++) {
+                char name[64];
+                snprintf(name, sizeof(name), "batch/%s/%d", g_kind_names[kind], BATCH_ROWS);
+                add_result(name, cols[kind].count,
+                           run_batch(ctx, &cols[kind], kind, CASE_GENITIVE, BATCH_ROWS, &errors));
+                snprintf(name, sizeof(name), "batch/%s/all", g_kind_names[kind]);
+                add_result(name, cols[kind].count,
+                           run_batch(ctx, &cols[kind], kind, CASE_GENITIVE, cols[kind].count, &errors));
+        }
+        add_result("batch/exception/last", exc_last.count,
+                   run_batch(ctx, &exc_last, NAME_LAST, CASE_GENITIVE, BATCH_ROWS, &errors));
+        column_free(&exc_first);
+        column_free(&exc_last);
+        column_free(&no_match);
+
+        // Scaling across threads, each one inflects the whole corpus
+        for (long num_threads = 1; num_threads <= max_threads;) {
+                worker_t workers[MAX_THREADS];
+                double start = now_ns();
+                for (long i = 0; i < num_threads; i++) {
+                        workers[i].ctx = ctx;
+                        workers[i].cols = cols;
+                        workers[i].errors = 0;
+                        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+                                fprintf(stderr, "Failed to start thread\n");
+                                return 1;
+                        }
+                }
+                for (long i = 0; i < num_threads; i++) {
+                        pthread_join(workers[i].thread, NULL);
+                        errors += workers[i].errors;
+                }
+                char name[64];
+                snprintf(name, sizeof(name), "threads/%ld", num_threads);
+                add_result(name, num_threads * NAME_KIND_COUNT * num_names, now_ns() - start);
+
+                // The same corpus split across a pool by petr_inflect_batch_parallel
+                petr_pool_t *pool;
+                if (petr_pool_create(num_threads, &pool) != 0) {
+                        fprintf(stderr, "Failed to create thread pool\n");
+                        return 1;
+                }
+                start = now_ns();
+                for (int kind = 0; kind < NAME_KIND_COUNT; kind++)
+                        errors += run_parallel(pool, ctx, &cols[kind], kind, CASE_GENITIVE) != 0;
+                snprintf(name, sizeof(name), "pool/%ld", num_threads);
+                add_result(name, NAME_KIND_COUNT * num_names, now_ns() - start);
+                petr_pool_free(pool);
+
+                // Powers of 2, then the maximum
+                if (num_threads == max_threads)
+                        break;
+                num_threads = num_threads * 2 < max_threads ? num_threads * 2 : max_threads;
+        }
+
+        if (json) {
+                printf("{\n  \"names\": %lu,\n  \"errors\": %lu,\n  \"results\": [\n", (unsigned long)num_names,
+                       (unsigned long)errors);
+                for (size_t i = 0; i < g_num_results; i++) {
+                        const result_t *res = &g_results[i];
+                        printf("    { \"name\": \"%s\", \"ops\": %lu, \"ns_per_op\": %.2f, \"ops_per_sec\": %.0f }%s\n",
+                               res->name, (unsigned long)res->ops, res->ns / res->ops, res->ops * 1e9 / res->ns,
+                               i + 1 == g_num_results ? "" : ",");
+                }
+                printf("  ]\n}\n");
+        } else {
+                printf("%-28s %12s %12s %14s\n", "benchmark", "ops", "ns/op", "ops/s");
+                for (size_t i = 0; i < g_num_results; i++) {
+                        const result_t *res = &g_results[i];
+                        printf("%-28s %12lu %12.2f %14.0f\n", res->name, (unsigned long)res->ops, res->ns / res->ops,
+                               res->ops * 1e9 / res->ns);
+                }
+                if (errors != 0)
+                        printf("%lu errors\n", (unsigned long)errors);
+        }
+
+        for (int kind = 0; kind < NAME_KIND_COUNT; kind++)
+                column_free(&cols[kind]);
+        if (loaded_ctx != NULL)
+                petr_free_context(loaded_ctx);
+        return errors != 0;
+}
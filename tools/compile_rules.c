@@ -0,0 +1,84 @@
+/// @file compile_rules.c
+///
+/// @copyright Copyright (c) Mail.Ru Group, 2016. All rights reserved. MIT License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "petrovich.h"
+
+static void print_usage(void)
+{
+        fprintf(stderr, "Usage: petr_compile_rules [--c-source] <rules.yml> <output>\n"
+                        "    Compile rules into a file loadable with petr_init_from_mmap\n"
+                        "    --c-source: write C source with static tables instead\n");
+}
+
+/// Read the whole file into a heap buffer
+static char *read_file(const char *path, size_t *len)
+{
+        FILE *fp = fopen(path, "rb");
+        if (fp == NULL)
+                return NULL;
+        char *data = NULL;
+        long size;
+        if (fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) >= 0 && fseek(fp, 0, SEEK_SET) == 0) {
+                data = malloc(size + 1);
+                if (data != NULL && fread(data, 1, size, fp) != (size_t)size) {
+                        free(data);
+                        data = NULL;
+                }
+                *len = size;
+        }
+        fclose(fp);
+        return data;
+}
+
+int main(int argc, char **argv)
+{
+        bool c_source = argc > 1 && strcmp(argv[1], "--c-source") == 0;
+        if (c_source) {
+                argc--;
+                argv++;
+        }
+        if (argc != 3) {
+                fprintf(stderr, "Invalid number of arguments\n");
+                print_usage();
+                return 1;
+        }
+
+        size_t len;
+        char *data = read_file(argv[1], &len);
+        if (data == NULL) {
+                fprintf(stderr, "Failed to read %s\n", argv[1]);
+                return 1;
+        }
+        petr_context_t *ctx;
+        petr_rules_error_t error;
+        int rc = petr_init_from_string_with_error(data, len, NULL, &error, &ctx);
+        free(data);
+        if (rc == ERR_INVALID_RULES) {
+                if (error.line != 0)
+                        fprintf(stderr, "%s, line %u, column %u: %s\n", argv[1], error.line, error.column,
+                                error.message);
+                else
+                        fprintf(stderr, "%s: %s\n", argv[1], error.message);
+                return 1;
+        }
+        if (rc != 0) {
+                fprintf(stderr, "Failed to read the rules\n");
+                return 1;
+        }
+        if (c_source)
+                rc = petr_save_compiled_source(ctx, argv[2]);
+        else
+                rc = petr_save_compiled(ctx, argv[2]);
+        petr_free_context(ctx);
+        if (rc != 0) {
+                fprintf(stderr, "Failed to write compiled rules\n");
+                return 1;
+        }
+        return 0;
+}
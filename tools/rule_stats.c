@@ -0,0 +1,270 @@
+/// @file rule_stats.c
+///
+/// @copyright Copyright (c) Mail.Ru Group, 2016. All rights reserved. MIT License.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "petrovich.h"
+
+#define NAME_KIND_COUNT         (NAME_LAST + 1)
+#define GENDER_COUNT            (GEND_UNKNOWN + 1)
+#define MATCH_KIND_COUNT        (MATCH_SUFFIX + 1)
+#define MAX_PARTS               16
+
+static const char *g_kind_names[NAME_KIND_COUNT] = { "first", "middle", "last" };
+static const char *g_gender_names[GENDER_COUNT] = { "male", "female", "androgynous", "unknown" };
+static const char *g_match_names[MATCH_KIND_COUNT] = { "none", "exception", "suffix" };
+
+/// Hits of the rules of one kind of match, by rule index
+typedef struct {
+        uint64_t *hits;
+        const char **tests;
+        size_t *test_lens;
+        size_t size;
+} counters_t;
+
+/// Line of the report
+typedef struct {
+        int kind;
+        int match_kind;
+        int gender;
+        unsigned rule;
+        const char *test;
+        size_t test_len;
+        uint64_t hits;
+} stat_t;
+
+static counters_t g_counters[NAME_KIND_COUNT][MATCH_KIND_COUNT][GENDER_COUNT];
+
+static void count_match(int kind, const petr_rule_match_t *match)
+{
+        counters_t *counters = &g_counters[kind][match->kind][match->gender];
+        unsigned rule = match->kind == MATCH_NONE ? 0 : match->rule;
+        if (rule >= counters->size) {
+                size_t size = counters->size ? counters->size : 64;
+                while (size <= rule)
+                        size *= 2;
+                counters->hits = realloc(counters->hits, size * sizeof(uint64_t));
+                counters->tests = realloc(counters->tests, size * sizeof(const char *));
+                counters->test_lens = realloc(counters->test_lens, size * sizeof(size_t));
+                if (!counters->hits || !counters->tests || !counters->test_lens) {
+                        fprintf(stderr, "Out of memory\n");
+                        exit(1);
+                }
+                memset(counters->hits + counters->size, 0, (size - counters->size) * sizeof(uint64_t));
+                counters->size = size;
+        }
+        if (counters->hits[rule]++ == 0) {
+                counters->tests[rule] = match->test;
+                counters->test_lens[rule] = match->test_len;
+        }
+}
+
+static int cmp_stats(const void *p1, const void *p2)
+{
+        const stat_t *s1 = p1;
+        const stat_t *s2 = p2;
+        if (s1->kind != s2->kind)
+                return s1->kind - s2->kind;
+        if (s1->hits != s2->hits)
+                return s1->hits > s2->hits ? -1 : 1;
+        if (s1->match_kind != s2->match_kind)
+                return s1->match_kind - s2->match_kind;
+        return s1->rule < s2->rule ? -1 : s1->rule > s2->rule;
+}
+
+static bool parse_kind(const char *str, int *kind)
+{
+        for (int i = 0; i < NAME_KIND_COUNT; i++) {
+                if (strcmp(str, g_kind_names[i]) == 0) {
+                        *kind = i;
+                        return true;
+                }
+        }
+        return false;
+}
+
+static bool parse_gender(const char *str, petr_gender_t *gender)
+{
+        if (*str == '\0') {
+                *gender = GEND_UNKNOWN;
+                return true;
+        }
+        for (int i = 0; i < GENDER_COUNT; i++) {
+                if (strcmp(str, g_gender_names[i]) == 0) {
+                        *gender = i;
+                        return true;
+                }
+        }
+        return false;
+}
+
+static void print_usage(void)
+{
+        fprintf(stderr, "Usage: petr_rule_stats [--rules rules.yml] [--top N] [corpus]\n"
+                        "    Replays a corpus of names and reports how often each rule fires\n"
+                        "    corpus: lines of name <TAB> kind [<TAB> gender], read from stdin if omitted\n"
+                        "        further fields of a line are ignored\n"
+                        "    kind: first | middle | last\n"
+                        "    gender: male | female | androgynous | unknown (default)\n"
+                        "    --top: number of rules listed per name kind (default 20)\n");
+}
+
+int main(int argc, char **argv)
+{
+        const char *rules_path = NULL;
+        const char *corpus_path = NULL;
+        size_t top = 20;
+        for (int i = 1; i < argc; i++) {
+                if (strcmp(argv[i], "--rules") == 0 && i + 1 < argc) {
+                        rules_path = argv[++i];
+                } else if (strcmp(argv[i], "--top") == 0 && i + 1 < argc) {
+                        top = strtoul(argv[++i], NULL, 10);
+                } else if (argv[i][0] != '-' && corpus_path == NULL) {
+                        corpus_path = argv[i];
+                } else {
+                        print_usage();
+                        return 1;
+                }
+        }
+
+        petr_context_t *loaded_ctx = NULL;
+        const petr_context_t *ctx = petr_default_context();
+        if (rules_path != NULL) {
+                if (petr_init_from_file(rules_path, &loaded_ctx) != 0) {
+                        fprintf(stderr, "Failed to load rules from %s\n", rules_path);
+                        return 1;
+                }
+                ctx = loaded_ctx;
+        }
+        if (ctx == NULL) {
+                fprintf(stderr, "Library is built without the default rules, use --rules\n");
+                return 1;
+        }
+        FILE *fp = stdin;
+        if (corpus_path != NULL) {
+                fp = fopen(corpus_path, "r");
+                if (fp == NULL) {
+                        fprintf(stderr, "Failed to open %s\n", corpus_path);
+                        return 1;
+                }
+        }
+
+        uint64_t parts[NAME_KIND_COUNT] = { 0 };
+        uint64_t line_no = 0, errors = 0;
+        char *line = NULL;
+        size_t line_size = 0;
+        ssize_t len;
+        while ((len = getline(&line, &line_size, fp)) >= 0) {
+                line_no++;
+                while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+                        line[--len] = '\0';
+                if (len == 0)
+                        continue;
+                char *kind_str = strchr(line, '\t');
+                char *gender_str = kind_str ? strchr(kind_str + 1, '\t') : NULL;
+                if (kind_str)
+                        *kind_str++ = '\0';
+                if (gender_str) {
+                        *gender_str++ = '\0';
+                        char *rest = strchr(gender_str, '\t');
+                        if (rest)
+                                *rest = '\0';
+                }
+                int kind;
+                petr_gender_t gender;
+                if (kind_str == NULL || !parse_kind(kind_str, &kind) || !parse_gender(gender_str ? gender_str : "",
+                                                                                    &gender)) {
+                        fprintf(stderr, "line %lu: invalid record\n", (unsigned long)line_no);
+                        errors++;
+                        continue;
+                }
+
+                petr_rule_match_t matches[MAX_PARTS];
+                size_t num_matches;
+                if (petr_match_rules(ctx, line, strlen(line), kind, gender, matches, MAX_PARTS, &num_matches) != 0) {
+                        fprintf(stderr, "line %lu: too many parts\n", (unsigned long)line_no);
+                        errors++;
+                        continue;
+                }
+                for (size_t i = 0; i < num_matches; i++)
+                        count_match(kind, &matches[i]);
+                parts[kind] += num_matches;
+        }
+        free(line);
+        if (fp != stdin)
+                fclose(fp);
+
+        size_t num_stats = 0;
+        for (int kind = 0; kind < NAME_KIND_COUNT; kind++)
+                for (int m = 0; m < MATCH_KIND_COUNT; m++)
+                        for (int g = 0; g < GENDER_COUNT; g++)
+                                num_stats += g_counters[kind][m][g].size;
+        stat_t *stats = calloc(num_stats + 1, sizeof(stat_t));
+        if (stats == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                return 1;
+        }
+        num_stats = 0;
+        for (int kind = 0; kind < NAME_KIND_COUNT; kind++) {
+                for (int m = 0; m < MATCH_KIND_COUNT; m++) {
+                        for (int g = 0; g < GENDER_COUNT; g++) {
+                                counters_t *counters = &g_counters[kind][m][g];
+                                for (size_t rule = 0; rule < counters->size; rule++) {
+                                        if (counters->hits[rule] == 0)
+                                                continue;
+                                        stat_t stat = { kind, m, g, rule, counters->tests[rule],
+                                                        counters->test_lens[rule], counters->hits[rule] };
+                                        stats[num_stats++] = stat;
+                                }
+                        }
+                }
+        }
+        qsort(stats, num_stats, sizeof(stat_t), cmp_stats);
+
+        size_t pos = 0;
+        for (int kind = 0; kind < NAME_KIND_COUNT; kind++) {
+                uint64_t by_match[MATCH_KIND_COUNT] = { 0 };
+                size_t begin = pos;
+                for (; pos < num_stats && stats[pos].kind == kind; pos++)
+                        by_match[stats[pos].match_kind] += stats[pos].hits;
+                if (parts[kind] == 0)
+                        continue;
+                double total = parts[kind];
+                printf("%s names: %lu parts, %.1f%% exceptions, %.1f%% suffixes, %.1f%% not matched\n",
+                       g_kind_names[kind], (unsigned long)parts[kind], by_match[MATCH_EXCEPTION] * 100 / total,
+                       by_match[MATCH_SUFFIX] * 100 / total, by_match[MATCH_NONE] * 100 / total);
+                printf("  %12s %7s  %-9s %5s  %-11s %s\n", "hits", "share", "match", "rule", "gender", "test");
+                for (size_t i = begin; i < pos && i - begin < top; i++) {
+                        const stat_t *stat = &stats[i];
+                        printf("  %12lu %6.2f%%  %-9s ", (unsigned long)stat->hits, stat->hits * 100 / total,
+                               g_match_names[stat->match_kind]);
+                        if (stat->match_kind == MATCH_NONE)
+                                printf("%5s  ", "-");
+                        else
+                                printf("%5u  ", stat->rule);
+                        printf("%-11s %.*s\n", g_gender_names[stat->gender], (int)stat->test_len,
+                               stat->test ? stat->test : "");
+                }
+        }
+
+        free(stats);
+        for (int kind = 0; kind < NAME_KIND_COUNT; kind++) {
+                for (int m = 0; m < MATCH_KIND_COUNT; m++) {
+                        for (int g = 0; g < GENDER_COUNT; g++) {
+                                free(g_counters[kind][m][g].hits);
+                                free(g_counters[kind][m][g].tests);
+                                free(g_counters[kind][m][g].test_lens);
+                        }
+                }
+        }
+        if (loaded_ctx != NULL)
+                petr_free_context(loaded_ctx);
+        return errors != 0;
+}